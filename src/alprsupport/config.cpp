@@ -68,6 +68,28 @@ Config::Config(const string country, const string config_file, const string runt
   hardware_acceleration = ALPRCONFIG_CPU;
   gpu_id = 0;
   gpu_batch_size = 1;
+  ocr_preprocess_threads = base.get_int("ocr_preprocess_threads", 1);
+  ocr_max_concurrency = base.get_int("ocr_max_concurrency", 0);
+  ocr_batch_buckets = base.get_string("ocr_batch_buckets", "");
+  ocr_warmup = base.get_boolean("ocr_warmup", true);
+  ocr_huge_pages = base.get_boolean("ocr_huge_pages", false);
+  ocr_numa_local = base.get_boolean("ocr_numa_local", false);
+  ocr_intra_op_threads = base.get_int("ocr_intra_op_threads", 1);
+  ocr_inter_op_threads = base.get_int("ocr_inter_op_threads", 1);
+  ocr_parallel_execution = base.get_boolean("ocr_parallel_execution", false);
+  ocr_thread_spinning = base.get_boolean("ocr_thread_spinning", true);
+  ocr_thread_affinity = base.get_string("ocr_thread_affinity", "");
+  ocr_global_thread_pool = base.get_boolean("ocr_global_thread_pool", false);
+  ocr_omp_num_threads = base.get_int("ocr_omp_num_threads", 0);
+  ocr_omp_wait_policy = base.get_string("ocr_omp_wait_policy", "");
+  ocr_pipeline = base.get_boolean("ocr_pipeline", false);
+  ocr_model_variant = base.get_string("ocr_model_variant", "");
+  ocr_cache_size = base.get_int("ocr_cache_size", 0);
+  ocr_cache_ttl_ms = base.get_int("ocr_cache_ttl_ms", 2000);
+  ocr_cache_max_hamming = base.get_int("ocr_cache_max_hamming", 2);
+  ocr_cache_geometry_cell = base.get_int("ocr_cache_geometry_cell", 16);
+  ocr_beam_width = base.get_int("ocr_beam_width", 0);
+  ocr_beam_candidates = base.get_int("ocr_beam_candidates", 5);
 
   postProcessMinConfidence = base.get_float("postprocess_min_confidence", 100);
   postProcessConfidenceSkipLevel = base.get_float("postprocess_confidence_skip_level", 100);
@@ -141,6 +163,10 @@ string Config::getOCRPrefix() const {
   return ocr_runtime_dir;
 }
 
+string Config::getOCRLanguageDir() const {
+  return ocr_runtime_dir + ocrLanguage;
+}
+
 string Config::getConfigFilePath() const {
   return config_file_path;
 }
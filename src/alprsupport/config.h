@@ -87,6 +87,47 @@ class OPENALPRSUPPORT_DLL_EXPORT Config {
     int gpu_id;
     int gpu_batch_size;
 
+    // Threads used to warp/convert OCR crops before inference (1 = serial, 0 = one per core)
+    int ocr_preprocess_threads;
+    // Concurrent recognize_batch callers served by one Ocr (each gets its own scratch tensors, 0 = one per core)
+    int ocr_max_concurrency;
+    // Batch sizes sent to the OCR network: "exact", "clamp", "pow2" or a list such as "1,4,16" (empty = clamp on
+    // GPU, exact on CPU).  Each new batch shape is slow the first time it runs.
+    string ocr_batch_buckets;
+    // Run every bucket once at startup so the first real plates don't pay for it
+    bool ocr_warmup;
+    // Place OCR input tensors on transparent huge pages / on the NUMA node of the thread that first uses them
+    bool ocr_huge_pages;
+    bool ocr_numa_local;
+    // ONNX runtime threading for the OCR session (see OrtThreadingConfig).  Many single-threaded concurrent
+    // callers suit throughput; more intra-op threads suit single-plate latency.
+    int ocr_intra_op_threads;
+    int ocr_inter_op_threads;
+    bool ocr_parallel_execution;
+    bool ocr_thread_spinning;
+    string ocr_thread_affinity;
+    bool ocr_global_thread_pool;
+    // OMP_NUM_THREADS / OMP_WAIT_POLICY for OpenMP builds of ONNX runtime (0 / empty = leave the environment alone)
+    int ocr_omp_num_threads;
+    string ocr_omp_wait_policy;
+    // Overlap preprocessing, inference and decoding of the sub-batches of batches larger than the OCR max batch
+    // (CPU only)
+    bool ocr_pipeline;
+    // Loads ocr_x_<variant> instead of ocr_x (e.g. "int8" for the statically quantized model)
+    string ocr_model_variant;
+    // Result cache for repeated crops in video (0 entries = off).  A crop is a hit when a cached one from the same
+    // source within a geometry cell (pixels) of it differs in at most max_hamming of its 64 hash bits and is under
+    // ttl_ms old.  Each extra bit of max_hamming makes a different plate in the same spot likelier to match.
+    int ocr_cache_size;
+    int ocr_cache_ttl_ms;
+    int ocr_cache_max_hamming;
+    int ocr_cache_geometry_cell;
+    // Beam search over the top-k characters of every timestep (0 = off, top-1 only).  It keeps ocr_beam_width
+    // partial plates, follows the country's templates for the plate's region and returns the best
+    // ocr_beam_candidates whole plates.
+    int ocr_beam_width;
+    int ocr_beam_candidates;
+
     dims_t ocrSize;
 
     string detectorLanguage;
@@ -119,6 +160,8 @@ class OPENALPRSUPPORT_DLL_EXPORT Config {
 
     string getPostProcessRuntimeDir() const;
     string getOCRPrefix() const;
+    // getOCRPrefix() + ocrLanguage: ocr_config.json (or runtime.bundle) and the ocr_x models
+    string getOCRLanguageDir() const;
     string getConfigFilePath() const;
     string getRuntimeBaseDir() const;
 
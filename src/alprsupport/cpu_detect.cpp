@@ -405,6 +405,14 @@ int has_sse(cpu_info_t * info) {
 int has_avx(cpu_info_t * info) {
     return info->supports_avx;
 }
+
+int has_avx2(cpu_info_t * info) {
+    return info->supports_avx2;
+}
+
+int has_neon(cpu_info_t * info) {
+    return false;
+}
 int collect_info(cpu_info_t *info)
 {
     cpu_classifiers_t cpu_classifiers;
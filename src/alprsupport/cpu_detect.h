@@ -52,12 +52,15 @@ namespace alprsupport
     int has_sse4_1, has_sse4_2;
     int has_reg7;  /* True if cpuid supports cpuid(7) */
     int supports_avx, supports_avx2;
+    int has_neon;
   } cpu_info_t;
 
   int collect_info(cpu_info_t *info);
 
   OPENALPRSUPPORT_DLL_EXPORT int has_avx(cpu_info_t * info);
+  OPENALPRSUPPORT_DLL_EXPORT int has_avx2(cpu_info_t * info);
   OPENALPRSUPPORT_DLL_EXPORT int has_sse(cpu_info_t * info);
+  OPENALPRSUPPORT_DLL_EXPORT int has_neon(cpu_info_t * info);
   OPENALPRSUPPORT_DLL_EXPORT cpu_info_t * cpu_detect(void);
 }
 
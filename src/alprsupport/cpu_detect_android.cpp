@@ -17,6 +17,14 @@ namespace alprsupport {
     return info->supports_avx;
   }
 
+  int has_avx2(cpu_info_t* info) {
+    return info->supports_avx2;
+  }
+
+  int has_neon(cpu_info_t* info) {
+    return info->has_neon;
+  }
+
   cpu_info_t* cpu_detect() {
     cpu_info_t * info = (cpu_info_t *)malloc(sizeof(cpu_info_t));
     if (!info) {
@@ -33,6 +41,8 @@ namespace alprsupport {
     info->has_sse4_2 = HAS_FEATURE(features, ANDROID_CPU_X86_FEATURE_SSE4_2);
     info->supports_avx = HAS_FEATURE(features, ANDROID_CPU_X86_FEATURE_AVX);
     info->supports_avx2 = HAS_FEATURE(features, ANDROID_CPU_X86_FEATURE_AVX2);
+    info->has_neon = family == ANDROID_CPU_FAMILY_ARM64 ||
+        (family == ANDROID_CPU_FAMILY_ARM && HAS_FEATURE(features, ANDROID_CPU_ARM_FEATURE_NEON));
 
     return info;
   }
@@ -3,7 +3,14 @@
 namespace alprsupport {
 
 int has_avx(cpu_info_t * info) { return false; }
+int has_avx2(cpu_info_t * info) { return false; }
 int has_sse(cpu_info_t * info) { return false; }
-cpu_info_t * cpu_detect(void) {}
+// NEON is part of the aarch64 baseline; 32-bit builds only have it when compiled with -mfpu=neon
+#if defined(__aarch64__) || defined(__ARM_NEON)
+int has_neon(cpu_info_t * info) { return true; }
+#else
+int has_neon(cpu_info_t * info) { return false; }
+#endif
+cpu_info_t * cpu_detect(void) { return NULL; }
 
 };
\ No newline at end of file
@@ -3,7 +3,10 @@
 #include <sstream>
 #include <iostream>
 #include <fstream>
+#include <vector>
 #include "filecryptstream.h"
+#include "salsa20.h"
+#include "../timing.h"
 #include "../tclap/CmdLine.h"
 #include "../filesystem.h"
 
@@ -19,6 +22,7 @@ int main( int argc, const char** argv )
   
   TCLAP::ValueArg<std::string> inputFileArg("i","input_file","Input file to enc/dec",true, "" ,"input_file");
   TCLAP::ValueArg<std::string> keyArg("k","key","Key used for decryption (e.g., ocr, edge, etc). ", true, "" ,"key");
+  TCLAP::SwitchArg benchmarkSwitch("","benchmark","Time every Salsa20 implementation this CPU supports on the input file and check that they agree.", cmd, false);
 
   std::string output_filename;
   std::string input_filename;
@@ -49,33 +53,10 @@ int main( int argc, const char** argv )
 
   uint8_t key[32];
   uint8_t iv[8];
-  if (keystr == "edge")
-  {
-    for (unsigned int i = 0; i < 32; i++)
-      key[i] = (i % 5) * (3 % (i + 2)) * (i % 5) + i;
-
-    for (unsigned int i = 0; i < 8; i++)
-      iv[i] = (i % 7) * (7 % (i + 5)) * ((i % 4) + i) + i;
-  }
-  else if (keystr == "ocr")
-  {
-    for (unsigned int i = 0; i < 32; i++)
-      key[i] = (i % 5) * (2 % (i + 3)) * (i % 6) + i;
-
-    for (unsigned int i = 0; i < 8; i++)
-      iv[i] = (i % 6) * (3 % (i + 9)) * ((i % 3) + i) + i;
-  }
-  else if (keystr == "classifier")
-  {
-    for (unsigned int i = 0; i < 32; i++)
-      key[i] = (i % 5) * (3 % (i + 2)) * (i % 5) + i;
-
-    for (unsigned int i = 0; i < 8; i++)
-      iv[i] = (i % 7) * (7 % (i + 5)) * ((i % 4) + i) + i;
-  }
-  else
+  if (!alprsupport::FileCryptStream::key_for_name(keystr, key, iv))
   {
     std::cout << "Invalid key type (" << keystr << ") options are: edge, ocr, classifier" << std::endl;
+    return 1;
   }
 
 //  if (!alprsupport::fileExists(input_filename.c_str()))
@@ -90,6 +71,32 @@ int main( int argc, const char** argv )
   std::string str((std::istreambuf_iterator<char>(t)),
                   std::istreambuf_iterator<char>());
 
+  if (benchmarkSwitch.getValue())
+  {
+    std::vector<uint8_t> reference;
+    const s20_impl_t impls[] = { S20_IMPL_SCALAR, S20_IMPL_SSE2, S20_IMPL_AVX2, S20_IMPL_NEON };
+    for (unsigned int i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)
+    {
+      if (!s20_impl_available(impls[i]))
+        continue;
+
+      std::vector<uint8_t> data(str.begin(), str.end());
+      timespec startTime, endTime;
+      alprsupport::getTimeMonotonic(&startTime);
+      s20_crypt_impl(impls[i], key, S20_KEYLEN_256, iv, 0, data.data(), data.size());
+      alprsupport::getTimeMonotonic(&endTime);
+      double ms = alprsupport::diffclock(startTime, endTime);
+      double mb = data.size() / (1024.0 * 1024.0);
+
+      if (impls[i] == S20_IMPL_SCALAR)
+        reference = data;
+      bool matches = data == reference;
+      std::cout << s20_impl_name(impls[i]) << ": " << ms << " ms, " << (ms > 0 ? mb * 1000.0 / ms : 0.0) << " MB/s"
+                << (matches ? "" : " (OUTPUT DIFFERS FROM SCALAR)") << std::endl;
+    }
+    std::cout << "Default: " << s20_impl_name(s20_best_impl()) << std::endl;
+  }
+
   string encrypted = crypt.encrypt_decrypt(str);
 
   std::ofstream out(output_filename.c_str(), std::ios::binary);
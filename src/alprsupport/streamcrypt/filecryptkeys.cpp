@@ -0,0 +1,44 @@
+ /*************************************************************************
+ * OPENALPR CONFIDENTIAL
+ * 
+ *  Copyright 2018 OpenALPR Technology, Inc.
+ *  All Rights Reserved.
+ * 
+ * NOTICE:  All information contained herein is, and remains
+ * the property of OpenALPR Technology Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to OpenALPR  
+ * Technology Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from OpenALPR Technology Incorporated.
+ */
+
+#include "filecryptstream.h"
+
+// Shared by the Salsa20 (library) and Crypto++ (encdecfile) builds of FileCryptStream
+namespace alprsupport
+{
+  OPENALPRSUPPORT_DLL_EXPORT bool FileCryptStream::key_for_name(const std::string& name, uint8_t key[32], uint8_t iv[8])
+  {
+    if (name == "edge" || name == "classifier")
+    {
+      for (unsigned int i = 0; i < 32; i++)
+        key[i] = (i % 5) * (3 % (i + 2)) * (i % 5) + i;
+
+      for (unsigned int i = 0; i < 8; i++)
+        iv[i] = (i % 7) * (7 % (i + 5)) * ((i % 4) + i) + i;
+      return true;
+    }
+    else if (name == "ocr")
+    {
+      for (unsigned int i = 0; i < 32; i++)
+        key[i] = (i % 5) * (2 % (i + 3)) * (i % 6) + i;
+
+      for (unsigned int i = 0; i < 8; i++)
+        iv[i] = (i % 6) * (3 % (i + 9)) * ((i % 3) + i) + i;
+      return true;
+    }
+    return false;
+  }
+}
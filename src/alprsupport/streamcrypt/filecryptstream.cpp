@@ -17,6 +17,7 @@
 #include "filecryptstream.h"
 #include "filecryptstream_c.h"
 
+#include <algorithm>
 #include <iterator>
 #include <stdio.h>
 #include <memory.h>
@@ -100,6 +101,25 @@ namespace alprsupport
     
   }
 
+  OPENALPRSUPPORT_DLL_EXPORT bool FileCryptStream::encrypt_decrypt_stream(std::istream& in, char* out, size_t size,
+                                                                      size_t chunk_size)
+  {
+    // The keystream is generated in 64 byte blocks; whole blocks per chunk avoid recomputing one at each boundary
+    chunk_size = std::max<size_t>(64, chunk_size - chunk_size % 64);
+    for (size_t offset = 0; offset < size; offset += chunk_size)
+    {
+      size_t len = std::min(chunk_size, size - offset);
+      if (!in.read(out + offset, len))
+        return false;
+
+      // The stream index is the byte offset, so each chunk picks the keystream up where the last one stopped
+      s20_status_t success = s20_crypt(key, S20_KEYLEN_256, iv, offset, (uint8_t*) out + offset, len);
+      if (success != S20_SUCCESS)
+        return false;
+    }
+    return true;
+  }
+
   OPENALPRSUPPORT_DLL_EXPORT char* FileCryptStream::encrypt_decrypt_c(const char* data, size_t size)
   {
     char* convertedBytes = (char*) malloc(size);
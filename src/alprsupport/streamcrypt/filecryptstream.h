@@ -21,6 +21,14 @@ namespace alprsupport
     OPENALPRSUPPORT_DLL_EXPORT std::vector<char> encrypt_decrypt_vec(std::string filename);
     OPENALPRSUPPORT_DLL_EXPORT std::vector<char> encrypt_decrypt_vec(std::vector<unsigned char> data);
 
+    // Read `size' bytes from `in' into `out' a chunk at a time, decrypting each chunk in place as it arrives.
+    // Nothing but `out' ever holds the data.  Returns false on a short read.
+    OPENALPRSUPPORT_DLL_EXPORT bool encrypt_decrypt_stream(std::istream& in, char* out, size_t size,
+                                                           size_t chunk_size = 4 * 1024 * 1024);
+
+    // Key and IV for a named runtime data key (edge, ocr, classifier).  Returns false for an unknown name.
+    OPENALPRSUPPORT_DLL_EXPORT static bool key_for_name(const std::string& name, uint8_t key[32], uint8_t iv[8]);
+
   private:
 
     // Used for Cryptopp version
@@ -1,6 +1,19 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include "salsa20.h"
+#include "../cpu_detect.h"
+
+// The wide kernels use GCC/clang vector extensions, so one body serves SSE2, AVX2 and NEON
+#if defined(__GNUC__) || defined(__clang__)
+#if defined(__x86_64__) || defined(__i386__)
+#define S20_HAVE_SSE2
+#define S20_HAVE_AVX2
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#define S20_HAVE_NEON
+#endif
+#endif
 
 // Implements DJB's definition of '<<<'
 static inline uint32_t rotl(uint32_t value, int shift)
@@ -16,6 +29,16 @@ static inline void s20_quarterround(uint32_t *y0, uint32_t *y1, uint32_t *y2, ui
   *y0 = *y0 ^ rotl(*y3 + *y2, 18);
 }
 
+// Same quarterround on GCC vectors, one Salsa20 block per lane
+#define S20_ROTL_V(v, shift) (((v) << (shift)) | ((v) >> (32 - (shift))))
+#define S20_QUARTERROUND_V(y0, y1, y2, y3) \
+  do { \
+    (y1) ^= S20_ROTL_V((y0) + (y3), 7); \
+    (y2) ^= S20_ROTL_V((y1) + (y0), 9); \
+    (y3) ^= S20_ROTL_V((y2) + (y1), 13); \
+    (y0) ^= S20_ROTL_V((y3) + (y2), 18); \
+  } while (0)
+
 static inline void s20_rowround(uint32_t y[16])
 {
   s20_quarterround(&y[0], &y[1], &y[2], &y[3]);
@@ -78,8 +101,8 @@ static inline void s20_hash(uint8_t seq[64])
   }
 }
 
-// The 16-byte (128-bit) key expansion function
-static inline void s20_expand16(uint8_t *k,
+// Lays out the block that the 16-byte (128-bit) key expansion hashes
+static inline void s20_layout16(uint8_t *k,
                          uint8_t n[16],
                          uint8_t keystream[64])
 {
@@ -104,13 +127,19 @@ static inline void s20_expand16(uint8_t *k,
     keystream[44+i] = k[i];
     keystream[24+i] = n[i];
   }
+}
 
+static inline void s20_expand16(uint8_t *k,
+                         uint8_t n[16],
+                         uint8_t keystream[64])
+{
+  s20_layout16(k, n, keystream);
   s20_hash(keystream);
 }
 
 
-// The 32-byte (256-bit) key expansion function
-static inline void s20_expand32(uint8_t *k,
+// Lays out the block that the 32-byte (256-bit) key expansion hashes
+static inline void s20_layout32(uint8_t *k,
                          uint8_t n[16],
                          uint8_t keystream[64])
 {
@@ -135,19 +164,25 @@ static inline void s20_expand32(uint8_t *k,
     keystream[44+i] = k[i+16];
     keystream[24+i] = n[i];
   }
+}
 
+static inline void s20_expand32(uint8_t *k,
+                         uint8_t n[16],
+                         uint8_t keystream[64])
+{
+  s20_layout32(k, n, keystream);
   s20_hash(keystream);
 }
 
 
 // Performs up to 2^32-1 bytes of encryption or decryption under a
-// 128- or 256-bit key and 64-byte nonce.
-enum s20_status_t s20_crypt(uint8_t *key,
-                            enum s20_keylen_t keylen,
-                            uint8_t nonce[8],
-                            uint32_t si,
-                            uint8_t *buf,
-                            uint32_t buflen)
+// 128- or 256-bit key and 64-byte nonce, one block at a time.
+static enum s20_status_t s20_crypt_scalar(uint8_t *key,
+                                          enum s20_keylen_t keylen,
+                                          uint8_t nonce[8],
+                                          uint32_t si,
+                                          uint8_t *buf,
+                                          uint32_t buflen)
 {
   uint8_t keystream[64];
   // 'n' is the 8-byte nonce (unique message number) concatenated
@@ -197,3 +232,216 @@ enum s20_status_t s20_crypt(uint8_t *key,
 
   return S20_SUCCESS;
 }
+
+// Computes LANES keystream blocks at once, with word i of every block in
+// one vector (lane j holds block `block + j`), and xors them into buf.
+// nblocks must be a multiple of LANES.
+template<typename V, int LANES>
+static inline __attribute__((always_inline)) void s20_xor_blocks(const uint32_t input[16],
+                                                                 uint32_t block,
+                                                                 uint8_t *buf,
+                                                                 uint32_t nblocks)
+{
+  V base[16];
+  V ctr, step;
+  for (int i = 0; i < 16; ++i)
+    for (int j = 0; j < LANES; ++j)
+      base[i][j] = input[i];
+  for (int j = 0; j < LANES; ++j) {
+    ctr[j] = block + j;
+    step[j] = LANES;
+  }
+
+  for (uint32_t b = 0; b < nblocks; b += LANES, ctr += step) {
+    V x[16];
+    for (int i = 0; i < 16; ++i)
+      x[i] = base[i];
+    // Word 8 is the low half of the block counter; the high half stays 0
+    x[8] = ctr;
+
+    V z[16];
+    for (int i = 0; i < 16; ++i)
+      z[i] = x[i];
+    for (int i = 0; i < 10; ++i) {
+      S20_QUARTERROUND_V(z[0], z[4], z[8], z[12]);
+      S20_QUARTERROUND_V(z[5], z[9], z[13], z[1]);
+      S20_QUARTERROUND_V(z[10], z[14], z[2], z[6]);
+      S20_QUARTERROUND_V(z[15], z[3], z[7], z[11]);
+      S20_QUARTERROUND_V(z[0], z[1], z[2], z[3]);
+      S20_QUARTERROUND_V(z[5], z[6], z[7], z[4]);
+      S20_QUARTERROUND_V(z[10], z[11], z[8], z[9]);
+      S20_QUARTERROUND_V(z[15], z[12], z[13], z[14]);
+    }
+
+    uint32_t words[16][LANES];
+    for (int i = 0; i < 16; ++i) {
+      z[i] += x[i];
+      memcpy(words[i], &z[i], sizeof(words[i]));
+    }
+
+    // Transpose back to byte order, then xor a word at a time
+    uint8_t keystream[64 * LANES];
+    for (int j = 0; j < LANES; ++j)
+      for (int i = 0; i < 16; ++i)
+        s20_rev_littleendian(keystream + 64 * j + 4 * i, words[i][j]);
+
+    uint8_t *out = buf + 64 * b;
+    for (int k = 0; k < 64 * LANES; k += 8) {
+      uint64_t data, ks;
+      memcpy(&data, out + k, 8);
+      memcpy(&ks, keystream + k, 8);
+      data ^= ks;
+      memcpy(out + k, &data, 8);
+    }
+  }
+}
+
+#if defined(S20_HAVE_SSE2) || defined(S20_HAVE_NEON)
+typedef uint32_t s20_v4 __attribute__((vector_size(16)));
+
+static void s20_xor_blocks_4(const uint32_t input[16], uint32_t block, uint8_t *buf, uint32_t nblocks)
+{
+  s20_xor_blocks<s20_v4, 4>(input, block, buf, nblocks);
+}
+#endif
+
+#ifdef S20_HAVE_AVX2
+typedef uint32_t s20_v8 __attribute__((vector_size(32)));
+
+__attribute__((target("avx2")))
+static void s20_xor_blocks_8(const uint32_t input[16], uint32_t block, uint8_t *buf, uint32_t nblocks)
+{
+  s20_xor_blocks<s20_v8, 8>(input, block, buf, nblocks);
+}
+#endif
+
+static enum s20_impl_t s20_detect_impl()
+{
+#if defined(S20_HAVE_AVX2)
+  enum s20_impl_t impl = S20_IMPL_SSE2;
+  alprsupport::cpu_info_t *info = alprsupport::cpu_detect();
+  if (info != NULL) {
+    if (alprsupport::has_avx(info) && alprsupport::has_avx2(info))
+      impl = S20_IMPL_AVX2;
+    free(info);
+  }
+  return impl;
+#elif defined(S20_HAVE_NEON)
+  alprsupport::cpu_info_t *info = alprsupport::cpu_detect();
+  enum s20_impl_t impl = alprsupport::has_neon(info) ? S20_IMPL_NEON : S20_IMPL_SCALAR;
+  free(info);
+  return impl;
+#else
+  return S20_IMPL_SCALAR;
+#endif
+}
+
+enum s20_impl_t s20_best_impl()
+{
+  static const enum s20_impl_t best = s20_detect_impl();
+  return best;
+}
+
+int s20_impl_available(enum s20_impl_t impl)
+{
+  enum s20_impl_t best = s20_best_impl();
+  switch (impl) {
+    case S20_IMPL_AUTO:
+    case S20_IMPL_SCALAR:
+      return 1;
+    case S20_IMPL_SSE2:
+      return best == S20_IMPL_SSE2 || best == S20_IMPL_AVX2;
+    case S20_IMPL_AVX2:
+      return best == S20_IMPL_AVX2;
+    case S20_IMPL_NEON:
+      return best == S20_IMPL_NEON;
+  }
+  return 0;
+}
+
+const char *s20_impl_name(enum s20_impl_t impl)
+{
+  switch (impl) {
+    case S20_IMPL_AUTO: return "auto";
+    case S20_IMPL_SCALAR: return "scalar";
+    case S20_IMPL_SSE2: return "sse2";
+    case S20_IMPL_AVX2: return "avx2";
+    case S20_IMPL_NEON: return "neon";
+  }
+  return "unknown";
+}
+
+enum s20_status_t s20_crypt_impl(enum s20_impl_t impl,
+                                 uint8_t *key,
+                                 enum s20_keylen_t keylen,
+                                 uint8_t nonce[8],
+                                 uint32_t si,
+                                 uint8_t *buf,
+                                 uint32_t buflen)
+{
+  if (impl == S20_IMPL_AUTO)
+    impl = s20_best_impl();
+  if (!s20_impl_available(impl))
+    return S20_FAILURE;
+  if (keylen != S20_KEYLEN_256 && keylen != S20_KEYLEN_128)
+    return S20_FAILURE;
+  if (key == NULL || nonce == NULL || buf == NULL)
+    return S20_FAILURE;
+
+  void (*xor_blocks)(const uint32_t *, uint32_t, uint8_t *, uint32_t) = NULL;
+  uint32_t lanes = 1;
+#ifdef S20_HAVE_AVX2
+  if (impl == S20_IMPL_AVX2) {
+    xor_blocks = s20_xor_blocks_8;
+    lanes = 8;
+  }
+#endif
+#if defined(S20_HAVE_SSE2) || defined(S20_HAVE_NEON)
+  if (impl == S20_IMPL_SSE2 || impl == S20_IMPL_NEON) {
+    xor_blocks = s20_xor_blocks_4;
+    lanes = 4;
+  }
+#endif
+  if (xor_blocks == NULL)
+    return s20_crypt_scalar(key, keylen, nonce, si, buf, buflen);
+
+  // Bring the stream index to a block boundary with the scalar code
+  uint32_t head = (64 - si % 64) % 64;
+  if (head > buflen)
+    head = buflen;
+  if (head > 0)
+    s20_crypt_scalar(key, keylen, nonce, si, buf, head);
+
+  uint32_t nblocks = (buflen - head) / 64;
+  nblocks -= nblocks % lanes;
+  if (nblocks > 0) {
+    // The input block for counter 0; the kernels fill in the counter
+    uint8_t n[16] = { 0 };
+    uint8_t layout[64];
+    uint32_t input[16];
+    memcpy(n, nonce, 8);
+    if (keylen == S20_KEYLEN_256)
+      s20_layout32(key, n, layout);
+    else
+      s20_layout16(key, n, layout);
+    for (int i = 0; i < 16; ++i)
+      input[i] = s20_littleendian(layout + 4 * i);
+    xor_blocks(input, (si + head) / 64, buf + head, nblocks);
+  }
+
+  // Whatever is left over is less than `lanes' blocks
+  uint32_t done = head + nblocks * 64;
+  if (done < buflen)
+    s20_crypt_scalar(key, keylen, nonce, si + done, buf + done, buflen - done);
+  return S20_SUCCESS;
+}
+
+enum s20_status_t s20_crypt(uint8_t *key,
+                            enum s20_keylen_t keylen,
+                            uint8_t nonce[8],
+                            uint32_t si,
+                            uint8_t *buf,
+                            uint32_t buflen)
+{
+  return s20_crypt_impl(S20_IMPL_AUTO, key, keylen, nonce, si, buf, buflen);
+}
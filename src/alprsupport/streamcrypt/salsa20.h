@@ -65,4 +65,34 @@ enum s20_status_t s20_crypt(uint8_t *key,
                             uint8_t *buf,
                             uint32_t buflen);
 
+/**
+ * Keystream implementations.  The wide ones compute 4 (SSE2, NEON) or
+ * 8 (AVX2) blocks at a time and produce byte-identical output to the
+ * scalar one.  s20_crypt uses the best one this CPU supports.
+ */
+enum s20_impl_t
+{
+  S20_IMPL_AUTO,
+  S20_IMPL_SCALAR,
+  S20_IMPL_SSE2,
+  S20_IMPL_AVX2,
+  S20_IMPL_NEON
+};
+
+/**
+ * s20_crypt with a specific implementation.  Returns S20_FAILURE if
+ * it isn't available on this CPU.
+ */
+enum s20_status_t s20_crypt_impl(enum s20_impl_t impl,
+                                 uint8_t *key,
+                                 enum s20_keylen_t keylen,
+                                 uint8_t nonce[8],
+                                 uint32_t si,
+                                 uint8_t *buf,
+                                 uint32_t buflen);
+
+int s20_impl_available(enum s20_impl_t impl);
+enum s20_impl_t s20_best_impl();
+const char *s20_impl_name(enum s20_impl_t impl);
+
 #endif
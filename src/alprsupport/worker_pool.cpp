@@ -0,0 +1,91 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <exception>
+
+namespace alprsupport
+{
+
+  WorkerPool::WorkerPool(int num_workers) : stopping(false) {
+    for (int i = 0; i < num_workers; i++)
+      workers.push_back(std::thread(&WorkerPool::worker_loop, this));
+  }
+
+  WorkerPool::~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(tasks_mutex);
+      stopping = true;
+    }
+    tasks_cv.notify_all();
+    for (uint32_t i = 0; i < workers.size(); i++)
+      workers[i].join();
+  }
+
+  std::future<void> WorkerPool::submit(std::function<void()> task) {
+    std::packaged_task<void()> packaged(task);
+    std::future<void> result = packaged.get_future();
+    if (workers.size() == 0) {
+      packaged();
+      return result;
+    }
+    {
+      std::lock_guard<std::mutex> lock(tasks_mutex);
+      tasks.push(std::move(packaged));
+    }
+    tasks_cv.notify_one();
+    return result;
+  }
+
+  void WorkerPool::parallel_for(size_t count, const std::function<void(size_t, size_t)>& fn) {
+    if (count == 0)
+      return;
+
+    size_t num_chunks = std::min(count, static_cast<size_t>(concurrency()));
+    size_t chunk_size = count / num_chunks;
+    size_t remainder = count % num_chunks;
+
+    // The first `remainder` chunks take one extra item
+    std::vector<std::future<void>> pending;
+    size_t first_end = chunk_size + (remainder > 0 ? 1 : 0);
+    size_t begin = first_end;
+    for (size_t chunk = 1; chunk < num_chunks; chunk++) {
+      size_t end = begin + chunk_size + (chunk < remainder ? 1 : 0);
+      pending.push_back(submit([&fn, begin, end]() { fn(begin, end); }));
+      begin = end;
+    }
+
+    // Wait for every chunk before leaving, even on failure, since the tasks reference fn
+    std::exception_ptr error;
+    try {
+      fn(0, first_end);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    for (uint32_t i = 0; i < pending.size(); i++) {
+      try {
+        pending[i].get();
+      } catch (...) {
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  void WorkerPool::worker_loop() {
+    while (true) {
+      std::packaged_task<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(tasks_mutex);
+        tasks_cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+        if (stopping && tasks.empty())
+          return;
+        task = std::move(tasks.front());
+        tasks.pop();
+      }
+      task();
+    }
+  }
+
+}
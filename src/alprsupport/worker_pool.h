@@ -0,0 +1,47 @@
+#ifndef OPENALPR_WORKER_POOL_H
+#define OPENALPR_WORKER_POOL_H
+
+#include <stddef.h>
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include "exports.h"
+
+namespace alprsupport
+{
+
+  /// Fixed set of worker threads used to spread CPU work (e.g., crop preprocessing) across cores.
+  class OPENALPRSUPPORT_DLL_EXPORT WorkerPool {
+  public:
+
+    /// Start num_workers threads.  0 workers is valid: everything then runs on the calling thread.
+    explicit WorkerPool(int num_workers);
+    virtual ~WorkerPool();
+
+    /// Number of threads that take part in parallel_for (the workers plus the caller)
+    int concurrency() { return workers.size() + 1; }
+
+    /// Queue a task on the workers.  The future rethrows anything the task throws.
+    std::future<void> submit(std::function<void()> task);
+
+    /// Split [0, count) into contiguous chunks, one per thread.  The calling thread processes the first chunk and
+    /// returns once every chunk is done, so the output of fn(begin, end) never depends on scheduling.
+    void parallel_for(size_t count, const std::function<void(size_t begin, size_t end)>& fn);
+
+  private:
+    void worker_loop();
+
+    std::vector<std::thread> workers;
+    std::queue<std::packaged_task<void()>> tasks;
+    std::mutex tasks_mutex;
+    std::condition_variable tasks_cv;
+    bool stopping;
+  };
+
+}
+
+#endif // OPENALPR_WORKER_POOL_H
@@ -57,17 +57,25 @@ to be moved here being a single class.
 */
 
 BufferManager::BufferManager(int max_batch_size, bool pad_to_max)
-                             : _max_batch_size(max_batch_size)
+                             : _is_gpu(false)
+                             , _alpr_gpu_support(NULL)
+                             , _arena(TensorArena::Default())
+                             , _max_batch_size(max_batch_size)
                              , _pad_to_max(pad_to_max)
-                             , _is_gpu(false)
-                             , _buffer_initialized(false) {}
+                             , _buffer_initialized(false)
+                             , _cpu_memory_info(NULL)
+                             , _gpu_memory_info(NULL) {}
 
 BufferManager::~BufferManager() {
-  for (auto & x : _tensors) {
-    g_ort->ReleaseValue(x);
-  }
-  for (auto & x : _buffers)
+  // _tensors only points into the per-buffer caches
+  for (auto & x : _buffers) {
+    ReleaseCachedTensors(x.second);
     x.second.free();
+  }
+  if (_cpu_memory_info)
+    g_ort->ReleaseMemoryInfo(_cpu_memory_info);
+  if (_gpu_memory_info)
+    g_ort->ReleaseMemoryInfo(_gpu_memory_info);
 
   for (auto & x : _node_names)
     free(reinterpret_cast<void *>(const_cast<char *>(x)));
@@ -79,7 +87,7 @@ void BufferManager::SetCudaSupport(AlprGpuSupport* alpr_gpu_support) {
 }
 
 
-bool BufferManager::SetTensorDims(const std::string & name, std::vector<int64_t> dims) {
+bool BufferManager::SetTensorDims(const std::string & name, const std::vector<int64_t> & dims) {
   TensorDesc & desc = GetTensorDesc(name);
 
   bool dims_equal = desc.DimsAreEqual(dims);
@@ -106,15 +114,14 @@ bool BufferManager::SetTensorDims(const std::string & name, std::vector<int64_t>
     exit(EXIT_FAILURE);
   }
 
-  vector<bool> dim_updated(dims.size(), false);
-  for (int i = 0; i < dims.size(); i++) {
-    dim_updated[i] = dims[i] != desc.cur_dims[i];
-  }
   desc.cur_dims = dims;
-  desc.free();
   if (_pad_to_max && desc.cur_dims[0] < _max_batch_size)
     desc.cur_dims[0] = _max_batch_size;
-  desc.allocate();
+  // allocate() keeps the current buffer when it is already big enough
+  if (!desc.allocate(_arena)) {
+    ALPR_WARN << "Failed to allocate buffer `" << name << "'" << std::endl;
+    exit(EXIT_FAILURE);
+  }
   MakeORTdescriptor(desc);
 
   for (auto & x : _buffers) {
@@ -122,18 +129,44 @@ bool BufferManager::SetTensorDims(const std::string & name, std::vector<int64_t>
       continue;
     } else {
       if (x.second.cur_dims[0] < desc.cur_dims[0]) {
-        x.second.free();
         x.second.cur_dims[0] = desc.cur_dims[0];
-        x.second.allocate();
+        x.second.allocate(_arena);
         MakeORTdescriptor(x.second);
       }
     }
   }
-  desc.allocate();
-  MakeORTdescriptor(desc);
   return true;
 }
 
+void BufferManager::BindExternalBuffer(const std::string & name, const std::vector<int64_t> & dims, void * data,
+                                       size_t size, bool on_gpu) {
+  TensorDesc & desc = GetTensorDesc(name);
+  if (desc.external && desc.buf == data && desc.DimsAreEqual(dims))
+    return;
+  if (!desc.CanUpateDims(dims)) {
+    ALPR_ERROR << "Bad dimensionn update for buffer `" << name << "'" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  ReleaseCachedTensors(desc);
+  desc.free();
+  desc.cur_dims = dims;
+  desc.is_gpu = on_gpu;
+  desc.buf = data;
+  desc.size = size;
+  desc.capacity = size;
+  desc.external = true;
+  if (desc.BufferSizeBytes() > size) {
+    ALPR_ERROR << "Buffer bound to `" << name << "' is smaller than its dims require" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  MakeORTdescriptor(desc);
+}
+
+void BufferManager::AppendTensorDims(std::vector<int64_t> & key) {
+  for (auto & x : _buffers)
+    key.insert(key.end(), x.second.cur_dims.begin(), x.second.cur_dims.end());
+}
+
 
 void BufferManager::RegisterBuffer(size_t pos, char * name, std::vector<int64_t> proto_dims, ONNXTensorElementDataType type) {
   if (_node_names.size() != pos) {
@@ -148,9 +181,10 @@ void BufferManager::RegisterBuffer(size_t pos, char * name, std::vector<int64_t>
 
 void BufferManager::MoveToCpu(const std::string & name) {
   TensorDesc & desc = GetTensorDesc(name);
+  ReleaseCachedTensors(desc);
   desc.free();
   desc.is_gpu = false;
-  if (!desc.allocate()) {
+  if (!desc.allocate(_arena)) {
     ALPR_WARN << "Failed to allocate buffer `" << name << "'" << std::endl;
     exit(EXIT_FAILURE);
   }
@@ -199,36 +233,52 @@ size_t BufferManager::GetRawBufferSize(const std::string & name) {
   return GetTensorDesc(name).size;
 }
 
+void BufferManager::ReleaseCachedTensors(TensorDesc & desc) {
+  for (auto & x : desc.tensor_cache)
+    g_ort->ReleaseValue(x.second);
+  desc.tensor_cache.clear();
+  desc.tensor_cache_buf = NULL;
+}
+
 void BufferManager::MakeORTdescriptor(TensorDesc & desc) {
-  // free any buffer.
-  if (desc.index < _tensors.size()) {
-    if (_tensors[desc.index]) {
-      g_ort->ReleaseValue(_tensors[desc.index]);
-      _tensors[desc.index] = NULL;
-    }
-  } else {
+  if (desc.index >= _tensors.size()) {
     ALPR_WARN << "Failed to access input node ";
     exit(EXIT_FAILURE);
   }
+  _tensors[desc.index] = NULL;
+
+  // cached tensors wrap the old buffer once it has been reallocated
+  if (desc.tensor_cache_buf != desc.buf) {
+    ReleaseCachedTensors(desc);
+    desc.tensor_cache_buf = desc.buf;
+  }
 
   // the cur_dims field has what the user intends, however, GetRealDims returns dimensions
   // after any padding to max_batch_size has been applied.
-  auto real_dims = desc.GetRealDims();
+  const auto & real_dims = desc.GetRealDims();
+  auto cached = desc.tensor_cache.find(real_dims);
+  if (cached != desc.tensor_cache.end()) {
+    _tensors[desc.index] = cached->second;
+    return;
+  }
+
   OrtValue* input_tensor = NULL;
-  OrtMemoryInfo * mem_info;
   int gpu_id = 0;
-  if (desc.is_gpu)
-    OrtCheckStatus(g_ort->CreateMemoryInfo("Cuda", OrtDeviceAllocator, gpu_id, OrtMemTypeDefault, &mem_info));
-  else
-    OrtCheckStatus(g_ort->CreateCpuMemoryInfo(OrtArenaAllocator, OrtMemTypeDefault, &mem_info));
+  OrtMemoryInfo ** mem_info = desc.is_gpu ? &_gpu_memory_info : &_cpu_memory_info;
+  if (*mem_info == NULL) {
+    if (desc.is_gpu)
+      OrtCheckStatus(g_ort->CreateMemoryInfo("Cuda", OrtDeviceAllocator, gpu_id, OrtMemTypeDefault, mem_info));
+    else
+      OrtCheckStatus(g_ort->CreateCpuMemoryInfo(OrtArenaAllocator, OrtMemTypeDefault, mem_info));
+  }
 
-  OrtCheckStatus(g_ort->CreateTensorWithDataAsOrtValue(mem_info, desc.buf, desc.BufferSizeBytes(),
+  OrtCheckStatus(g_ort->CreateTensorWithDataAsOrtValue(*mem_info, desc.buf, desc.BufferSizeBytes(),
                                                        real_dims.data(), real_dims.size(),
                                                        desc.elem_type, &input_tensor));
   _tensors[desc.index] = input_tensor;
+  desc.tensor_cache[real_dims] = input_tensor;
   int is_tensor;
   OrtCheckStatus(g_ort->IsTensor(input_tensor, &is_tensor));
   assert(is_tensor);
-  g_ort->ReleaseMemoryInfo(mem_info);
 }
 }  // namespace alpr
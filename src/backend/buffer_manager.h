@@ -31,6 +31,7 @@
 #include <chrono>
 #include <string>
 #include <unordered_map>
+#include <map>
 #include <utility>
 #include <alprgpusupport.h>
 #include <inttypes.h>
@@ -42,6 +43,7 @@
 #include <omp.h>
 #endif
 #include <alprsupport/streamcrypt/filecryptstream.h>
+#include "tensor_arena.h"
 #include <fcntl.h>
 
 
@@ -71,6 +73,8 @@ class TensorDesc {
   // cur_dims holds the current dimensions of the tensor,
   // therefore there can't be negative inside this.
   vector<int64_t> cur_dims;
+  // cur_dims after padding to max_batch_size, see GetRealDims
+  vector<int64_t> real_dims;
   const bool _pad_to_max;
   const size_t _max_batch_size;
   size_t elem_size;
@@ -78,30 +82,44 @@ class TensorDesc {
   ONNXTensorElementDataType elem_type;
   void * buf;
   size_t size;
+  // bytes actually allocated at buf; size can be smaller after the batch shrinks
+  size_t capacity;
+  // buf belongs to the caller (see BufferManager::BindExternalBuffer) and is never freed here
+  bool external;
+  // where a CPU buf came from
+  TensorArena * arena;
   bool is_gpu;
+  // OrtValues wrapping buf, one per shape it has been used with.  Owned by BufferManager.
+  std::map<vector<int64_t>, OrtValue *> tensor_cache;
+  void * tensor_cache_buf;
   // I'm not sure why this is needed
   TensorDesc()
-            : index(0), _pad_to_max(false), _max_batch_size(1), buf(NULL) {}
+            : index(0), _pad_to_max(false), _max_batch_size(1), buf(NULL), size(0), capacity(0), external(false),
+              arena(NULL), tensor_cache_buf(NULL) {}
 
   TensorDesc(size_t index, std::vector<int64_t> dims, ONNXTensorElementDataType type,
             AlprGpuSupport* alpr_gpu_support, bool pad_to_max, size_t max_batch_size)
             : index(index)
             , proto_dims(dims)
             , cur_dims(dims.size(), 0)
+            , _pad_to_max(pad_to_max)
+            , _max_batch_size(max_batch_size)
             , elem_size(_ONNX_element_size[static_cast<int>(type)])
+            , _alpr_gpu_support(alpr_gpu_support)
             , elem_type(type)
             , buf(NULL)
             , size(0)
-            , _alpr_gpu_support(alpr_gpu_support)
+            , capacity(0)
+            , external(false)
+            , arena(NULL)
             , is_gpu(alpr_gpu_support != NULL)
-            , _pad_to_max(pad_to_max)
-            , _max_batch_size(max_batch_size) {}
+            , tensor_cache_buf(NULL) {}
 
   ~TensorDesc() {
     this->free();
   }
 
-  size_t NumElements(vector<int64_t> dims) {
+  size_t NumElements(const vector<int64_t> & dims) {
     size_t num_el = 0;
     for (int i = 0; i < dims.size(); i++) {
       auto x = dims[i];
@@ -120,11 +138,12 @@ class TensorDesc {
     return num_el;
   }
   size_t BufferSizeBytes(void) {
-    std::vector<int64_t> dims = this->GetRealDims();
+    const std::vector<int64_t> & dims = this->GetRealDims();
     return elem_size * NumElements(dims);
   }
-  vector<int64_t> GetRealDims(void) {
-    vector<int64_t> real_dims = cur_dims;
+  // valid until the next call; reusing one vector keeps shape changes free of allocations
+  const vector<int64_t> & GetRealDims(void) {
+    real_dims = cur_dims;
     if (_pad_to_max)
       real_dims[0] = _max_batch_size;
     return real_dims;
@@ -168,19 +187,35 @@ class TensorDesc {
     return true;
   }
 
-  bool allocate(void) {
-    this->free();
+  bool allocate(TensorArena * cpu_arena) {
     size_t buffer_size = this->BufferSizeBytes();
+    // a smaller (or previously seen) shape fits in the buffer we already have
+    if (this->buf != NULL && !this->external && buffer_size <= this->capacity) {
+      this->size = buffer_size;
+      return true;
+    }
+    this->free();
+
+    // with a dynamic batch dimension, make room for the largest batch up front so changing
+    // the batch size later never reallocates.
+    size_t reserve_size = buffer_size;
+    int64_t batch = this->GetRealDims()[0];
+    if (proto_dims.size() > 0 && proto_dims[0] < 0 && batch < static_cast<int64_t>(_max_batch_size))
+      reserve_size = buffer_size / batch * _max_batch_size;
+
     void * buffer;
     if (this->is_gpu) {
-      buffer = _alpr_gpu_support->memory_allocate_gpu_buffer(buffer_size);
+      buffer = _alpr_gpu_support->memory_allocate_gpu_buffer(reserve_size);
     } else {
-      buffer = malloc(buffer_size);
+      buffer = cpu_arena->Allocate(reserve_size);
+      this->arena = cpu_arena;
     }
     this->buf = buffer;
     this->size = buffer_size;
+    this->capacity = reserve_size;
     if (!buffer) {
       ALPR_WARN << "Failed to allocate input buffer";
+      this->capacity = 0;
       return false;
     }
     return true;
@@ -189,14 +224,19 @@ class TensorDesc {
   void free(void) {
     if (this->buf == NULL)
       return;
-    if (this->is_gpu) {
+    if (this->external) {
+      // owned by whoever bound it
+    } else if (this->is_gpu) {
       _alpr_gpu_support->memory_free_gpu_buffer(this->buf);
     } else {
-      std::free(this->buf);
+      this->arena->Free(this->buf, this->capacity);
     }
     // just in case
     this->buf = NULL;
     this->size = 0;
+    this->capacity = 0;
+    this->external = false;
+    this->arena = NULL;
   }
 };
 
@@ -211,7 +251,12 @@ class BufferManager {
   std::vector<int64_t> GetCurRawBufferDims(const std::string & name);
   std::vector<int64_t> GetProtoRawBufferDims(const std::string & name);
   TensorDesc & GetTensorDesc(const std::string & name);
-  bool SetTensorDims(const std::string & name, std::vector<int64_t> dims);
+  bool SetTensorDims(const std::string & name, const std::vector<int64_t> & dims);
+  // Point input `name' at caller-owned memory of `size' bytes holding a tensor of shape `dims'
+  void BindExternalBuffer(const std::string & name, const std::vector<int64_t> & dims, void * data, size_t size,
+                          bool on_gpu);
+  // Append the current dims of every input to `key' (used to key per-shape caches)
+  void AppendTensorDims(std::vector<int64_t> & key);
 
   // void MakeNetworkTensors();
   // void SetBufferDims(const std::string & name, const std::vector<int64_t> & batch_dims);
@@ -219,12 +264,16 @@ class BufferManager {
   vector<const char *> & Names() { return _node_names; }
   vector<OrtValue *> & Tensors() { return _tensors; }
   void SetCudaSupport(AlprGpuSupport* alpr_gpu_support);
+  // CPU buffers allocated from now on come from `arena' (TensorArena::Default() until set)
+  void SetTensorArena(TensorArena * arena) { _arena = arena; }
+  TensorArena * GetTensorArena() const { return _arena; }
   bool IsGpuBuffer(const std::string & name);
   void MoveToCpu(const std::string & name);
 
  private:
   // void AllocateBuffer(TensorDesc & desc);
   void MakeORTdescriptor(TensorDesc & desc);
+  void ReleaseCachedTensors(TensorDesc & desc);
 
   size_t GetNodeId(const std::string & name);
   // void FreeBuffer(TensorDesc & in);
@@ -236,9 +285,12 @@ class BufferManager {
 
   bool _is_gpu;
   AlprGpuSupport* _alpr_gpu_support;
+  TensorArena * _arena;
   const int _max_batch_size;
   const bool _pad_to_max;
   bool _buffer_initialized;
+  OrtMemoryInfo * _cpu_memory_info;
+  OrtMemoryInfo * _gpu_memory_info;
 };
 
 }  // namespace alpr
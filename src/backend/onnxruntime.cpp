@@ -33,10 +33,16 @@
 #include <queue>
 #include <iomanip>
 #include <utility>
+#include <mutex>
+#include <string>
 #include <alprsupport/profiler.h>
 
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 using std::vector;
@@ -49,8 +55,8 @@ namespace alpr {
 const OrtApi* g_ort = OrtGetApiBase()->GetApi(ORT_API_VERSION);
 // When we use version > https://github.com/microsoft/onnxruntime/issues/1430
 // We can remove this from global namespace.
-OrtEnv* g_env;
-bool a = g_ort->CreateEnv(ORT_LOGGING_LEVEL_ERROR, "alpr", &g_env);
+// Created by the first runtime (see acquire_env), since a global thread pool has to be chosen at creation.
+OrtEnv* g_env = NULL;
 
 void OrtCheckStatus(OrtStatus* status) {
   if (status != NULL) {
@@ -60,11 +66,201 @@ void OrtCheckStatus(OrtStatus* status) {
   }
 }
 
-void set_omp_to_synchronous() {
+void set_omp_to_synchronous(const OrtThreadingConfig & threading) {
+#ifndef _WIN32
+  // Only what was configured, and never over what the user put in the environment
+  if (!threading.omp_wait_policy.empty())
+    setenv("OMP_WAIT_POLICY", threading.omp_wait_policy.c_str(), 0);
+  if (threading.omp_num_threads > 0)
+    setenv("OMP_NUM_THREADS", std::to_string(threading.omp_num_threads).c_str(), 0);
+#endif
+}
+
+namespace {
+std::mutex g_env_mutex;
+bool g_env_has_global_pool = false;
+
+OrtEnv* acquire_env(const OrtThreadingConfig & threading) {
+  std::lock_guard<std::mutex> lock(g_env_mutex);
+  if (g_env != NULL) {
+    if (threading.use_global_thread_pool && !g_env_has_global_pool)
+      ALPR_WARN << "ONNX runtime env already exists without a global thread pool; using per-session threads";
+    if (threading.omp_num_threads > 0 || !threading.omp_wait_policy.empty())
+      ALPR_WARN << "OpenMP settings only apply to the first ONNX runtime created in the process; ignoring them";
+    return g_env;
+  }
+  // Once, before ORT (and OpenMP) start any threads
+  set_omp_to_synchronous(threading);
+  if (threading.use_global_thread_pool) {
+    OrtThreadingOptions* options = NULL;
+    OrtCheckStatus(g_ort->CreateThreadingOptions(&options));
+    OrtCheckStatus(g_ort->SetGlobalIntraOpNumThreads(options, threading.intra_op_threads));
+    OrtCheckStatus(g_ort->SetGlobalInterOpNumThreads(options, threading.inter_op_threads));
+    OrtCheckStatus(g_ort->SetGlobalSpinControl(options, threading.allow_spinning ? 1 : 0));
+#if ORT_API_VERSION >= 15
+    if (!threading.affinity.empty())
+      OrtCheckStatus(g_ort->SetGlobalIntraOpThreadAffinity(options, threading.affinity.c_str()));
+#else
+    if (!threading.affinity.empty())
+      ALPR_WARN << "Global thread pool affinity needs ONNX runtime 1.15 or newer; ignoring \"" << threading.affinity
+                << "\"";
+#endif
+    OrtCheckStatus(g_ort->CreateEnvWithGlobalThreadPools(ORT_LOGGING_LEVEL_ERROR, "alpr", options, &g_env));
+    g_ort->ReleaseThreadingOptions(options);
+    g_env_has_global_pool = g_env != NULL;
+  }
+  if (g_env == NULL)
+    OrtCheckStatus(g_ort->CreateEnv(ORT_LOGGING_LEVEL_ERROR, "alpr", &g_env));
+  if (g_env == NULL) {
+    ALPR_ERROR << "Failed to create the ONNX runtime env";
+    exit(EXIT_FAILURE);
+  }
+  return g_env;
+}
+
+void apply_threading(OrtSessionOptions* session_options, const OrtThreadingConfig & threading, bool global_pool) {
+  OrtCheckStatus(g_ort->SetSessionExecutionMode(session_options,
+                                                threading.parallel_execution ? ORT_PARALLEL : ORT_SEQUENTIAL));
+  if (global_pool) {
+    OrtCheckStatus(g_ort->DisablePerSessionThreads(session_options));
+    return;
+  }
+  OrtCheckStatus(g_ort->SetIntraOpNumThreads(session_options, threading.intra_op_threads));
+  OrtCheckStatus(g_ort->SetInterOpNumThreads(session_options, threading.inter_op_threads));
+#if ORT_API_VERSION >= 7
+  const char* spin = threading.allow_spinning ? "1" : "0";
+  OrtCheckStatus(g_ort->AddSessionConfigEntry(session_options, "session.intra_op.allow_spinning", spin));
+  OrtCheckStatus(g_ort->AddSessionConfigEntry(session_options, "session.inter_op.allow_spinning", spin));
+#else
+  if (!threading.allow_spinning)
+    ALPR_WARN << "Per-session spin control needs a newer ONNX runtime; use the global thread pool instead";
+#endif
+#if ORT_API_VERSION >= 14
+  if (!threading.affinity.empty())
+    OrtCheckStatus(g_ort->AddSessionConfigEntry(session_options, "session.intra_op_thread_affinities",
+                                                threading.affinity.c_str()));
+#else
+  if (!threading.affinity.empty())
+    ALPR_WARN << "Thread affinity needs ONNX runtime 1.14 or newer; ignoring \"" << threading.affinity << "\"";
+#endif
+}
+}  // namespace
+
+bool ModelData::Map(const char* filename) {
+  Release();
+#ifdef _WIN32
+  return false;
+#else
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+  void * addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping keeps its own reference to the file
+  close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+  // ORT parses the protobuf front to back
+  madvise(addr, st.st_size, MADV_SEQUENTIAL);
+  _data = static_cast<char *>(addr);
+  _size = st.st_size;
+  _mapped = true;
+  return true;
+#endif
+}
 
+char * ModelData::Allocate(size_t size) {
+  Release();
+  _data = static_cast<char *>(malloc(size));
+  _size = _data != NULL ? size : 0;
+  _mapped = false;
+  return _data;
 }
 
-std::vector<char> read_model(const char* filename, std::string enc_key_name) {
+void ModelData::Release() {
+  if (_data == NULL)
+    return;
+#ifndef _WIN32
+  if (_mapped)
+    munmap(_data, _size);
+  else
+#endif
+    free(_data);
+  _data = NULL;
+  _size = 0;
+  _mapped = false;
+}
+
+namespace {
+
+bool is_encrypted_model(const std::string & filename) {
+  const std::string suffix = ".enc";
+  return filename.size() > suffix.size() &&
+         filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Reads an encrypted model from memory (e.g. a mapped runtime bundle) through the same stream decryption
+struct MemoryStreamBuf : std::streambuf {
+  MemoryStreamBuf(const char * data, size_t size) {
+    char * begin = const_cast<char *>(data);
+    setg(begin, begin, begin + size);
+  }
+};
+
+// Decrypt straight into the buffer handed to ORT, one chunk at a time, so the plaintext only exists once
+void decrypt_model(std::istream & file, size_t size, const char* filename, const std::string & enc_key_name,
+                   ModelData & model) {
+  uint8_t key[32];
+  uint8_t iv[8];
+  if (!alprsupport::FileCryptStream::key_for_name(enc_key_name, key, iv)) {
+    ALPR_ERROR << "Unknown runtime data key `" << enc_key_name << "' for " << filename;
+    exit(EXIT_FAILURE);
+  }
+
+  char * buffer = model.Allocate(size);
+  if (buffer == NULL) {
+    ALPR_ERROR << "Failed to allocate " << size << " bytes for " << filename;
+    exit(EXIT_FAILURE);
+  }
+
+  timespec start_time, end_time;
+  alprsupport::getTimeMonotonic(&start_time);
+  alprsupport::FileCryptStream crypt(key, iv);
+  if (!crypt.encrypt_decrypt_stream(file, buffer, size)) {
+    ALPR_ERROR << "Failed to read runtime data file: " << filename;
+    exit(EXIT_FAILURE);
+  }
+  alprsupport::getTimeMonotonic(&end_time);
+  double elapsed_ms = alprsupport::diffclock(start_time, end_time);
+  double mb = size / (1024.0 * 1024.0);
+  ALPR_INFO << "Decrypted " << filename << " (" << std::fixed << std::setprecision(1) << mb << " MB) in "
+            << elapsed_ms << " ms, " << (elapsed_ms > 0 ? mb * 1000.0 / elapsed_ms : 0.0) << " MB/s";
+}
+
+void read_encrypted_model(const char* filename, const std::string & enc_key_name, ModelData & model) {
+  std::ifstream file(filename, std::ios::binary | std::ios::ate);
+  if (!file.is_open()) {
+    ALPR_WARN << "Runtime data file not found: " << filename;
+    exit(EXIT_FAILURE);
+  }
+  std::streamsize size = file.tellg();
+  file.seekg(0, std::ios::beg);
+  decrypt_model(file, size, filename, enc_key_name, model);
+}
+
+}  // namespace
+
+void read_model(const char* filename, std::string enc_key_name, ModelData & model) {
+    if (is_encrypted_model(filename)) {
+      read_encrypted_model(filename, enc_key_name, model);
+      return;
+    }
+    if (model.Map(filename))
+      return;
 
     int fd = open(filename, O_RDONLY);
     if (fd == -1) {
@@ -75,51 +271,74 @@ std::vector<char> read_model(const char* filename, std::string enc_key_name) {
     std::ifstream file(filename, std::ios::binary | std::ios::ate);
     std::streamsize size = file.tellg();
     file.seekg(0, std::ios::beg);
-    std::vector<char> buffer(size);
-    if (!file.read(buffer.data(), size)) {
+    char * buffer = model.Allocate(size);
+    if (buffer == NULL || !file.read(buffer, size)) {
       ALPR_WARN << "Runtime data file not found: " << filename;
       exit(EXIT_FAILURE);
     }
     file.close();
-    return buffer;
-  
 }
 
+namespace {
+
+// Keeps the cache from growing without bound when a caller feeds many distinct input shapes
+const size_t kMaxCachedOutputShapes = 128;
+
+void release_session(OrtSession* session) {
+  g_ort->ReleaseSession(session);
+}
+
+void release_session_options(OrtSessionOptions* options) {
+  g_ort->ReleaseSessionOptions(options);
+}
+
+}  // namespace
+
 AlprONNXRuntime::AlprONNXRuntime(const std::string & model_path, ProcessingProvider proc_type, int gpu_id,
-                                 bool pad_to_max, std::string logid, int max_batch_size)
+                                 bool pad_to_max, std::string logid, int max_batch_size, std::string enc_key_name,
+                                 const OrtThreadingConfig & threading)
                                  : _proc_type(proc_type), _profile(false), _max_batch_size(max_batch_size),
                                  _pad_to_max(pad_to_max), _input_buffer_manager(max_batch_size, pad_to_max),
-                                 _gpu_id(gpu_id), _env(g_env) {
+                                 _gpu_id(gpu_id), _env(NULL), _current_outputs(NULL) {
   _alpr_gpu_support = NULL;
   if (proc_type != ORT_CPU) {
     _alpr_gpu_support = AlprGpuSupport::getInstance(_gpu_id);
   }
-  set_omp_to_synchronous();
+  _env = acquire_env(threading);
   _input_buffer_manager.SetCudaSupport(_alpr_gpu_support);
   //*************************************************************************
   // initialize enviroment. one enviroment per process
   // enviroment maintains thread pools and other state info
   // OrtCheckStatus(g_ort->CreateEnv(ORT_LOGGING_LEVEL_ERROR, logid.c_str(), &_env));
+  CreateSessionOptions(proc_type, threading);
+
+  // ORT copies what it needs, so the model bytes are released as soon as the session exists
+  ModelData raw_model;
+  read_model(model_path.c_str(), enc_key_name, raw_model);
+  CreateSession(raw_model.data(), raw_model.size(), model_path);
+}
 
+void AlprONNXRuntime::CreateSessionOptions(ProcessingProvider proc_type, const OrtThreadingConfig & threading) {
   // initialize session options if needed
-  OrtCheckStatus(g_ort->CreateSessionOptions(&_session_options));
-  OrtCheckStatus(g_ort->SetIntraOpNumThreads(_session_options, 1));
+  OrtSessionOptions* session_options;
+  OrtCheckStatus(g_ort->CreateSessionOptions(&session_options));
+  _session_options.reset(session_options, release_session_options);
 #ifndef _WIN32
   if (_profile)
-    OrtCheckStatus(g_ort->EnableProfiling(_session_options, "profile"));
+    OrtCheckStatus(g_ort->EnableProfiling(session_options, "profile"));
 #endif
 
   // Sets graph optimization level
-  OrtCheckStatus(g_ort->SetSessionGraphOptimizationLevel(_session_options, ORT_ENABLE_ALL));
-  OrtCheckStatus(g_ort->SetIntraOpNumThreads(_session_options, 1));
+  OrtCheckStatus(g_ort->SetSessionGraphOptimizationLevel(session_options, ORT_ENABLE_ALL));
+  apply_threading(session_options, threading, threading.use_global_thread_pool && g_env_has_global_pool);
 
   switch (proc_type) {
     case ORT_CUDA: {
-      this->_alpr_gpu_support->set_onnxruntime_gpu(_session_options, false);
+      this->_alpr_gpu_support->set_onnxruntime_gpu(session_options, false);
       break;
     }
     case ORT_TRT: {
-      this->_alpr_gpu_support->set_onnxruntime_gpu(_session_options, true);
+      this->_alpr_gpu_support->set_onnxruntime_gpu(session_options, true);
       break;
     }
     case ORT_CPU: {
@@ -130,24 +349,75 @@ AlprONNXRuntime::AlprONNXRuntime(const std::string & model_path, ProcessingProvi
       exit(EXIT_FAILURE);
     }
   }
+}
+
+AlprONNXRuntime::AlprONNXRuntime(const void * model_data, size_t model_size, bool encrypted,
+                                 const std::string & model_name, ProcessingProvider proc_type, int gpu_id,
+                                 bool pad_to_max, std::string logid, int max_batch_size, std::string enc_key_name,
+                                 const OrtThreadingConfig & threading)
+                                 : _proc_type(proc_type), _profile(false), _max_batch_size(max_batch_size),
+                                 _pad_to_max(pad_to_max), _input_buffer_manager(max_batch_size, pad_to_max),
+                                 _gpu_id(gpu_id), _env(NULL), _current_outputs(NULL) {
+  _alpr_gpu_support = NULL;
+  if (proc_type != ORT_CPU)
+    _alpr_gpu_support = AlprGpuSupport::getInstance(_gpu_id);
+  _env = acquire_env(threading);
+  _input_buffer_manager.SetCudaSupport(_alpr_gpu_support);
+  CreateSessionOptions(proc_type, threading);
+
+  if (!encrypted) {
+    CreateSession(model_data, model_size, model_name);
+    return;
+  }
+  ModelData raw_model;
+  std::string name = model_name + ".enc";
+  MemoryStreamBuf buffer(static_cast<const char *>(model_data), model_size);
+  std::istream stream(&buffer);
+  decrypt_model(stream, model_size, name.c_str(), enc_key_name, raw_model);
+  CreateSession(raw_model.data(), raw_model.size(), model_name);
+}
+
+void AlprONNXRuntime::CreateSession(const void * model_data, size_t model_size, const std::string & model_name) {
+  OrtSession* session = NULL;
+  OrtCheckStatus(g_ort->CreateSessionFromArray(_env, model_data, model_size, _session_options.get(), &session));
+  if (session == NULL) {
+    ALPR_ERROR << "Failed to create ONNX session for " << model_name;
+    exit(EXIT_FAILURE);
+  }
+  _session.reset(session, release_session);
+
+  RegisterNodes();
+}
 
-  std::vector<char> raw_model = read_model(model_path.c_str(), "edge");
-  OrtCheckStatus(g_ort->CreateSessionFromArray(_env, static_cast<void *>(raw_model.data()), raw_model.size(),
-                                               _session_options, &_session));
+AlprONNXRuntime::AlprONNXRuntime(const AlprONNXRuntime & shared)
+                                 : _proc_type(shared._proc_type), _profile(false),
+                                 _max_batch_size(shared._max_batch_size), _pad_to_max(shared._pad_to_max),
+                                 _input_buffer_manager(shared._max_batch_size, shared._pad_to_max),
+                                 _gpu_id(shared._gpu_id), _env(shared._env), _session(shared._session),
+                                 _session_options(shared._session_options),
+                                 _alpr_gpu_support(shared._alpr_gpu_support), _current_outputs(NULL) {
+  _input_buffer_manager.SetCudaSupport(_alpr_gpu_support);
+  _input_buffer_manager.SetTensorArena(shared._input_buffer_manager.GetTensorArena());
+  RegisterNodes();
+}
+
+AlprONNXRuntime * AlprONNXRuntime::CreateContext() {
+  return new AlprONNXRuntime(*this);
+}
 
+void AlprONNXRuntime::RegisterNodes() {
   //*************************************************************************
   // print model input layer (node names, types, shape etc.)
   size_t num_input_nodes;
-  OrtStatus* status;
   OrtCheckStatus(g_ort->GetAllocatorWithDefaultOptions(&_allocator));
-  OrtCheckStatus(g_ort->SessionGetInputCount(_session, &num_input_nodes));
+  OrtCheckStatus(g_ort->SessionGetInputCount(_session.get(), &num_input_nodes));
   // iterate over all input nodes
   for (size_t i = 0; i < num_input_nodes; i++) {
     char* name = NULL;
-    OrtCheckStatus(g_ort->SessionGetInputName(_session, i, _allocator, &name));
+    OrtCheckStatus(g_ort->SessionGetInputName(_session.get(), i, _allocator, &name));
     // print input node types
     OrtTypeInfo* typeinfo;
-    OrtCheckStatus(g_ort->SessionGetInputTypeInfo(_session, i, &typeinfo));
+    OrtCheckStatus(g_ort->SessionGetInputTypeInfo(_session.get(), i, &typeinfo));
     const OrtTensorTypeAndShapeInfo* tensor_info;
     OrtCheckStatus(g_ort->CastTypeInfoToTensorInfo(typeinfo, &tensor_info));
     ONNXTensorElementDataType type;
@@ -164,29 +434,41 @@ AlprONNXRuntime::AlprONNXRuntime(const std::string & model_path, ProcessingProvi
   }
 
   size_t num_output_nodes;
-  status = g_ort->SessionGetOutputCount(_session, &num_output_nodes);
+  OrtCheckStatus(g_ort->SessionGetOutputCount(_session.get(), &num_output_nodes));
   for (size_t i = 0; i < num_output_nodes; i++) {
     char* name = NULL;
-    OrtCheckStatus(g_ort->SessionGetOutputName(_session, i, _allocator, &name));
-    _outputs.insert({std::string(name), OutputMeta()});
+    OrtCheckStatus(g_ort->SessionGetOutputName(_session.get(), i, _allocator, &name));
+    _output_index.insert({std::string(name), i});
     // record names, order is important here.
     _output_names.push_back(strdup(name));
-    _output_tensors.push_back(nullptr);
     OrtCheckStatus(g_ort->AllocatorFree(_allocator, name));
+
+    OrtTypeInfo* typeinfo;
+    OrtCheckStatus(g_ort->SessionGetOutputTypeInfo(_session.get(), i, &typeinfo));
+    const OrtTensorTypeAndShapeInfo* tensor_info;
+    OrtCheckStatus(g_ort->CastTypeInfoToTensorInfo(typeinfo, &tensor_info));
+    bool dynamic = false;
+    if (tensor_info != NULL) {
+      size_t num_dims;
+      OrtCheckStatus(g_ort->GetDimensionsCount(tensor_info, &num_dims));
+      std::vector<int64_t> dims(num_dims);
+      OrtCheckStatus(g_ort->GetDimensions(tensor_info, reinterpret_cast<int64_t *>(dims.data()), num_dims));
+      for (size_t d = 1; d < num_dims; d++)
+        dynamic = dynamic || dims[d] < 0;
+    }
+    _output_dynamic.push_back(dynamic);
+    g_ort->ReleaseTypeInfo(typeinfo);
   }
-  g_ort->ReleaseStatus(status);
 }
 
 AlprONNXRuntime::~AlprONNXRuntime(void) {
-  if (_profile)
-    OrtCheckStatus(g_ort->DisableProfiling(_session_options));
-  g_ort->ReleaseSession(_session);
-  g_ort->ReleaseSessionOptions(_session_options);
+  // Only the runtime that created the session enabled profiling on it
+  if (_profile && _session_options.use_count() == 1)
+    OrtCheckStatus(g_ort->DisableProfiling(_session_options.get()));
   // When we use version > https://github.com/microsoft/onnxruntime/issues/1430
   // uncomment.
   // g_ort->ReleaseEnv(_env);
-  for (auto & x : _output_tensors)
-    g_ort->ReleaseValue(x);
+  ReleaseCachedOutputs();
   for (auto & x : _output_names) {
     free((void *)x);
     x = NULL;
@@ -197,56 +479,84 @@ bool AlprONNXRuntime::IsCuda(void) {
   return _proc_type != ORT_CPU;
 }
 
-// void AlprONNXRuntime::SetInputShape(const std::string & name, const std::vector<int64_t> & dims) {
-//   ALPR_PROF_SCOPE_START(alprsupport::Profiler::Get(), "AlprONNXRuntime::SetInputShape");
-//   bool updated_shape = _input_buffer_manager.SetTensorDims(name, dims);
-
-//   // if the input shape was update, release any output tensors that the network has allocated.
-//   // when the request with the new shape happens, the network will allocate new buffers for output tensors.
-//   if (updated_shape) {
-//     for (int i = 0; i < _output_tensors.size(); i++) {
-//       g_ort->ReleaseValue(_output_tensors[i]);
-//       _output_tensors[i] = NULL;
-//     }
-//   }
-//   ALPR_PROF_SCOPE_END(alprsupport::Profiler::Get());
-// }
+void AlprONNXRuntime::ReleaseCachedOutputs() {
+  for (auto & entry : _output_cache) {
+    for (auto & x : entry.second.tensors) {
+      if (x)
+        g_ort->ReleaseValue(x);
+    }
+  }
+  _output_cache.clear();
+  _current_outputs = NULL;
+}
+
+AlprONNXRuntime::CachedOutputs & AlprONNXRuntime::GetCachedOutputs() {
+  // The output shapes only depend on the input shapes, so those are the key
+  _output_key.clear();
+  _input_buffer_manager.AppendTensorDims(_output_key);
+  auto it = _output_cache.find(_output_key);
+  if (it != _output_cache.end())
+    return it->second;
+
+  if (_output_cache.size() >= kMaxCachedOutputShapes)
+    ReleaseCachedOutputs();
+  CachedOutputs & entry = _output_cache[_output_key];
+  entry.tensors.assign(_output_names.size(), nullptr);
+  entry.meta.resize(_output_names.size());
+  entry.described = false;
+  return entry;
+}
 
 void AlprONNXRuntime::Infer() {
   ALPR_PROF_SCOPE_START(alprsupport::Profiler::Get(), "AlprONNXRuntime::Infer");
   ALPR_PROF_SCOPE_START(alprsupport::Profiler::Get(), "AlprONNXRuntime::Run");
-  auto input_names = _input_buffer_manager.Names();
-  auto input_tensors = _input_buffer_manager.Tensors();
-  OrtValue** v = _output_tensors.data();
-  OrtCheckStatus(g_ort->Run(_session, NULL, input_names.data(), input_tensors.data(), input_tensors.size(),
-                            _output_names.data(), _output_names.size(), v));
+  const std::vector<const char*> & input_names = _input_buffer_manager.Names();
+  const std::vector<OrtValue*> & input_tensors = _input_buffer_manager.Tensors();
+  CachedOutputs & outputs = GetCachedOutputs();
+  // Dynamic outputs can't be filled in place, since this run may give them a different shape
+  for (size_t i = 0; i < outputs.tensors.size(); i++) {
+    if (_output_dynamic[i] && outputs.tensors[i] != NULL) {
+      g_ort->ReleaseValue(outputs.tensors[i]);
+      outputs.tensors[i] = NULL;
+    }
+  }
+  OrtCheckStatus(g_ort->Run(_session.get(), NULL, input_names.data(), input_tensors.data(), input_tensors.size(),
+                            _output_names.data(), _output_names.size(), outputs.tensors.data()));
+  _current_outputs = &outputs;
   ALPR_PROF_SCOPE_END(alprsupport::Profiler::Get());
-  ALPR_PROF_SCOPE_START(alprsupport::Profiler::Get(), "AlprONNXRuntime::Postprocessor");
 
-  for (int i = 0; i < _output_tensors.size(); i++) {
-    int is_tensor;
-    OrtCheckStatus(g_ort->IsTensor(_output_tensors[i], &is_tensor));
-    assert(is_tensor);
-    char* _name = NULL;
-    OrtCheckStatus(g_ort->SessionGetOutputName(_session, i, _allocator, &_name));
-    std::string name(_name);
-    OrtTensorTypeAndShapeInfo* tensor_info;
-    OrtCheckStatus(g_ort->GetTensorTypeAndShape(_output_tensors[i], &tensor_info));
-    ONNXTensorElementDataType type;
-    OrtCheckStatus(g_ort->GetTensorElementType(tensor_info, &type));
-    size_t num_dims;
-    OrtCheckStatus(g_ort->GetDimensionsCount(tensor_info, &num_dims));
-    std::vector<int64_t> & dims = _outputs[name].dims;
-    dims.resize(num_dims);
-    OrtCheckStatus(g_ort->GetDimensions(tensor_info, reinterpret_cast<int64_t *>(dims.data()), num_dims));
-    OrtCheckStatus(g_ort->GetTensorMutableData(_output_tensors[i], static_cast<void**>(&_outputs[name].data)));
-    OrtCheckStatus(g_ort->AllocatorFree(_allocator, _name));
-    g_ort->ReleaseTensorTypeAndShapeInfo(tensor_info);
+  // Shapes, types and data pointers of a cached entry don't change between runs, so only look them up once (every
+  // run for dynamic outputs)
+  ALPR_PROF_SCOPE_START(alprsupport::Profiler::Get(), "AlprONNXRuntime::Postprocessor");
+  for (size_t i = 0; i < outputs.tensors.size(); i++) {
+    if (!outputs.described || _output_dynamic[i])
+      DescribeOutput(outputs, i);
   }
+  outputs.described = true;
   ALPR_PROF_SCOPE_END(alprsupport::Profiler::Get());
   ALPR_PROF_SCOPE_END(alprsupport::Profiler::Get());
 }
 
+void AlprONNXRuntime::DescribeOutput(CachedOutputs & outputs, size_t index) {
+  if (outputs.tensors[index] == NULL) {
+    ALPR_ERROR << "AlprONNXRuntime::Run did not produce output " << _output_names[index];
+    exit(EXIT_FAILURE);
+  }
+  int is_tensor;
+  OrtCheckStatus(g_ort->IsTensor(outputs.tensors[index], &is_tensor));
+  assert(is_tensor);
+  OutputMeta & meta = outputs.meta[index];
+  OrtTensorTypeAndShapeInfo* tensor_info;
+  OrtCheckStatus(g_ort->GetTensorTypeAndShape(outputs.tensors[index], &tensor_info));
+  OrtCheckStatus(g_ort->GetTensorElementType(tensor_info, &meta.type));
+  size_t num_dims;
+  OrtCheckStatus(g_ort->GetDimensionsCount(tensor_info, &num_dims));
+  meta.dims.resize(num_dims);
+  OrtCheckStatus(g_ort->GetDimensions(tensor_info, reinterpret_cast<int64_t *>(meta.dims.data()), num_dims));
+  OrtCheckStatus(g_ort->GetTensorMutableData(outputs.tensors[index], static_cast<void**>(&meta.data)));
+  g_ort->ReleaseTensorTypeAndShapeInfo(tensor_info);
+}
+
 int AlprONNXRuntime::GetGpuId(void) {
   return _gpu_id;
 }
@@ -32,6 +32,8 @@
 #include <chrono>
 #include <string>
 #include <unordered_map>
+#include <map>
+#include <memory>
 #include <utility>
 #include <inttypes.h>
 #include <stdint.h>
@@ -56,9 +58,70 @@ namespace alpr {
 extern const OrtApi* g_ort;
 extern OrtEnv* g_env;
 
-void set_omp_to_synchronous();
+/*
+  How a session spreads its work over threads.  The defaults (one intra-op thread, sequential execution) suit
+  many concurrent single-threaded sessions; a low-latency deployment running one plate at a time wants more
+  intra-op threads instead.
+*/
+struct OrtThreadingConfig {
+  // 0 = let ORT pick (one per physical core)
+  int intra_op_threads;
+  // Only used with parallel_execution
+  int inter_op_threads;
+  // Run independent graph branches concurrently (ORT_PARALLEL) instead of one node at a time
+  bool parallel_execution;
+  // Idle pool threads spin waiting for work (lower latency) rather than block (less CPU)
+  bool allow_spinning;
+  // ORT affinity string for the intra-op threads, e.g. "1,2;3,4" (needs ORT 1.14+, 1.15+ with the global thread
+  // pool); empty = OS scheduling
+  std::string affinity;
+  // Run every session on one process-wide pool held by the env instead of a pool per session.  Only takes
+  // effect if it is requested by the first runtime created in the process, since that creates the env.
+  bool use_global_thread_pool;
+  // OMP_NUM_THREADS / OMP_WAIT_POLICY for OpenMP builds of ORT (0 / empty = leave alone).  Exported by the first
+  // runtime created in the process, before ORT starts its threads; a variable already set is never replaced.
+  int omp_num_threads;
+  std::string omp_wait_policy;
+  OrtThreadingConfig()
+      : intra_op_threads(1), inter_op_threads(1), parallel_execution(false), allow_spinning(true),
+        use_global_thread_pool(false), omp_num_threads(0) {}
+};
+
+// Exports the configured OpenMP settings (see OrtThreadingConfig).  setenv isn't thread-safe, so this runs once,
+// under the env lock, before the first env is created.  Has no effect once OpenMP has started.
+void set_omp_to_synchronous(const OrtThreadingConfig & threading);
 void OrtCheckStatus(OrtStatus* status);
-std::vector<char> read_model(const char* filename, std::string enc_key_name);
+
+/*
+  Bytes of a model file, ready for CreateSessionFromArray.  Plain models are mapped read-only rather than copied,
+  so there is no private copy of the file next to the one ORT builds, and processes loading the same model share
+  its page-cache pages.  Drop it once the session exists.
+*/
+class ModelData {
+ public:
+  ModelData() : _data(NULL), _size(0), _mapped(false) { }
+  ~ModelData() { Release(); }
+
+  // Map `filename' read-only.  Returns false if it can't be mapped (the caller can fall back to Allocate)
+  bool Map(const char* filename);
+  // Heap buffer of `size' bytes for data that has to be transformed on load
+  char * Allocate(size_t size);
+  void Release();
+
+  const void * data() const { return _data; }
+  size_t size() const { return _size; }
+  bool mapped() const { return _mapped; }
+
+ private:
+  ModelData(const ModelData &);
+  ModelData & operator=(const ModelData &);
+
+  char * _data;
+  size_t _size;
+  bool _mapped;
+};
+
+void read_model(const char* filename, std::string enc_key_name, ModelData & model);
 
 
 typedef enum {
@@ -67,10 +130,26 @@ typedef enum {
   ORT_TRT
 } ProcessingProvider;
 
+// Maps the C++ element type to the ONNX element type, used to check typed access to tensors
+template<typename T> struct OrtElementType;
+template<> struct OrtElementType<float> {
+  static const ONNXTensorElementDataType value = ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT;
+};
+template<> struct OrtElementType<uint8_t> {
+  static const ONNXTensorElementDataType value = ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8;
+};
+template<> struct OrtElementType<int32_t> {
+  static const ONNXTensorElementDataType value = ONNX_TENSOR_ELEMENT_DATA_TYPE_INT32;
+};
+template<> struct OrtElementType<int64_t> {
+  static const ONNXTensorElementDataType value = ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64;
+};
+
 struct OutputMeta {
   void * data;
   std::vector<int64_t> dims;
-  OutputMeta() : data(NULL) { }
+  ONNXTensorElementDataType type;
+  OutputMeta() : data(NULL), type(ONNX_TENSOR_ELEMENT_DATA_TYPE_UNDEFINED) { }
   ~OutputMeta() {
     // *data is owned by ONNXRuntime.
     // if (data)
@@ -78,19 +157,44 @@ struct OutputMeta {
   }
 };
 
+// Zero-copy view of an output tensor.  Valid until the next Infer() on the same runtime.
+template<typename T>
+struct TensorView {
+  T * data;
+  const std::vector<int64_t> * dims;
+  int64_t dim(size_t i) const { return (*dims)[i]; }
+  size_t num_dims() const { return dims->size(); }
+};
+
 class AlprONNXRuntime {
  public:
   int width, height;
   AlprONNXRuntime(const std::string & model_path, ProcessingProvider proc_type, int gpu_id, bool pad_to_max = false,
-                  std::string logid = "alpredge", int max_batch_size = 1);
+                  std::string logid = "alpredge", int max_batch_size = 1, std::string enc_key_name = "edge",
+                  const OrtThreadingConfig & threading = OrtThreadingConfig());
+  // Same from model bytes already in memory (e.g. a mapped runtime bundle).  `encrypted' bytes are decrypted with
+  // enc_key_name first, as for a .enc file.
+  AlprONNXRuntime(const void * model_data, size_t model_size, bool encrypted, const std::string & model_name,
+                  ProcessingProvider proc_type, int gpu_id, bool pad_to_max = false,
+                  std::string logid = "alpredge", int max_batch_size = 1, std::string enc_key_name = "edge",
+                  const OrtThreadingConfig & threading = OrtThreadingConfig());
   ~AlprONNXRuntime(void);
 
+  /*
+    Returns a runtime that shares this one's session (and so the model weights), but has its own input buffers and
+    output tensors.  Run is thread-safe in ORT, so each worker thread can Infer() on its own context concurrently.
+    The caller owns the returned object; it must not outlive this runtime's process-wide env.
+  */
+  AlprONNXRuntime * CreateContext();
+
   // void SetInputShape(const std::string & name, const std::vector<int64_t> & dims);
 
   void Infer();
   bool IsCuda(void);
   int GetGpuId(void);
   AlprGpuSupport * GetGpuSupport(void);
+  // Where CPU input buffers are allocated; contexts created afterwards use the same arena.  Not owned.
+  void SetTensorArena(TensorArena * arena) { _input_buffer_manager.SetTensorArena(arena); }
 
   std::vector<int64_t> GetCurInputBufferDims(const std::string & name) {
     std::vector<int64_t> res = _input_buffer_manager.GetCurRawBufferDims(name);
@@ -100,6 +204,9 @@ class AlprONNXRuntime {
     std::vector<int64_t> res = _input_buffer_manager.GetProtoRawBufferDims(name);
     return res;
   }
+  ONNXTensorElementDataType GetInputType(const std::string & name) {
+    return _input_buffer_manager.GetTensorDesc(name).elem_type;
+  }
 
   template<typename T>
   T * GetInputBuffer(const std::string & name, const std::vector<int64_t> & batch_dims, size_t * buf_size, bool cpu = false) {
@@ -114,36 +221,76 @@ class AlprONNXRuntime {
     if (cpu && _input_buffer_manager.IsGpuBuffer(name))
       _input_buffer_manager.MoveToCpu(name);
 
-    bool updated_shape = _input_buffer_manager.SetTensorDims(name, batch_dims);
-    // if the input shape was update, release any output tensors that the network has allocated.
-    // when the request with the new shape happens, the network will allocate new buffers for output tensors.
-    if (updated_shape) {
-      for (int i = 0; i < _output_tensors.size(); i++) {
-        g_ort->ReleaseValue(_output_tensors[i]);
-        _output_tensors[i] = NULL;
-      }
-    }
+    // Output tensors are cached per input shape (see Infer), so a shape change doesn't release anything here
+    _input_buffer_manager.SetTensorDims(name, batch_dims);
 
     *buf_size = _input_buffer_manager.GetRawBufferSize(name);
     T * res = static_cast<T *>(_input_buffer_manager.GetRawBuffer(name));
     return res;
   }
 
+  // Use memory that the caller owns (e.g., crops already prepared on the GPU) as the input instead of our buffer
+  void BindInputBuffer(const std::string & name, const std::vector<int64_t> & batch_dims, void * data, size_t size,
+                       bool on_gpu) {
+    _input_buffer_manager.BindExternalBuffer(name, batch_dims, data, size, on_gpu);
+  }
+
   template<typename T>
   T * GetOutputBuffer(const std::string & name, std::vector<int64_t> & dims) {
-    dims = _outputs[name].dims;
-    return static_cast<T *>(_outputs[name].data);
+    OutputMeta & meta = _current_outputs->meta[GetOutputIndex(name)];
+    dims = meta.dims;
+    return static_cast<T *>(meta.data);
+  }
+
+  // Output positions are fixed for the life of the session; resolve them once and use GetOutputView(index)
+  size_t GetOutputIndex(const std::string & name) {
+    auto it = _output_index.find(name);
+    if (it == _output_index.end()) {
+      ALPR_ERROR << "AlprONNXRuntime::Output " << name << " not found";
+      exit(EXIT_FAILURE);
+    }
+    return it->second;
+  }
+  bool HasOutput(const std::string & name) {
+    return _output_index.count(name) > 0;
+  }
+
+  template<typename T>
+  TensorView<T> GetOutputView(size_t index) {
+    OutputMeta & meta = _current_outputs->meta[index];
+    if (meta.type != OrtElementType<T>::value) {
+      ALPR_ERROR << "Output " << _output_names[index] << " has element type " << meta.type << ", expected "
+                 << OrtElementType<T>::value;
+      exit(EXIT_FAILURE);
+    }
+    TensorView<T> view;
+    view.data = static_cast<T *>(meta.data);
+    view.dims = &meta.dims;
+    return view;
   }
 
  private:
+  // Outputs of one input shape.  Passing the same OrtValues back to Run lets ORT fill them in place.
+  struct CachedOutputs {
+    std::vector<OrtValue*> tensors;
+    std::vector<OutputMeta> meta;
+    bool described;
+  };
+
+  AlprONNXRuntime(const AlprONNXRuntime & shared);
+  void CreateSessionOptions(ProcessingProvider proc_type, const OrtThreadingConfig & threading);
+  void CreateSession(const void * model_data, size_t model_size, const std::string & model_name);
+  void RegisterNodes();
+  CachedOutputs & GetCachedOutputs();
+  void DescribeOutput(CachedOutputs & outputs, size_t index);
+  void ReleaseCachedOutputs();
   void MakeNetworkInput(const string & node_name, float * buf, size_t buf_size);
   void AllocateInputBuffers();
 
 
   OrtEnv* _env;
-  OrtSession* _session;
-  OrtMemoryInfo* _memory_info;
-  OrtSessionOptions* _session_options;
+  std::shared_ptr<OrtSession> _session;
+  std::shared_ptr<OrtSessionOptions> _session_options;
 
   BufferManager _input_buffer_manager;
   const ProcessingProvider _proc_type;
@@ -153,8 +300,13 @@ class AlprONNXRuntime {
   const int _max_batch_size;
   const bool _pad_to_max;
   std::vector<const char *> _output_names;
-  std::unordered_map<std::string, OutputMeta> _outputs;
-  std::vector<OrtValue*> _output_tensors;
+  std::unordered_map<std::string, size_t> _output_index;
+  // Outputs with a symbolic dimension past the batch (e.g. a sequence length the model decides at run time).  Their
+  // shape can change from run to run at the same input shape, so ORT allocates them on every run.
+  std::vector<bool> _output_dynamic;
+  std::map<std::vector<int64_t>, CachedOutputs> _output_cache;
+  std::vector<int64_t> _output_key;
+  CachedOutputs * _current_outputs;
   OrtAllocator* _allocator;
 };
 }  // namespace alpr
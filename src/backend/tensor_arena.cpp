@@ -0,0 +1,165 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+
+#include "tensor_arena.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <alprlog.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+namespace alpr {
+
+namespace {
+#ifdef __linux__
+// From <numaif.h>, which would otherwise pull in libnuma just for these
+const int ALPR_MPOL_PREFERRED = 1;
+const size_t kMaxNumaNodes = 1024;
+
+// Prefer (rather than require) the node, so a full node falls back to another instead of failing the fault
+void bind_to_node(void * addr, size_t size, int node) {
+  if (node < 0 || static_cast<size_t>(node) >= kMaxNumaNodes)
+    return;
+  const size_t bits_per_word = 8 * sizeof(unsigned long);
+  unsigned long nodemask[kMaxNumaNodes / (8 * sizeof(unsigned long))];
+  memset(nodemask, 0, sizeof(nodemask));
+  nodemask[node / bits_per_word] = 1UL << (node % bits_per_word);
+  // Fails with ENOSYS on kernels built without NUMA, where there is only one node anyway
+  syscall(SYS_mbind, addr, size, ALPR_MPOL_PREFERRED, nodemask, kMaxNumaNodes, 0);
+}
+#endif
+
+size_t round_up(size_t size, size_t multiple) {
+  return (size + multiple - 1) / multiple * multiple;
+}
+}  // namespace
+
+int TensorArena::CurrentNode() {
+#ifdef __linux__
+  unsigned int cpu = 0, node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+    return -1;
+  return static_cast<int>(node);
+#else
+  return -1;
+#endif
+}
+
+TensorArena::TensorArena(bool huge_pages, bool numa_local) : _huge_pages(huge_pages), _numa_local(numa_local) {
+#ifndef __linux__
+  if (huge_pages || numa_local)
+    ALPR_WARN << "Huge page and NUMA tensor placement are only supported on Linux";
+  _huge_pages = false;
+  _numa_local = false;
+#endif
+}
+
+TensorArena * TensorArena::Default() {
+  static TensorArena arena(false, false);
+  return &arena;
+}
+
+bool TensorArena::UsesMapping(size_t size) const {
+  return (_huge_pages && size >= kHugePageSize) || _numa_local;
+}
+
+void * TensorArena::Allocate(size_t size) {
+  if (size == 0)
+    return NULL;
+  void * buffer = NULL;
+#ifdef __linux__
+  if (UsesMapping(size)) {
+    bool huge = _huge_pages && size >= kHugePageSize;
+    size_t mapped_size = round_up(size, huge ? kHugePageSize : sysconf(_SC_PAGESIZE));
+    size_t reserve_size = huge ? mapped_size + kHugePageSize : mapped_size;
+    char * region = static_cast<char *>(mmap(NULL, reserve_size, PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (region == MAP_FAILED) {
+      ALPR_WARN << "Could not map a " << reserve_size << " byte tensor buffer (" << strerror(errno)
+                << "); using ordinary memory";
+      region = NULL;
+    }
+    char * start = region;
+    if (region != NULL && huge) {
+      // Trim the reservation to a 2MB-aligned range so the whole buffer can sit on huge pages
+      start = reinterpret_cast<char *>(round_up(reinterpret_cast<uintptr_t>(region), kHugePageSize));
+      if (start > region)
+        munmap(region, start - region);
+      size_t tail = (region + reserve_size) - (start + mapped_size);
+      if (tail > 0)
+        munmap(start + mapped_size, tail);
+      madvise(start, mapped_size, MADV_HUGEPAGE);
+    }
+    if (region != NULL) {
+      if (_numa_local)
+        bind_to_node(start, mapped_size, CurrentNode());
+      std::lock_guard<std::mutex> lock(_mapped_mutex);
+      _mapped.insert(start);
+      buffer = start;
+    }
+  }
+#endif
+  if (buffer == NULL) {
+#ifdef _WIN32
+    buffer = _aligned_malloc(size, kAlignment);
+#else
+    if (posix_memalign(&buffer, kAlignment, size) != 0)
+      buffer = NULL;
+#endif
+    if (buffer == NULL)
+      return NULL;
+  }
+  // Fault every page in now (on the bound node) rather than during the first inference
+  memset(buffer, 0, size);
+  return buffer;
+}
+
+void TensorArena::Free(void * ptr, size_t size) {
+  if (ptr == NULL)
+    return;
+#ifdef __linux__
+  if (UsesMapping(size)) {
+    bool mapped;
+    {
+      std::lock_guard<std::mutex> lock(_mapped_mutex);
+      mapped = _mapped.erase(ptr) > 0;
+    }
+    if (mapped) {
+      bool huge = _huge_pages && size >= kHugePageSize;
+      munmap(ptr, round_up(size, huge ? kHugePageSize : sysconf(_SC_PAGESIZE)));
+      return;
+    }
+  }
+#endif
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+}  // namespace alpr
@@ -0,0 +1,69 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+
+#ifndef OPENALPR_BACKEND_TENSOR_ARENA_H_
+#define OPENALPR_BACKEND_TENSOR_ARENA_H_
+
+#include <stddef.h>
+#include <mutex>
+#include <unordered_set>
+
+namespace alpr {
+
+/*
+  Allocator for CPU tensor buffers.  Every buffer is 64-byte aligned and is faulted in when it is allocated, so the
+  first inference doesn't take the page faults.  Buffers of at least kHugePageSize can be put on transparent huge
+  pages, and all of them can be bound to the NUMA node of the thread that calls Allocate.  BufferManager allocates
+  lazily, on the first GetInputBuffer of its context, so a context's tensors live wherever that first call ran;
+  Ocr makes sure it runs on the thread that created the workspace, and hands workspaces out by node.  When the
+  mapping can't be made (e.g. no address space left), the buffer falls back to ordinary aligned memory.
+
+  The buffers themselves are sized once for max_batch by BufferManager; the arena only decides where they live.
+  One arena is shared by every context created from a runtime.
+*/
+class TensorArena {
+ public:
+  static const size_t kAlignment = 64;
+  static const size_t kHugePageSize = 2 * 1024 * 1024;
+
+  TensorArena(bool huge_pages, bool numa_local);
+
+  // Plain aligned buffers, used by any BufferManager that hasn't been given an arena
+  static TensorArena * Default();
+
+  void * Allocate(size_t size);
+  // `size' must be the size passed to Allocate
+  void Free(void * ptr, size_t size);
+
+  bool HugePages() const { return _huge_pages; }
+  bool NumaLocal() const { return _numa_local; }
+
+  // NUMA node of the CPU the calling thread is running on, or -1 when it can't be told
+  static int CurrentNode();
+
+ private:
+  bool UsesMapping(size_t size) const;
+
+  bool _huge_pages;
+  bool _numa_local;
+  // Buffers that came from mmap; the rest of them (including failed mappings) came from posix_memalign
+  std::mutex _mapped_mutex;
+  std::unordered_set<void *> _mapped;
+};
+
+}  // namespace alpr
+#endif  // OPENALPR_BACKEND_TENSOR_ARENA_H_
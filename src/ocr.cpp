@@ -15,13 +15,20 @@
  */
 
 #include "ocr.h"
+#include "ocr_cache.h"
 #include "backend/onnxruntime.h"
+#include "backend/tensor_arena.h"
+#include "preprocess/crop_kernel.h"
 #include "opencv2/imgproc/imgproc.hpp"
-#include <alprsupport/json.hpp>
 #include <alprsupport/filesystem.h>
 #include <alprsupport/profiler.h>
+#include <alprsupport/string_utils.h>
 #include <alprlog.h>
 #include <alprgpusupport.h>
+#include <alprsupport/timing.h>
+#include <algorithm>
+#include <sstream>
+#include <thread>
 #include <vector>
 
 using namespace std;
@@ -30,233 +37,687 @@ using namespace cv;
 #define MIN_OCR_OVERALL_CONFIDENCE 0.1f
 #define MAX_OCR_OVERALL_CONFIDENCE_MULTIPLIER 0.95f
 #define MIN_OCR_CONFIDENCE_ADJUSTMENT 0.6f
+#define MIN_OCR_CHAR_CONFIDENCE 0.0005f
 
 namespace alpr {
+namespace {
+// Ids come out of the network as int64; anything outside the table decodes to an empty token
+const char* token_name(const std::vector<std::string>& names, int64_t id) {
+  uint32_t index = static_cast<uint32_t>(id & 0xFFFFFFFF);
+  return index < names.size() ? names[index].c_str() : "";
+}
+
+// Scale for the character confidences of a plate read with `overall_confidence' (0-1)
+float character_confidence_multiplier(float overall_confidence) {
+  float multiplier = ((1.0 - MIN_OCR_CONFIDENCE_ADJUSTMENT) * overall_confidence) + MIN_OCR_CONFIDENCE_ADJUSTMENT;
+  // Don't go above MAX_OCR_OVERALL_CONFIDENCE_MULTIPLIER, ever...
+  return multiplier * MAX_OCR_OVERALL_CONFIDENCE_MULTIPLIER;
+}
+
+// Batch sizes sent to the network under an ocr_batch_buckets policy, ascending and ending at max_batch.
+//   exact  - no padding; only max_batch is listed (for warm-up)
+//   clamp  - multiples of clamp_size
+//   pow2   - powers of two
+//   1,4,16 - the listed sizes
+// Returns an empty list for a policy it doesn't understand.
+std::vector<int> batch_buckets_for_policy(const std::string& policy, int max_batch, int clamp_size) {
+  std::vector<int> buckets;
+  if (policy == "exact") {
+    // nothing but max_batch
+  } else if (policy == "clamp") {
+    for (int size = clamp_size; size < max_batch; size += clamp_size)
+      buckets.push_back(size);
+  } else if (policy == "pow2") {
+    for (int size = 1; size < max_batch; size *= 2)
+      buckets.push_back(size);
+  } else {
+    std::stringstream ss(policy);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+      alprsupport::trim(item);
+      char* end = NULL;
+      long size = strtol(item.c_str(), &end, 10);
+      if (item.empty() || *end != '\0' || size <= 0)
+        return std::vector<int>();
+      if (size < max_batch)
+        buckets.push_back(size);
+    }
+    std::sort(buckets.begin(), buckets.end());
+    buckets.erase(std::unique(buckets.begin(), buckets.end()), buckets.end());
+  }
+  buckets.push_back(max_batch);
+  return buckets;
+}
+}  // namespace
+
 Ocr::Ocr(Config* config) {
   this->config = config;
   _initialized = false;
   has_regions = false;
+  has_sequence_lengths = false;
+  decode_top1 = false;
+  input_nhwc = false;
+  input_bgr = false;
+  input_type = ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT;
+  input_tensor_size = 0;
+  pad_to_buckets = false;
+  num_regions = 0;
   this->total_crops_processed = 0;
-  set_omp_to_synchronous();
-  input_tensor_values = NULL;
-  input_tensor_max_size = 0;
-
-  std::string ocr_root = "/home/mhill/Downloads/ocr_test/runtime";
-
-  // std::string ocr_root = config->getOCRPrefix() + config->ocrLanguage;
-  std::string ocr_model_path = ocr_root + "/ocr_x";
-  if (!alprsupport::fileExists(ocr_model_path.c_str()))
-    ocr_model_path = ocr_root + "/ocr_x.enc";
-
-  if (!alprsupport::fileExists(ocr_model_path.c_str())) {
-    ALPR_ERROR << "Unable to find OCR runtime data: " << ocr_model_path;
+  preprocess_pool = NULL;
+  pipeline_pool = NULL;
+  result_cache = NULL;
+  backend = NULL;
+  tensor_arena = new TensorArena(config->ocr_huge_pages, config->ocr_numa_local);
+  set_preprocess_threads(config->ocr_preprocess_threads);
+  max_workspaces = config->ocr_max_concurrency > 0 ? config->ocr_max_concurrency
+                                                   : std::max<int>(1, std::thread::hardware_concurrency());
+
+  // The same directory PostProcess reads, so both share one RuntimeData
+  std::string ocr_root = config->getOCRLanguageDir();
+  // e.g. ocr_model_variant "int8" loads the statically quantized ocr_x_int8
+  std::string ocr_model_name = "ocr_x";
+  if (!config->ocr_model_variant.empty())
+    ocr_model_name += "_" + config->ocr_model_variant;
+
+  // Runtime constants, token tables and the country's templates come from ocr_root/runtime.bundle, or else from
+  // ocr_config.json and the .patterns file.  They are shared with every other Ocr and PostProcess using them.
+  std::string patterns_path = config->getPostProcessRuntimeDir() + "/" + config->getCountry() + ".patterns";
+  runtime_data = RuntimeData::acquire(ocr_root, config->getPostProcessRuntimeDir(), config->getCountry(),
+                                      config->postProcessRegexLetters, config->postProcessRegexNumbers);
+  if (!runtime_data->loaded())
     return;
+  std::string ocr_config_path = runtime_data->getSources()[0];
+
+  // A bundled model is read in place from the mapped bundle
+  size_t model_size = 0;
+  bool model_encrypted = false;
+  const void* model_data = runtime_data->modelData(ocr_model_name, model_size, model_encrypted);
+  std::string ocr_model_path = ocr_root + "/" + ocr_model_name;
+  if (model_data == NULL) {
+    if (!alprsupport::fileExists(ocr_model_path.c_str()))
+      ocr_model_path = ocr_root + "/" + ocr_model_name + ".enc";
+    if (!alprsupport::fileExists(ocr_model_path.c_str())) {
+      ALPR_ERROR << "Unable to find OCR runtime data: " << ocr_model_path;
+      return;
+    }
   }
 
-  std::string ocr_config_path = ocr_root + "/ocr_config.json";
-  if (!alprsupport::fileExists(ocr_config_path.c_str())) {
-    ALPR_ERROR << "Unable to find OCR configuration: " << ocr_config_path;
+  // Define input/output nodes and shapes
+  const OcrRuntimeConstants& constants = runtime_data->ocrConstants();
+  topk = constants.topk;
+  crop_width = constants.crop_width;
+  crop_height = constants.crop_height;
+  max_timesteps = constants.max_timesteps;
+  decode_top1 = constants.top1_only != 0;
+  // Models that cast/transpose/swap channels inside the graph take the crop as it comes out of the warp:
+  // "input_layout": "NHWC" and "input_channel_order": "BGR", either at the top level or for one model variant
+  // under "model_inputs": {"ocr_x_nhwc": {...}}.  The element type comes from the model itself.
+  OcrModelInput input_format = runtime_data->modelInput(ocr_model_name);
+  std::string input_layout = input_format.layout;
+  std::string input_channel_order = input_format.channel_order;
+  if ((input_layout != "NCHW" && input_layout != "NHWC") ||
+      (input_channel_order != "RGB" && input_channel_order != "BGR")) {
+    ALPR_ERROR << "Unsupported OCR input format " << input_layout << "/" << input_channel_order;
     return;
   }
+  input_nhwc = input_layout == "NHWC";
+  input_bgr = input_channel_order == "BGR";
+
+  const std::vector<std::string>& char_tokens = runtime_data->charTokens();
+  const std::vector<std::string>& region_tokens = runtime_data->regionTokens();
+  num_regions = constants.num_regions;
+
+  // Resolve the special tokens once, so decoding compares ids instead of strings
+  char_token_kinds.assign(char_tokens.size(), OCR_TOKEN_LETTER);
+  for (uint32_t i = 0; i < char_tokens.size(); i++) {
+    if (char_tokens[i] == "*" || char_tokens[i] == "^")
+      char_token_kinds[i] = OCR_TOKEN_PADDING;
+    else if (char_tokens[i] == "~")
+      char_token_kinds[i] = OCR_TOKEN_NEGATIVE;
+    else if (char_tokens[i] == "$")
+      char_token_kinds[i] = OCR_TOKEN_END;
+  }
+  char_decoder = OcrTokenDecoder(char_token_kinds, MIN_OCR_CHAR_CONFIDENCE);
+
+  has_regions = num_regions > 0;
+
+  if (config->ocr_beam_width > 0) {
+    // The same templates PostProcess checks, compiled against this model's tokens.  Without them the search still
+    // returns the best plates, just unconstrained.
+    const PatternMatcher& pattern_matcher = runtime_data->patternMatcher();
+    if (pattern_matcher.empty())
+      ALPR_WARN << "No plate templates at " << patterns_path << ", the OCR beam search is unconstrained";
+    std::vector<uint32_t> token_classes(char_tokens.size());
+    for (uint32_t i = 0; i < char_tokens.size(); i++)
+      token_classes[i] = pattern_matcher.symbolClass(char_tokens[i]);
+    region_templates.assign(region_tokens.size(), -1);
+    for (uint32_t i = 0; i < region_tokens.size(); i++)
+      region_templates[i] = pattern_matcher.regionIndex(region_tokens[i]);
+    beam_search = OcrBeamSearch(char_token_kinds, token_classes, pattern_matcher.empty() ? NULL : &pattern_matcher,
+                                MIN_OCR_CHAR_CONFIDENCE, config->ocr_beam_width, config->ocr_beam_candidates);
+  }
 
-  // Read runtime constants from JSON
-  std::ifstream ifs(ocr_config_path);
-  nlohmann::json runtime = nlohmann::json::parse(ifs);
-
-  // Define input/output nodes and shapes
-  topk = runtime["topk"];
-  crop_width = runtime["crop_width"];
-  crop_height = runtime["crop_height"];
-  max_timesteps = runtime["max_timesteps"];
-
-  // Fill the char toke and region token maps from the JSON values
-  for (auto & x : runtime["region_idx2name"].items())
-    region_name_map[stoi(x.key())] = x.value();
-
-  for (auto & x : runtime["idx2char"].items())
-    char_name_map[stoi(x.key())] = x.value();
-
-  has_regions = region_name_map.size() > 0;
-  input_tensor_size = crop_height * crop_width * crop_channels * sizeof(float);
-  // Initialize session options if needed
-  OrtCheckStatus(g_ort->CreateSessionOptions(&session_options));
-  OrtCheckStatus(g_ort->SetIntraOpNumThreads(session_options, 1));
-  OrtCheckStatus(g_ort->SetSessionGraphOptimizationLevel(session_options, ORT_ENABLE_ALL));
-
-  // g_ort->EnableProfiling(session_options, "onnxprof");
   // Create session and load model into memory
+  ProcessingProvider provider = ORT_CPU;
   if (config->hardware_acceleration == ALPRCONFIG_NVIDIA_GPU) {
-    // GPU
-    const bool prefer_tensorrt = false;
-    AlprGpuSupport* alpr_gpu_support = AlprGpuSupport::getInstance(config->gpu_id);
-    alpr_gpu_support->set_onnxruntime_gpu(session_options, prefer_tensorrt);
-
+    // GPU (CUDA rather than TensorRT)
+    provider = ORT_CUDA;
     const int OCR_BATCH_MULTIPLE = 4;
     this->max_batch = config->gpu_batch_size * OCR_BATCH_MULTIPLE;
-    this->batch_clamp_size = min(10, config->gpu_batch_size / 2);
+    this->batch_clamp_size = std::max(1, min(10, config->gpu_batch_size / 2));
   } else {
     // CPU
     this->max_batch = 100;
+    this->batch_clamp_size = 10;
+    // One thread prepares the next sub-batch and one decodes the previous one
+    if (config->ocr_pipeline)
+      pipeline_pool = new alprsupport::WorkerPool(2);
   }
-  std::vector<char> filedata = read_model(ocr_model_path.c_str(), "ocr");
-  OrtCheckStatus(g_ort->CreateSessionFromArray(g_env, filedata.data(), filedata.size(), session_options, &session));
+  if (config->ocr_pipeline && pipeline_pool == NULL)
+    ALPR_WARN << "ocr_pipeline only applies to CPU inference; GPU crops share one device buffer";
+
+  // GPU caching for the CUDA provider is goofy.  For every different batch size, it goes through a caching
+  // operation which is slow. For example, if we have a max 40 image batch, and pass 6 images in, the first
+  // time we do this it will take 300ms, the second time ~5ms.  As a mitigation, batches are padded up to one of
+  // a few fixed sizes, and each of those is run once before the first real plate.
+  std::string bucket_policy = config->ocr_batch_buckets;
+  if (bucket_policy.empty())
+    bucket_policy = config->hardware_acceleration == ALPRCONFIG_NVIDIA_GPU ? "clamp" : "exact";
+  pad_to_buckets = bucket_policy != "exact";
+  batch_buckets = batch_buckets_for_policy(bucket_policy, max_batch, batch_clamp_size);
+  if (batch_buckets.empty()) {
+    ALPR_ERROR << "Invalid ocr_batch_buckets: " << bucket_policy;
+    return;
+  }
+  OrtThreadingConfig threading;
+  threading.intra_op_threads = config->ocr_intra_op_threads;
+  threading.inter_op_threads = config->ocr_inter_op_threads;
+  threading.parallel_execution = config->ocr_parallel_execution;
+  threading.allow_spinning = config->ocr_thread_spinning;
+  threading.affinity = config->ocr_thread_affinity;
+  threading.use_global_thread_pool = config->ocr_global_thread_pool;
+  threading.omp_num_threads = config->ocr_omp_num_threads;
+  threading.omp_wait_policy = config->ocr_omp_wait_policy;
+  if (model_data != NULL) {
+    backend = new AlprONNXRuntime(model_data, model_size, model_encrypted, ocr_model_name, provider, config->gpu_id,
+                                  false, "ocr", max_batch, "ocr", threading);
+  } else {
+    backend = new AlprONNXRuntime(ocr_model_path, provider, config->gpu_id, false, "ocr", max_batch, "ocr",
+                                  threading);
+  }
+  backend->SetTensorArena(tensor_arena);
+
+  // Output positions never change, so look them up once rather than by name on every batch
+  input_name = "images";
+  // Quantized models may take the 0-255 levels as uint8 instead of float; either way the values are the same
+  input_type = backend->GetInputType(input_name);
+  if (input_type != ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT && input_type != ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8) {
+    ALPR_ERROR << "Unsupported OCR input element type " << input_type << " in " << ocr_model_path;
+    return;
+  }
+  if ((input_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8 || input_nhwc || input_bgr) && provider != ORT_CPU) {
+    ALPR_ERROR << "OCR models with uint8, NHWC or BGR input are CPU only; GPU crops are prepared as float RGB planes";
+    return;
+  }
+  std::vector<int64_t> model_dims = backend->GetProtoInputBufferDims(input_name);
+  std::vector<int64_t> expected_dims = get_input_shape(1);
+  bool dims_match = model_dims.size() == expected_dims.size();
+  for (uint32_t i = 1; dims_match && i < model_dims.size(); i++)
+    dims_match = model_dims[i] < 0 || model_dims[i] == expected_dims[i];
+  if (!dims_match) {
+    ALPR_ERROR << "OCR model input doesn't match the " << input_layout << " " << crop_width << "x" << crop_height
+               << " crops in " << ocr_config_path;
+    return;
+  }
+  input_tensor_size = crop_height * crop_width * crop_channels *
+                      (input_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8 ? sizeof(uint8_t) : sizeof(float));
+  char_ids_output = backend->GetOutputIndex("character_ids");
+  char_confids_output = backend->GetOutputIndex("character_confidences");
+  if (has_regions) {
+    region_ids_output = backend->GetOutputIndex("region_ids");
+    region_confids_output = backend->GetOutputIndex("region_confidences");
+  }
+  // Models that stop early may also say how many timesteps each crop used; the rest are never read
+  const std::string& sequence_lengths_name = runtime_data->sequenceLengthOutput();
+  has_sequence_lengths = backend->HasOutput(sequence_lengths_name);
+  if (has_sequence_lengths)
+    sequence_lengths_output = backend->GetOutputIndex(sequence_lengths_name);
+  if (config->ocr_cache_size > 0)
+    result_cache = new OcrResultCache(config->ocr_cache_size, config->ocr_cache_ttl_ms,
+                                      config->ocr_cache_max_hamming, config->ocr_cache_geometry_cell);
+  if (config->ocr_warmup)
+    warm_up();
   _initialized = true;
 }
 
+int Ocr::padded_batch_size(size_t num_crops) {
+  if (!pad_to_buckets)
+    return num_crops;
+  std::vector<int>::const_iterator bucket = std::lower_bound(batch_buckets.begin(), batch_buckets.end(),
+                                                             static_cast<int>(num_crops));
+  return bucket == batch_buckets.end() ? max_batch : *bucket;
+}
+
+void Ocr::warm_up() {
+  // The per-shape setup lives in the shared session, so one workspace is enough to warm it for all of them
+  OcrWorkspaceLease workspace(*this);
+  OcrStage& stage = workspace->stages[0];
+  AlprONNXRuntime* context = stage.backend;
+  // Sized for the largest bucket once; every warm-up batch reads a prefix of it
+  size_t host_crops_size = input_tensor_size * max_batch;
+  float* host_crops = NULL;
+  if (config->hardware_acceleration == ALPRCONFIG_NVIDIA_GPU)
+    host_crops = static_cast<float*>(tensor_arena->Allocate(host_crops_size));
+  for (uint32_t i = 0; i < batch_buckets.size(); i++) {
+    int batch_size = batch_buckets[i];
+    timespec start_time, end_time;
+    alprsupport::getTimeMonotonic(&start_time);
+
+    size_t input_memory_size = input_tensor_size * batch_size;
+    stage.input_dims[0] = batch_size;
+    if (config->hardware_acceleration == ALPRCONFIG_NVIDIA_GPU) {
+      // Same binding as the real GPU crops, which are handed over as host memory
+      context->BindInputBuffer(input_name, stage.input_dims, host_crops, input_memory_size, false);
+    } else {
+      uint8_t* input_tensor_values = context->GetInputBuffer<uint8_t>(input_name, stage.input_dims,
+                                                                     &input_memory_size, true);
+      memset(input_tensor_values, 0, input_tensor_size * batch_size);
+    }
+    context->Infer();
+
+    alprsupport::getTimeMonotonic(&end_time);
+    ALPR_INFO << "OCR warm-up: batch " << batch_size << " took " << alprsupport::diffclock(start_time, end_time)
+              << " ms";
+  }
+  tensor_arena->Free(host_crops, host_crops_size);
+}
+
 
 Ocr::~Ocr() {
-  g_ort->ReleaseSession(session);
-  g_ort->ReleaseSessionOptions(session_options);
-  if (input_tensor_values != NULL && config->hardware_acceleration == ALPRCONFIG_CPU)
-    free(input_tensor_values);
+  delete preprocess_pool;
+  delete pipeline_pool;
+  delete result_cache;
+  for (uint32_t i = 0; i < workspaces.size(); i++) {
+    for (uint32_t s = 0; s < workspaces[i]->stages.size(); s++)
+      delete workspaces[i]->stages[s].backend;
+    delete workspaces[i];
+  }
+  delete backend;
+  delete tensor_arena;
 }
 
+OcrWorkspace* Ocr::checkout_workspace() {
+  int node = tensor_arena->NumaLocal() ? TensorArena::CurrentNode() : -1;
+  std::unique_lock<std::mutex> lock(workspace_mutex);
+  if (node >= 0) {
+    for (size_t i = idle_workspaces.size(); i-- > 0;) {
+      if (idle_workspaces[i]->numa_node == node) {
+        OcrWorkspace* workspace = idle_workspaces[i];
+        idle_workspaces.erase(idle_workspaces.begin() + i);
+        return workspace;
+      }
+    }
+  }
+  if ((idle_workspaces.size() == 0 || node >= 0) && workspaces.size() < max_workspaces) {
+    // Its stage 0 tensors are allocated by this thread's first batch, so they land on this node
+    OcrWorkspace* workspace = new OcrWorkspace();
+    workspace->numa_node = node;
+    workspace->stages.resize(1);
+    workspace->stages[0].backend = backend->CreateContext();
+    workspace->stages[0].input_dims = get_input_shape(1);
+    workspaces.push_back(workspace);
+    return workspace;
+  }
+  workspace_cv.wait(lock, [this]() { return idle_workspaces.size() > 0; });
+  OcrWorkspace* workspace = idle_workspaces.back();
+  idle_workspaces.pop_back();
+  return workspace;
+}
+
+void Ocr::return_workspace(OcrWorkspace* workspace) {
+  {
+    std::lock_guard<std::mutex> lock(workspace_mutex);
+    idle_workspaces.push_back(workspace);
+  }
+  workspace_cv.notify_one();
+}
+
+void Ocr::initialize_input_tensor(std::vector<cv::Mat>& images, const std::vector<OcrRequestCrop>& crops) {
+  OcrWorkspaceLease workspace(*this);
+  initialize_input_tensor(workspace->stages[0], images, crops.data(), crops.size(), crops.size());
+}
 
-void Ocr::initialize_input_tensor(std::vector<cv::Mat>& images, std::vector<OcrRequestCrop> crops) {
-  // assuming network expects RGB, and images is in BGR.
+void Ocr::initialize_input_tensor(OcrStage& stage, std::vector<cv::Mat>& images, const OcrRequestCrop* crops,
+                                  size_t num_crops, size_t batch_size) {
+  if (images.size() == 0 || num_crops == 0)
+    return;
+
+  ALPR_PROF_SCOPE_START(alprsupport::Profiler::Get(), "Initialize Input Crops");
+  // The runtime reserves a full max_batch on first use, so later batch sizes reuse the same buffer
+  size_t input_memory_size;
+  stage.input_dims[0] = batch_size;
+  // Raw bytes: float or uint8 depending on the model (see input_type)
+  uint8_t* input_tensor_values = stage.backend->GetInputBuffer<uint8_t>(input_name, stage.input_dims,
+                                                                       &input_memory_size, true);
+  // Padding slots are blank crops; their results are never read
+  if (batch_size > num_crops)
+    memset(input_tensor_values + num_crops * input_tensor_size, 0, (batch_size - num_crops) * input_tensor_size);
+
+  // Every crop owns the slot at its index, so the tensor layout is the same however the crops are split up
+  if (preprocess_pool != NULL && num_crops > 1) {
+    preprocess_pool->parallel_for(num_crops, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++)
+        initialize_crop(images[crops[i].image_index], crops[i], input_type,
+                        input_tensor_values + i * input_tensor_size);
+    });
+  } else {
+    for (uint32_t i = 0; i < num_crops; i++)
+      initialize_crop(images[crops[i].image_index], crops[i], input_type,
+                      input_tensor_values + i * input_tensor_size);
+  }
+  ALPR_PROF_SCOPE_END(alprsupport::Profiler::Get());
+}
+
+void Ocr::preprocess_crops(std::vector<cv::Mat>& images, const std::vector<OcrRequestCrop>& crops, float* out) {
+  const size_t slot_values = crop_width * crop_height * crop_channels;
+  for (uint32_t i = 0; i < crops.size(); i++)
+    initialize_crop(images[crops[i].image_index], crops[i], ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT,
+                    out + i * slot_values);
+}
+
+void Ocr::initialize_crop(const cv::Mat& original_image, const OcrRequestCrop& crop, ONNXTensorElementDataType type,
+                          void* slot) {
+  // images are BGR; the network takes RGB planes unless ocr_config.json says otherwise (see input_nhwc)
   const int NUM_CHANNELS = 3;
   const int channel_order[] = {2, 1, 0};
   const int channel_stride = crop_width * crop_height;
-  if (images.size() == 0 || crops.size() == 0)
+  const bool uint8_input = type == ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8;
+
+  if (original_image.type() == CV_8UC3) {
+    // Fused path: sample through the homography straight into this tensor slot
+    double dst_to_src[9];
+    crop_homography(crop.corner_points, crop_width, crop_height, dst_to_src);
+    if (input_nhwc && uint8_input)
+      warp_crop_to_interleaved(original_image, dst_to_src, crop_width, crop_height, input_bgr,
+                               static_cast<uint8_t*>(slot));
+    else if (input_nhwc)
+      warp_crop_to_interleaved(original_image, dst_to_src, crop_width, crop_height, input_bgr,
+                               static_cast<float*>(slot));
+    else if (uint8_input)
+      warp_crop_to_planar_rgb(original_image, dst_to_src, crop_width, crop_height, static_cast<uint8_t*>(slot));
+    else
+      warp_crop_to_planar_rgb(original_image, dst_to_src, crop_width, crop_height, static_cast<float*>(slot));
     return;
-
-  ALPR_PROF_SCOPE_START(alprsupport::Profiler::Get(), "Initialize Input Crops");
-  size_t total_bytes = crops.size() * input_tensor_size;
-  if (total_bytes > input_tensor_max_size) {
-    if (input_tensor_values != NULL)
-      free(input_tensor_values);
-    input_tensor_max_size = total_bytes;
-    input_tensor_values = static_cast<float *>(malloc(input_tensor_max_size));
   }
 
-  Mat scratchspace(crop_height, crop_width, CV_8UC3);
   Size cropSize = Size(crop_width, crop_height);
-
   std::vector<Point2f> small_corners;
   small_corners.push_back(Point2f(0, 0));
   small_corners.push_back(Point2f(crop_width, 0));
   small_corners.push_back(Point2f(crop_width, crop_height));
   small_corners.push_back(Point2f(0, crop_height));
 
-  float * tmp = input_tensor_values;
-  for (uint32_t i = 0; i < crops.size(); i++) {
-    cv::Mat original_image = images[crops[i].image_index];
-    std::vector<Point2f> big_corners;
-    for (int z = 0; z < crops[i].corner_points.size(); z = z+2)
-      big_corners.push_back(Point2f(crops[i].corner_points[z], crops[i].corner_points[z+1]));
-
-    Mat transmtx = getPerspectiveTransform(big_corners, small_corners);
-    Mat crop_image(crop_height, crop_width, original_image.type());
-    warpPerspective(original_image, crop_image, transmtx, cropSize, INTER_LINEAR, BORDER_REPLICATE, Scalar());
-
-    // Load image data to ORT format (channel blocks by row): https://answers.opencv.org/question/64837
-    // Mat crop_image_rgb;
-    // if (crop_image.channels() == 1)
-    //   cv::cvtColor(crop_image, crop_image_rgb, CV_GRAY2RGB);
-    // else
-    //   cv::cvtColor(crop_image, crop_image_rgb, cv::COLOR_BGR2RGB);
-    Mat float_image;
-    crop_image.convertTo(float_image, CV_32F);
-    std::vector<cv::Mat> channels;
-    channels.clear();
-    for (int i = 0; i < NUM_CHANNELS; ++i) {
-      float * tmp_buffer = tmp + channel_order[i] * channel_stride;
-      cv::Mat channel(crop_height, crop_width, CV_32FC1, tmp_buffer);
-      channels.push_back(channel);
+  std::vector<Point2f> big_corners;
+  for (int z = 0; z < crop.corner_points.size(); z = z+2)
+    big_corners.push_back(Point2f(crop.corner_points[z], crop.corner_points[z+1]));
+
+  Mat transmtx = getPerspectiveTransform(big_corners, small_corners);
+  Mat crop_image(crop_height, crop_width, original_image.type());
+  warpPerspective(original_image, crop_image, transmtx, cropSize, INTER_LINEAR, BORDER_REPLICATE, Scalar());
+
+  const int depth = uint8_input ? CV_8U : CV_32F;
+  const size_t element_size = uint8_input ? sizeof(uint8_t) : sizeof(float);
+  if (input_nhwc) {
+    // The crop already has the network's layout; only the type and maybe the channel order change
+    Mat interleaved(crop_height, crop_width, CV_MAKETYPE(depth, NUM_CHANNELS), slot);
+    if (input_bgr) {
+      crop_image.convertTo(interleaved, depth);
+    } else {
+      Mat rgb_image;
+      cvtColor(crop_image, rgb_image, COLOR_BGR2RGB);
+      rgb_image.convertTo(interleaved, depth);
     }
-    tmp += NUM_CHANNELS * channel_stride;
-    cv::split(float_image, channels);
-    // cv::imwrite("/tmp/test.png", crop_image);
-    // cv::imshow("test", crop_image);
-    // cv::waitKey(0);
+    return;
   }
-  ALPR_PROF_SCOPE_END(alprsupport::Profiler::Get());
+
+  // Load image data to ORT format (channel blocks by row): https://answers.opencv.org/question/64837
+  Mat converted_image;
+  crop_image.convertTo(converted_image, depth);
+  std::vector<cv::Mat> channels;
+  for (int i = 0; i < NUM_CHANNELS; ++i) {
+    uint8_t * tmp_buffer = static_cast<uint8_t*>(slot) + channel_order[i] * channel_stride * element_size;
+    cv::Mat channel(crop_height, crop_width, CV_MAKETYPE(depth, 1), tmp_buffer);
+    channels.push_back(channel);
+  }
+  cv::split(converted_image, channels);
 }
 
+void Ocr::set_preprocess_threads(int num_threads) {
+  if (num_threads <= 0)
+    num_threads = std::max<int>(1, std::thread::hardware_concurrency());
+  if (preprocess_pool != NULL) {
+    delete preprocess_pool;
+    preprocess_pool = NULL;
+  }
+  // The calling thread takes one share of the crops itself
+  if (num_threads > 1)
+    preprocess_pool = new alprsupport::WorkerPool(num_threads - 1);
+}
 
-// Return true if it should keep going.  False if it hits a stop character
-bool Ocr::append_character(OcrResult& word, int char_index, std::vector<std::pair<int, float>>& sorted_softmax) {
-  const float MIN_CHAR_CONFIDENCE = 0.0005;
-  for (uint32_t i = 0; i < sorted_softmax.size(); i++) {
-    if (sorted_softmax[i].second < MIN_CHAR_CONFIDENCE)
-      continue;
 
-    OcrChar c;
-    c.char_index = char_index;
-    c.confidence = sorted_softmax[i].second;
-    c.letter = char_name_map[sorted_softmax[i].first];
+void Ocr::expand_result(const OcrResultArena& arena, const OcrFlatResult& flat, OcrResult& result) {
+  result.image_index = flat.image_index;
+  result.overall_confidence = flat.overall_confidence;
+  result.corner_points.assign(flat.corner_points, flat.corner_points + flat.num_corner_points);
+  const OcrFlatProvince* provinces = arena.provinces(flat);
+  for (uint32_t p = 0; p < flat.num_provinces; p++) {
+    OcrProvince province;
+    province.regioncode = provinces[p].regioncode;
+    province.confidence = provinces[p].confidence;
+    result.provinces.push_back(province);
+  }
+  const OcrFlatChar* characters = arena.characters(flat);
+  for (uint32_t c = 0; c < flat.num_characters; c++) {
+    OcrChar character;
+    character.letter = characters[c].letter;
+    character.char_index = characters[c].char_index;
+    character.confidence = characters[c].confidence;
+    result.characters.push_back(character);
+  }
+  const OcrFlatCandidate* candidates = arena.candidates(flat);
+  for (uint32_t p = 0; p < flat.num_candidates; p++) {
+    OcrPlateCandidate candidate;
+    candidate.confidence = candidates[p].confidence;
+    candidate.matches_template = candidates[p].matches_template;
+    const OcrFlatChar* letters = arena.characters(candidates[p]);
+    for (uint32_t c = 0; c < candidates[p].num_characters; c++) {
+      OcrChar character;
+      character.letter = letters[c].letter;
+      character.char_index = letters[c].char_index;
+      character.confidence = letters[c].confidence;
+      candidate.plate += character.letter;
+      candidate.characters.push_back(character);
+    }
+    result.candidates.push_back(candidate);
+  }
+}
+
+void Ocr::reserve_results(OcrResultArena& arena, size_t num_crops, size_t num_tokens, int timesteps) {
+  // Worst case every crop is kept with all of its decoded tokens, and with a full list of beam plates that each
+  // use every timestep.  Only ever grows.
+  size_t results = arena.num_results + num_crops;
+  size_t characters = arena.num_characters + num_tokens;
+  size_t provinces = arena.num_provinces + num_crops * topk;
+  size_t candidates = 0;
+  size_t candidate_characters = 0;
+  if (beam_search.enabled()) {
+    candidates = arena.num_candidates + num_crops * config->ocr_beam_candidates;
+    candidate_characters = arena.num_candidate_characters + num_crops * config->ocr_beam_candidates * timesteps;
+  }
+  if (arena.results.size() < results)
+    arena.results.resize(results);
+  if (arena.character_storage.size() < characters)
+    arena.character_storage.resize(characters);
+  if (arena.province_storage.size() < provinces)
+    arena.province_storage.resize(provinces);
+  if (arena.candidate_storage.size() < candidates)
+    arena.candidate_storage.resize(candidates);
+  if (arena.candidate_character_storage.size() < candidate_characters)
+    arena.candidate_character_storage.resize(candidate_characters);
+}
+
+bool Ocr::add_candidates(OcrWorkspace* workspace, int template_region, const int64_t* ids, const float* confidences,
+                         int timesteps, int char_topk, OcrResultArena& results, OcrFlatResult& result) {
+  beam_search.search(ids, confidences, timesteps, char_topk, template_region, workspace->beam);
+  const OcrBeamSet& plates = workspace->beam.finished;
+  for (size_t p = 0; p < plates.hypotheses.size(); p++) {
+    const OcrBeamHypothesis& plate = plates.hypotheses[p];
+    OcrFlatCandidate& candidate = results.candidate_storage[results.num_candidates++];
+    // Scaled like the top-1 result: the plate's own overall confidence sets its characters' multiplier
+    float confidence_multiplier = character_confidence_multiplier(plate.score);
+    candidate.confidence = plate.score * 100;
+    candidate.matches_template = template_region >= 0;
+    candidate.first_character = results.num_candidate_characters;
+    candidate.num_characters = plate.num_tokens;
+    const OcrDecodedToken* tokens = &plates.tokens[plate.first_token];
+    for (uint32_t i = 0; i < plate.num_tokens; i++) {
+      OcrFlatChar& c = results.candidate_character_storage[results.num_candidate_characters++];
+      c.letter = token_name(runtime_data->charTokens(), tokens[i].id);
+      c.char_index = tokens[i].timestep;
+      c.confidence = tokens[i].confidence * confidence_multiplier * 100;
+    }
+    result.num_candidates++;
+  }
+  // Templates were checked and nothing the network read fits any of them
+  return !(config->mustMatchPattern && template_region >= 0 && plates.hypotheses.empty());
+}
+
+std::vector<OcrResult> Ocr::recognize_batch(std::vector<cv::Mat>& images, const std::vector<OcrRequestCrop>& crops) {
+  OcrWorkspaceLease workspace(*this);
+  return recognize_batch(workspace.get(), images, crops);
+}
 
-    if (i == 0) {
-      // * = padding or start of seq -- shouldn't ever show up in the output
-      if (c.letter == "*" || c.letter == "^") {
-        ALPR_DEBUG << "Seeing an unexpected " << c.letter << " output in OCR";
+std::vector<OcrResult> Ocr::recognize_batch(OcrWorkspace* workspace, std::vector<cv::Mat>& images,
+                                            const std::vector<OcrRequestCrop>& crops) {
+  if (result_cache != NULL)
+    return recognize_batch_cached(workspace, images, crops);
+
+  recognize_batch(workspace, images, crops.data(), crops.size(), workspace->results);
+  const OcrResultArena& arena = workspace->results;
+  std::vector<OcrResult> results(arena.size());
+  for (size_t i = 0; i < arena.size(); i++)
+    expand_result(arena, arena[i], results[i]);
+  return results;
+}
+
+std::vector<OcrResult> Ocr::recognize_batch_cached(OcrWorkspace* workspace, std::vector<cv::Mat>& images,
+                                                   const std::vector<OcrRequestCrop>& crops) {
+  // Look every crop up first, then send the misses to the network as one batch
+  std::vector<OcrCacheKey> keys(crops.size());
+  std::vector<OcrResult> cached(crops.size());
+  // 1 = cached result, 0 = cached as no result, -1 = miss, -2 = can't be cached
+  std::vector<int> hit(crops.size(), -1);
+  std::vector<OcrRequestCrop> misses;
+  for (size_t i = 0; i < crops.size(); i++) {
+    bool found = false;
+    if (!result_cache->make_key(images[crops[i].image_index], crops[i], keys[i]))
+      hit[i] = -2;
+    else if (result_cache->lookup(keys[i], found, cached[i]))
+      hit[i] = found ? 1 : 0;
+    if (hit[i] < 0)
+      misses.push_back(crops[i]);
+  }
+
+  const OcrResultArena& arena = workspace->results;
+  workspace->results.clear();
+  if (misses.size() > 0)
+    recognize_batch(workspace, images, misses.data(), misses.size(), workspace->results);
+  // Misses that were dropped (low confidence) have no result
+  std::vector<const OcrFlatResult*> miss_results(misses.size(), NULL);
+  for (size_t i = 0; i < arena.size(); i++)
+    miss_results[arena[i].crop_index] = &arena[i];
+
+  // Same order as without the cache: one result per kept crop, in crop order
+  std::vector<OcrResult> results;
+  size_t next_miss = 0;
+  for (size_t i = 0; i < crops.size(); i++) {
+    if (hit[i] == 1) {
+      // The text is the cached read; where it is comes from this request
+      OcrResult& result = cached[i];
+      result.image_index = crops[i].image_index;
+      result.corner_points.clear();
+      for (size_t z = 0; z + 1 < crops[i].corner_points.size() && result.corner_points.size() < 4; z += 2)
+        result.corner_points.push_back(Point2f(crops[i].corner_points[z], crops[i].corner_points[z + 1]));
+      results.push_back(result);
+    } else if (hit[i] < 0) {
+      const OcrFlatResult* flat = miss_results[next_miss++];
+      if (flat == NULL) {
+        if (hit[i] == -1)
+          result_cache->insert(keys[i], NULL);
         continue;
       }
-      if (word.overall_confidence < 0)
-        word.overall_confidence = c.confidence;
-      else
-        word.overall_confidence *= c.confidence;
-
-      if (c.letter == "~")  // ~ = negative plate
-        return false;
-      if (c.letter == "$")  // ~ End of sequence
-        return false;
+      results.push_back(OcrResult());
+      expand_result(arena, *flat, results.back());
+      if (hit[i] == -1)
+        result_cache->insert(keys[i], &results.back());
     }
-    if (c.letter != "$")
-      word.characters.push_back(c);
   }
-  return true;
+  return results;
 }
 
-std::vector<OcrResult> Ocr::recognize_batch(std::vector<cv::Mat>& images, std::vector<OcrRequestCrop> crops) {
-  std::vector<OcrResult> results;
+OcrCacheStats Ocr::get_cache_stats() {
+  if (result_cache != NULL)
+    return result_cache->stats();
+  OcrCacheStats stats;
+  memset(&stats, 0, sizeof(stats));
+  return stats;
+}
+
+void Ocr::recognize_batch(OcrWorkspace* workspace, std::vector<cv::Mat>& images, const OcrRequestCrop* crops,
+                          size_t num_crops, OcrResultArena& results) {
+  results.clear();
+  workspace->batch_crops = crops;
   auto profiler = alprsupport::Profiler::Get();
   if (profiler->isON()) {
-    ALPR_PROF_SCOPE_START(profiler, string("OCR Batch (" + std::to_string(crops.size())+")").c_str());
+    ALPR_PROF_SCOPE_START(profiler, string("OCR Batch (" + std::to_string(num_crops)+")").c_str());
+  }
+
+  if (pipeline_pool != NULL && num_crops > static_cast<size_t>(max_batch)) {
+    ALPR_PROF_SCOPE_START(profiler, "recognize_pipelined");
+    recognize_pipelined(workspace, images, crops, num_crops, results);
+    ALPR_PROF_SCOPE_END(profiler);
+    ALPR_PROF_SCOPE_END(profiler);
+    return;
   }
 
   // Only send up to the max_batch at a time
-  for (uint32_t i = 0; i < crops.size(); i = i + max_batch) {
-    int start_index = i;
-    int end_index = i + max_batch;
-    if (end_index >= crops.size())
-      end_index = crops.size();
-    std::vector<OcrRequestCrop> crop_slice = std::vector<OcrRequestCrop>(crops.begin() + start_index,
-                                                                         crops.begin() + end_index);
+  for (size_t i = 0; i < num_crops; i = i + max_batch) {
+    size_t sub_batch_size = std::min<size_t>(max_batch, num_crops - i);
     ALPR_PROF_SCOPE_START(profiler, "recognize_sub_batch");
-    std::vector<OcrResult> subresults = recognize_sub_batch(images, crop_slice);
-    for (int j = 0; j < subresults.size(); j++) {
-      OcrResult r = subresults[j];
-      results.push_back(r);
-    }
+    recognize_sub_batch(workspace, images, crops + i, sub_batch_size, results);
     ALPR_PROF_SCOPE_END(profiler);
   }
   ALPR_PROF_SCOPE_END(profiler);
-  return results;
 }
 
-std::vector<OcrResult> Ocr::recognize_sub_batch(std::vector<cv::Mat>& images, std::vector<OcrRequestCrop> crops) {
-    timespec startTime;
-    alprsupport::getTimeMonotonic(&startTime);
-    std::vector<OcrResult> response;
-    if (crops.size() == 0)
-      return response;
+void Ocr::recognize_sub_batch(OcrWorkspace* workspace, std::vector<cv::Mat>& images, const OcrRequestCrop* crops,
+                              size_t num_crops, OcrResultArena& results) {
+    if (num_crops == 0)
+      return;
 
-    int num_output_names;
-    std::vector<const char*> output_node_names;
-    if (has_regions) {
-      output_node_names = {"character_ids", "region_ids", "character_confidences", "region_confidences"};
-    } else {
-      output_node_names = {"character_ids", "character_confidences"};
-    }
-    num_output_names = output_node_names.size();
-    const char* input_node_names[] = {"images"};
+    OcrStage& stage = workspace->stages[0];
+    AlprONNXRuntime* context = stage.backend;
     size_t input_memory_size;
-    int batch_size = crops.size();
+    float* input_tensor_values;
+    int batch_size = padded_batch_size(num_crops);
+    // Held until inference is done since the GPU crops live in one shared device buffer
+    std::unique_lock<std::mutex> gpu_lock(gpu_mutex, std::defer_lock);
     if (config->hardware_acceleration == ALPRCONFIG_NVIDIA_GPU) {
+      gpu_lock.lock();
       AlprGpuSupport* alpr_gpu_support = AlprGpuSupport::getInstance(config->gpu_id);
-      std::vector<OcrCropInfo> crop_info;
-      for (int i = 0; i < crops.size(); i++) {
+      std::vector<OcrCropInfo>& crop_info = workspace->gpu_crop_info;
+      crop_info.clear();
+      for (int i = 0; i < num_crops; i++) {
         OcrCropInfo c;
         c.image_index = crops[i].image_index;
         c.x1 = crops[i].corner_points[0];
@@ -272,121 +733,198 @@ std::vector<OcrResult> Ocr::recognize_sub_batch(std::vector<cv::Mat>& images, st
       input_tensor_values = (float*) alpr_gpu_support->get_gpu_ocr_crops(max_batch,
                                           crops[0].ideal_width, crops[0].ideal_height, crop_info, input_memory_size);
 
-      // GPU caching for the CUDA provider is goofy.  For every different batch size, it goes through a caching
-      // operation which is slow. For example, if we have a max 40 image batch, and pass 6 images in, the first
-      // time we do this it will take 300ms, the second time ~5ms
-      // Then this will happen again if we send in 7 images.
-      // As a mitigation, we'll clamp the batch size that is sent to a slightly larger number
-      // We'll increase the memory size to the next one up (e.g., 4 plates would send a batch size of
-      // 5, 6 plates would send 10, etc)
-      batch_size = ((crops.size() / this->batch_clamp_size) + 1) * this->batch_clamp_size;
-      if (batch_size > max_batch)
-        batch_size = max_batch;
+      // The crops buffer holds max_batch slots, so the padded batch (see batch_buckets) is always in range
       input_memory_size = crop_width * crop_height * crop_channels * batch_size * sizeof(float);
+
+      // The crops buffer has always been handed to ORT as host memory
+      stage.input_dims[0] = batch_size;
+      context->BindInputBuffer(input_name, stage.input_dims, input_tensor_values, input_memory_size, false);
     } else {
-      initialize_input_tensor(images, crops);
-      input_memory_size = crops.size() * input_tensor_size;
+      initialize_input_tensor(stage, images, crops, num_crops, batch_size);
     }
 
-    // Create input tensor object from data values
-    ALPR_PROF_SCOPE_START(alprsupport::Profiler::Get(), "Create input");
-    OrtMemoryInfo* memory_info;
-    OrtCheckStatus(g_ort->CreateCpuMemoryInfo(OrtArenaAllocator, OrtMemTypeDefault, &memory_info));
-    OrtValue* input_tensor = NULL;
-
-    std::vector<int64_t> input_shape = {batch_size, crop_channels, crop_height, crop_width};
-    size_t input_shape_len = 4;
-    OrtCheckStatus(g_ort->CreateTensorWithDataAsOrtValue(memory_info, input_tensor_values, input_memory_size,
-                                                         input_shape.data(), input_shape.size(),
-                                                         ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT, &input_tensor));
+    // Run inference.  Outputs left from an earlier batch of this size are filled in place.
+    ALPR_PROF_SCOPE_START(alprsupport::Profiler::Get(), "inference");
+    context->Infer();
     ALPR_PROF_SCOPE_END(alprsupport::Profiler::Get());
-    int is_tensor;
-    OrtCheckStatus(g_ort->IsTensor(input_tensor, &is_tensor));
-    assert(is_tensor);
-    g_ort->ReleaseMemoryInfo(memory_info);
+    if (gpu_lock.owns_lock())
+      gpu_lock.unlock();
 
-    // Run inference
-    ALPR_PROF_SCOPE_START(alprsupport::Profiler::Get(), "inference");
-    std::vector<OrtValue*> outputs(num_output_names, nullptr);
-    OrtCheckStatus(g_ort->Run(session, NULL, input_node_names, &input_tensor, 1, output_node_names.data(),
-                               num_output_names, outputs.data()));
-    OrtCheckStatus(g_ort->IsTensor(outputs[0], &is_tensor));
-    assert(is_tensor);
+    ALPR_PROF_SCOPE_START(alprsupport::Profiler::Get(), "parse float output");
+    decode_sub_batch(workspace, stage, crops, num_crops, results);
     ALPR_PROF_SCOPE_END(alprsupport::Profiler::Get());
+}
 
-    // Get pointers to output tensor float values
-    int64_t* char_ids;
-    int64_t* region_ids;
-    float* char_confids;
-    float* region_confids;
-    if (has_regions) {
-      OrtCheckStatus(g_ort->GetTensorMutableData(outputs[0], (void**)&char_ids));
-      OrtCheckStatus(g_ort->GetTensorMutableData(outputs[1], (void**)&region_ids));
-      OrtCheckStatus(g_ort->GetTensorMutableData(outputs[2], (void**)&char_confids));
-      OrtCheckStatus(g_ort->GetTensorMutableData(outputs[3], (void**)&region_confids));
-    } else {
-      OrtCheckStatus(g_ort->GetTensorMutableData(outputs[0], (void**)&char_ids));
-      OrtCheckStatus(g_ort->GetTensorMutableData(outputs[1], (void**)&char_confids));
+void Ocr::add_pipeline_stages(OcrWorkspace* workspace) {
+  const size_t PIPELINE_DEPTH = 3;
+  if (workspace->stages.size() >= PIPELINE_DEPTH)
+    return;
+  while (workspace->stages.size() < PIPELINE_DEPTH) {
+    OcrStage stage;
+    stage.backend = backend->CreateContext();
+    stage.input_dims = workspace->stages[0].input_dims;
+    workspace->stages.push_back(stage);
+  }
+  // The stages are prepared on pipeline_pool threads, which may sit on any node; allocate their input tensors here
+  // instead, on the thread that holds the workspace
+  size_t input_memory_size;
+  for (size_t s = 0; s < workspace->stages.size(); s++)
+    workspace->stages[s].backend->GetInputBuffer<uint8_t>(input_name, workspace->stages[s].input_dims,
+                                                          &input_memory_size, true);
+}
+
+void Ocr::recognize_pipelined(OcrWorkspace* workspace, std::vector<cv::Mat>& images, const OcrRequestCrop* crops,
+                              size_t num_crops, OcrResultArena& results) {
+  // Step s runs three sub-batches on three stages at once: prepare s+1 (on the pool), infer s (here) and decode
+  // s-1 (on the pool).  A stage is only prepared again once the sub-batch before it has been decoded, and the
+  // decodes run in order, so the results come out exactly as from the serial loop.
+  add_pipeline_stages(workspace);
+  const size_t num_steps = (num_crops + max_batch - 1) / max_batch;
+  auto sub_batch_crops = [&](size_t step) { return crops + step * max_batch; };
+  auto sub_batch_size = [&](size_t step) { return std::min<size_t>(max_batch, num_crops - step * max_batch); };
+  auto stage_for = [&](size_t step) -> OcrStage& { return workspace->stages[step % workspace->stages.size()]; };
+  auto prepare = [&](size_t step) {
+    size_t count = sub_batch_size(step);
+    return pipeline_pool->submit([this, &images, &stage_for, &sub_batch_crops, step, count]() {
+      initialize_input_tensor(stage_for(step), images, sub_batch_crops(step), count, padded_batch_size(count));
+    });
+  };
+
+  std::future<void> prepared = prepare(0);
+  std::future<void> decoded;
+  // Queued and running tasks reference this frame, so if a step throws, wait them out before unwinding
+  struct Drain {
+    std::future<void>& prepared;
+    std::future<void>& decoded;
+    ~Drain() {
+      if (prepared.valid())
+        prepared.wait();
+      if (decoded.valid())
+        decoded.wait();
     }
+  } drain = {prepared, decoded};
+  for (size_t step = 0; step < num_steps; step++) {
+    prepared.get();
+    if (step + 1 < num_steps)
+      prepared = prepare(step + 1);
+
+    stage_for(step).backend->Infer();
+
+    if (decoded.valid())
+      decoded.get();
+    size_t count = sub_batch_size(step);
+    decoded = pipeline_pool->submit([this, workspace, &results, &stage_for, &sub_batch_crops, step, count]() {
+      decode_sub_batch(workspace, stage_for(step), sub_batch_crops(step), count, results);
+    });
+  }
+  decoded.get();
+}
 
+void Ocr::decode_sub_batch(OcrWorkspace* workspace, OcrStage& stage, const OcrRequestCrop* crops, size_t num_crops,
+                           OcrResultArena& results) {
+    AlprONNXRuntime* context = stage.backend;
+    // Get pointers to output tensor values.  Models with a dynamic sequence length emit [batch, timesteps, topk]
+    // with fewer timesteps than max_timesteps, so the shape is read from every batch.
+    TensorView<int64_t> char_ids_view = context->GetOutputView<int64_t>(char_ids_output);
+    const int64_t* char_ids = char_ids_view.data;
+    const float* char_confids = context->GetOutputView<float>(char_confids_output).data;
+    int timesteps = char_ids_view.num_dims() == 3 ? static_cast<int>(char_ids_view.dim(1)) : max_timesteps;
+    int char_topk = char_ids_view.num_dims() == 3 ? static_cast<int>(char_ids_view.dim(2)) : topk;
+    const int64_t* sequence_lengths = NULL;
+    if (has_sequence_lengths)
+      sequence_lengths = context->GetOutputView<int64_t>(sequence_lengths_output).data;
+    const int64_t* region_ids = NULL;
+    const float* region_confids = NULL;
+    if (has_regions) {
+      region_ids = context->GetOutputView<int64_t>(region_ids_output).data;
+      region_confids = context->GetOutputView<float>(region_confids_output).data;
+    }
 
     // Determine highest confidence region and character classes
-    ALPR_PROF_SCOPE_START(alprsupport::Profiler::Get(), "parse float output");
-    std::vector<std::pair<int, float>> top_tokens(topk);
-
-    for (int item_idx = 0; item_idx < crops.size(); item_idx++) {
-      OcrResult result;
+    OcrDecodedBatch& decoded = workspace->decoded;
+    if (decode_top1)
+      char_decoder.decode_top1(char_ids, char_confids, num_crops, timesteps, char_topk, decoded, sequence_lengths);
+    else
+      char_decoder.decode(char_ids, char_confids, num_crops, timesteps, char_topk, decoded, sequence_lengths);
+    reserve_results(results, num_crops, decoded.num_tokens, timesteps);
+    for (int item_idx = 0; item_idx < num_crops; item_idx++) {
+      const OcrRequestCrop& crop = crops[item_idx];
+      OcrFlatResult& result = results.results[results.num_results];
+      result.first_province = results.num_provinces;
+      result.num_provinces = 0;
+      result.first_character = results.num_characters;
+      result.num_characters = 0;
+      result.first_candidate = results.num_candidates;
+      result.num_candidates = 0;
       if (has_regions) {
-        int topk_regions = std::min<int>(topk, region_name_map.size());  // Some models may have < 10 regions
+        int topk_regions = std::min<int>(topk, num_regions);  // Some models may have < 10 regions
         for (uint32_t k = 0; k < topk_regions; k++) {
           int idx = item_idx*topk_regions + k;
-          top_tokens[k] = std::make_pair(static_cast<int>(region_ids[idx] & 0xFFFFFFFF), region_confids[idx]);
-        }
-        for (auto region : top_tokens) {
-          OcrProvince p;
-          p.regioncode = region_name_map[region.first];
-          p.confidence = region.second * 100;
-          result.provinces.push_back(p);
+          OcrFlatProvince& p = results.province_storage[result.first_province + result.num_provinces++];
+          p.regioncode = token_name(runtime_data->regionTokens(), region_ids[idx]);
+          p.confidence = region_confids[idx] * 100;
         }
       }
 
-      result.overall_confidence = -1;
-      for (int z = 0; z < crops[item_idx].corner_points.size(); z = z+2)
-        result.corner_points.push_back(Point2f(crops[item_idx].corner_points[z], crops[item_idx].corner_points[z+1]));
-
-      result.image_index = crops[item_idx].image_index;
-
-      for (int t = 0; t < max_timesteps; t++) {
-        for (uint32_t k = 0; k < topk; k++) {
-          int idx = item_idx * topk * max_timesteps + t * topk + k;
-          top_tokens[k] = std::make_pair(static_cast<int>(char_ids[idx] & 0xFFFFFFFF), char_confids[idx]);
-        }
-        bool keep_going = append_character(result, t, top_tokens);
-        if (!keep_going)
-          break;
+      result.num_corner_points = 0;
+      for (int z = 0; z + 1 < crop.corner_points.size() && result.num_corner_points < 4; z = z+2)
+        result.corner_points[result.num_corner_points++] = Point2f(crop.corner_points[z], crop.corner_points[z+1]);
+
+      result.image_index = crop.image_index;
+      result.crop_index = static_cast<uint32_t>(&crop - workspace->batch_crops);
+
+      const OcrDecodedSequence& sequence = decoded.sequences[item_idx];
+      result.overall_confidence = sequence.overall_confidence;
+      for (uint32_t i = 0; i < sequence.num_tokens; i++) {
+        const OcrDecodedToken& token = decoded.tokens[sequence.first_token + i];
+        OcrFlatChar& c = results.character_storage[results.num_characters++];
+        c.letter = token_name(runtime_data->charTokens(), token.id);
+        c.char_index = token.timestep;
+        c.confidence = token.confidence;
+        result.num_characters++;
       }
       // Apply some filters here on the final output
-      float confidence_multiplier = ((1.0 - MIN_OCR_CONFIDENCE_ADJUSTMENT) * result.overall_confidence) + MIN_OCR_CONFIDENCE_ADJUSTMENT;
-      // Don't go above MAX_OCR_OVERALL_CONFIDENCE_MULTIPLIER, ever...
-      confidence_multiplier *= MAX_OCR_OVERALL_CONFIDENCE_MULTIPLIER;
-      for (uint32_t charidx = 0; charidx < result.characters.size(); charidx++)
-        result.characters[charidx].confidence *= confidence_multiplier;
+      float confidence_multiplier = character_confidence_multiplier(result.overall_confidence);
+      OcrFlatChar* characters = &results.character_storage[result.first_character];
 
-      // If we're below the minimum confidence Skip it.
+      // If we're below the minimum confidence Skip it (and give back its characters and provinces)
       if (result.overall_confidence < MIN_OCR_OVERALL_CONFIDENCE) {
+        results.num_characters = result.first_character;
+        results.num_provinces = result.first_province;
         continue;
       }
 
+      if (beam_search.enabled()) {
+        // An explicit region wins over the one the network reads with most confidence
+        int template_region = -1;
+        if (!crop.template_region.empty()) {
+          template_region = runtime_data->patternMatcher().regionIndex(crop.template_region);
+        } else if (has_regions && result.num_provinces > 0) {
+          int64_t top_region = region_ids[item_idx * std::min<int>(topk, num_regions)];
+          uint32_t region = static_cast<uint32_t>(top_region & 0xFFFFFFFF);
+          if (region < region_templates.size())
+            template_region = region_templates[region];
+        }
+        size_t row = static_cast<size_t>(item_idx) * timesteps * char_topk;
+        int crop_timesteps = timesteps;
+        if (sequence_lengths != NULL)
+          crop_timesteps = std::max<int>(0, std::min<int64_t>(timesteps, sequence_lengths[item_idx]));
+        // A dropped crop has no plates to give back
+        if (!add_candidates(workspace, template_region, char_ids + row, char_confids + row, crop_timesteps,
+                            char_topk, results, result)) {
+          results.num_characters = result.first_character;
+          results.num_provinces = result.first_province;
+          continue;
+        }
+      }
+
       result.overall_confidence *= 100;
-      for (uint32_t z = 0; z < result.characters.size(); z++)
-        result.characters[z].confidence *= 100;
-      response.push_back(result);
+      for (uint32_t z = 0; z < result.num_characters; z++) {
+        characters[z].confidence *= confidence_multiplier;
+        characters[z].confidence *= 100;
+      }
+      results.num_results++;
     }
-    ALPR_PROF_SCOPE_END(alprsupport::Profiler::Get());
-    total_crops_processed += crops.size();
-    for (uint32_t i = 0; i < num_output_names; i++)
-      g_ort->ReleaseValue(outputs[i]);
-    g_ort->ReleaseValue(input_tensor);
-    return response;
+    total_crops_processed += num_crops;
 }
 }
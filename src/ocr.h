@@ -18,9 +18,18 @@
 #define OPENALPR_OCR_OCR_H_
 #include "config.h"
 #include "postprocess/postprocess.h"
+#include "postprocess/runtimedata.h"
+#include "ocr_decoder.h"
+#include "ocr_beam.h"
 #include <onnxruntime/core/session/onnxruntime_c_api.h>
 #include "alprlog/alprlog.h"
+#include <alprsupport/worker_pool.h>
+#include <alprgpusupport.h>
 #include <unordered_map>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #ifdef _WIN32
   #define OCR_DLL_EXPORT __declspec(dllexport)
 #else
@@ -40,12 +49,24 @@ struct OcrProvince {
   float confidence;
 };
 
+// One whole plate from the ocr_beam_width search
+struct OcrPlateCandidate {
+  std::string plate;
+  std::vector<OcrChar> characters;
+  // Product of the confidences picked at every timestep, skipping top-1 padding as overall_confidence does (0-100)
+  float confidence;
+  // Matches one of the templates of the region it was searched under
+  bool matches_template;
+};
+
 struct OcrResult {
   int image_index;
   std::vector<cv::Point2f> corner_points;
   std::vector<OcrProvince> provinces;
   std::vector<OcrChar> characters;
   float overall_confidence;
+  // Best plates first; empty unless ocr_beam_width is set
+  std::vector<OcrPlateCandidate> candidates;
 };
 
 struct OcrRequestCrop {
@@ -53,6 +74,124 @@ struct OcrRequestCrop {
   int ideal_width;
   int ideal_height;
   std::vector<float> corner_points;
+  // Region whose templates the beam search follows.  Empty = the region the network reads with most confidence.
+  std::string template_region;
+  // Camera / stream the image came from.  The result cache only matches crops from the same source.
+  int64_t source_id;
+  OcrRequestCrop() : image_index(0), ideal_width(0), ideal_height(0), source_id(0) {}
+};
+
+// Flat counterparts of OcrChar, OcrProvince and OcrResult, written by the arena variant of recognize_batch.
+// Letters and region codes point into the Ocr's token tables and stay valid for the life of the Ocr.
+struct OcrFlatChar {
+  const char* letter;
+  int char_index;
+  float confidence;
+};
+
+struct OcrFlatProvince {
+  const char* regioncode;
+  float confidence;
+};
+
+struct OcrFlatCandidate {
+  float confidence;
+  bool matches_template;
+  // Range in the arena's candidate character array
+  uint32_t first_character;
+  uint32_t num_characters;
+};
+
+struct OcrFlatResult {
+  int image_index;
+  // Position of the crop in the recognize_batch request
+  uint32_t crop_index;
+  cv::Point2f corner_points[4];
+  uint32_t num_corner_points;
+  float overall_confidence;
+  // Ranges in the arena's character and province arrays
+  uint32_t first_character;
+  uint32_t num_characters;
+  uint32_t first_province;
+  uint32_t num_provinces;
+  uint32_t first_candidate;
+  uint32_t num_candidates;
+};
+
+/*
+  Caller-owned storage for recognize_batch results.  Its arrays only ever grow, so once it has held the largest
+  batch a caller sends, recognizing into it again makes no heap allocations.
+*/
+class OcrResultArena {
+ public:
+  OcrResultArena() : num_results(0), num_characters(0), num_provinces(0), num_candidates(0),
+                     num_candidate_characters(0) {}
+  size_t size() const { return num_results; }
+  const OcrFlatResult& operator[](size_t i) const { return results[i]; }
+  const OcrFlatChar* characters(const OcrFlatResult& result) const {
+    return character_storage.data() + result.first_character;
+  }
+  const OcrFlatProvince* provinces(const OcrFlatResult& result) const {
+    return province_storage.data() + result.first_province;
+  }
+  const OcrFlatCandidate* candidates(const OcrFlatResult& result) const {
+    return candidate_storage.data() + result.first_candidate;
+  }
+  const OcrFlatChar* characters(const OcrFlatCandidate& candidate) const {
+    return candidate_character_storage.data() + candidate.first_character;
+  }
+  void clear() {
+    num_results = 0;
+    num_characters = 0;
+    num_provinces = 0;
+    num_candidates = 0;
+    num_candidate_characters = 0;
+  }
+
+ private:
+  friend class Ocr;
+  std::vector<OcrFlatResult> results;
+  std::vector<OcrFlatChar> character_storage;
+  std::vector<OcrFlatProvince> province_storage;
+  std::vector<OcrFlatCandidate> candidate_storage;
+  std::vector<OcrFlatChar> candidate_character_storage;
+  size_t num_results;
+  size_t num_characters;
+  size_t num_provinces;
+  size_t num_candidates;
+  size_t num_candidate_characters;
+};
+
+class AlprONNXRuntime;
+class TensorArena;
+class OcrResultCache;
+struct OcrCacheKey;
+struct OcrCacheStats;
+
+// One input tensor and its outputs
+struct OcrStage {
+  // Context on the shared session: holds this stage's input buffer and its output tensors per batch size
+  AlprONNXRuntime* backend;
+  // Ocr::get_input_shape; only the batch entry changes
+  std::vector<int64_t> input_dims;
+};
+
+// Scratch memory owned by one recognize_batch caller at a time.  The ORT session (and the model weights) are
+// shared by every workspace, since OrtSession::Run may be called from several threads at once.
+struct OcrWorkspace {
+  // stages[0] always exists.  The pipelined recognize_batch adds two more, so it can prepare, infer and decode
+  // three sub-batches at once.
+  std::vector<OcrStage> stages;
+  std::vector<OcrCropInfo> gpu_crop_info;
+  OcrDecodedBatch decoded;
+  OcrBeamScratch beam;
+  // Results of the vector-returning recognize_batch before they are expanded
+  OcrResultArena results;
+  // Start of the crops of the recognize_batch call in progress (for OcrFlatResult::crop_index)
+  const OcrRequestCrop* batch_crops;
+  // NUMA node of the thread that created it, where its input tensors live with ocr_numa_local (-1 = unknown)
+  int numa_node;
+  OcrWorkspace() : batch_crops(NULL), numa_node(-1) {}
 };
 
 class OCR_DLL_EXPORT Ocr {
@@ -60,34 +199,165 @@ class OCR_DLL_EXPORT Ocr {
   explicit Ocr(Config* config);
   virtual ~Ocr();
   bool initialized() { return _initialized; }
-  std::vector<OcrResult> recognize_batch(std::vector<cv::Mat>& images, std::vector<OcrRequestCrop> crops);
-  void initialize_input_tensor(std::vector<cv::Mat>& images, std::vector<OcrRequestCrop> crops);
+  // Largest number of crops sent to the network in one inference
+  int get_max_batch() { return max_batch; }
+  int get_topk() { return topk; }
+  int get_max_timesteps() { return max_timesteps; }
+
+  // Safe to call from several threads.  Each call borrows a workspace for its duration and blocks while
+  // all ocr_max_concurrency workspaces are in use.
+  std::vector<OcrResult> recognize_batch(std::vector<cv::Mat>& images, const std::vector<OcrRequestCrop>& crops);
+
+  // Callers that run many batches (e.g., a camera worker) can hold on to a workspace instead; OcrWorkspaceLease
+  // returns it even when a batch throws
+  OcrWorkspace* checkout_workspace();
+  void return_workspace(OcrWorkspace* workspace);
+  std::vector<OcrResult> recognize_batch(OcrWorkspace* workspace, std::vector<cv::Mat>& images,
+                                         const std::vector<OcrRequestCrop>& crops);
+
+  // Zero-copy variant: reads num_crops crops in place and replaces the contents of `results'.  With a held
+  // workspace and an arena that has already grown to the batch size, the CPU path makes no heap allocations.
+  void recognize_batch(OcrWorkspace* workspace, std::vector<cv::Mat>& images, const OcrRequestCrop* crops,
+                       size_t num_crops, OcrResultArena& results);
+
+  void initialize_input_tensor(std::vector<cv::Mat>& images, const std::vector<OcrRequestCrop>& crops);
+  // Number of threads preparing crops in initialize_input_tensor (1 = serial, <= 0 = one per core).
+  // Not safe to call while other threads are recognizing.
+  void set_preprocess_threads(int num_threads);
+  // The number it resolved to
+  int get_preprocess_threads() { return preprocess_pool != NULL ? preprocess_pool->concurrency() : 1; }
+
+  // Float network input for `crops' in the model's layout (see get_input_shape), whatever its input type (used
+  // to export calibration data for quantization)
+  void preprocess_crops(std::vector<cv::Mat>& images, const std::vector<OcrRequestCrop>& crops, float* out);
+  // [batch, channels, height, width], or [batch, height, width, channels] for NHWC models
+  std::vector<int64_t> get_input_shape(int64_t batch) {
+    if (input_nhwc)
+      return {batch, crop_height, crop_width, crop_channels};
+    return {batch, crop_channels, crop_height, crop_width};
+  }
+  int get_crop_width() { return crop_width; }
+  int get_crop_height() { return crop_height; }
+  const std::string& get_input_name() { return input_name; }
+
+  // Hits and misses of the ocr_cache_size result cache (all zero when it is off)
+  OcrCacheStats get_cache_stats();
+
+  // Character decoder for this model's token table (exposed for benchmarking)
+  const OcrTokenDecoder& get_char_decoder() { return char_decoder; }
 
  private:
-  std::vector<OcrResult> recognize_sub_batch(std::vector<cv::Mat>& images, std::vector<OcrRequestCrop> crops);
-  bool append_character(OcrResult& word, int char_index, std::vector<std::pair<int, float>>& sorted_softmax);
+  void recognize_sub_batch(OcrWorkspace* workspace, std::vector<cv::Mat>& images, const OcrRequestCrop* crops,
+                           size_t num_crops, OcrResultArena& results);
+  // CPU only: while sub-batch N runs on this thread, N+1 is prepared and N-1 decoded on pipeline_pool
+  void recognize_pipelined(OcrWorkspace* workspace, std::vector<cv::Mat>& images, const OcrRequestCrop* crops,
+                           size_t num_crops, OcrResultArena& results);
+  void add_pipeline_stages(OcrWorkspace* workspace);
+  // Appends the results of the last inference run on `stage'
+  void decode_sub_batch(OcrWorkspace* workspace, OcrStage& stage, const OcrRequestCrop* crops, size_t num_crops,
+                        OcrResultArena& results);
+  // Fills num_crops slots and sends batch_size (>= num_crops) to the network
+  void initialize_input_tensor(OcrStage& stage, std::vector<cv::Mat>& images, const OcrRequestCrop* crops,
+                               size_t num_crops, size_t batch_size);
+  // Batch size actually run for num_crops crops (<= max_batch)
+  int padded_batch_size(size_t num_crops);
+  // Runs one blank batch of every bucket size
+  void warm_up();
+  void reserve_results(OcrResultArena& arena, size_t num_crops, size_t num_tokens, int timesteps);
+  // Runs the beam search on one crop and appends its plates to `result'.  False if must_match_pattern drops the
+  // crop.
+  bool add_candidates(OcrWorkspace* workspace, int template_region, const int64_t* ids, const float* confidences,
+                      int timesteps, int char_topk, OcrResultArena& results, OcrFlatResult& result);
+  static void expand_result(const OcrResultArena& arena, const OcrFlatResult& flat, OcrResult& result);
+  // Vector recognize_batch in front of result_cache: only the crops it hasn't seen go to the network
+  std::vector<OcrResult> recognize_batch_cached(OcrWorkspace* workspace, std::vector<cv::Mat>& images,
+                                                const std::vector<OcrRequestCrop>& crops);
+  // Writes one crop into `slot' as float or uint8 planes
+  void initialize_crop(const cv::Mat& original_image, const OcrRequestCrop& crop, ONNXTensorElementDataType type,
+                       void* slot);
+
 
 
   Config* config;
   bool _initialized;
   int max_batch;
   int batch_clamp_size;
+  // Ascending batch sizes the network is run at (see ocr_batch_buckets); the last is max_batch
+  std::vector<int> batch_buckets;
+  bool pad_to_buckets;
   int crop_width;
   int crop_height;
   const int crop_channels = 3;
   int topk;
+  // Timesteps of fixed-length models.  Dynamic ones can emit fewer, see decode_sub_batch.
   int max_timesteps;
-  std::unordered_map<int, std::string> char_name_map;
-  std::unordered_map<int, std::string> region_name_map;
+  // Top-1 characters only (top1_only in ocr_config.json)
+  bool decode_top1;
+  // ocr_config.json (or runtime.bundle), the token tables and the country's templates.  Results point into the
+  // token tables, so this copy is held for the life of the Ocr, even across RuntimeData reloads.
+  std::shared_ptr<const RuntimeData> runtime_data;
+  // OcrTokenKind of every char token
+  std::vector<uint8_t> char_token_kinds;
+  OcrTokenDecoder char_decoder;
+  // Beam search over runtime_data's templates (off unless ocr_beam_width)
+  OcrBeamSearch beam_search;
+  // PatternMatcher region of every region token (-1 = no templates)
+  std::vector<int> region_templates;
+  size_t num_regions;
   bool has_regions;
-  OrtEnv* env;
-  OrtSession* session;
-  OrtSessionOptions* session_options;
-  // Reusable memory used to house the image data
-  float* input_tensor_values;
-  size_t input_tensor_max_size;
-  size_t total_crops_processed;
+  // Owns the session; workspaces run on contexts created from it
+  AlprONNXRuntime* backend;
+  // CPU input tensors of every workspace, and the warm-up crops
+  TensorArena* tensor_arena;
+  std::string input_name;
+  // FLOAT or UINT8
+  ONNXTensorElementDataType input_type;
+  // Interleaved pixels instead of planes, and B, G, R instead of R, G, B (input_layout / input_channel_order in
+  // ocr_config.json)
+  bool input_nhwc;
+  bool input_bgr;
+  size_t char_ids_output;
+  size_t char_confids_output;
+  size_t region_ids_output;
+  size_t region_confids_output;
+  // Optional [batch] output with the timesteps each crop actually used
+  bool has_sequence_lengths;
+  size_t sequence_lengths_output;
+  std::atomic<size_t> total_crops_processed;
   size_t input_tensor_size;
+  alprsupport::WorkerPool* preprocess_pool;
+  // Results of recent crops, so a plate that sits still in a video is only read once (NULL unless ocr_cache_size)
+  OcrResultCache* result_cache;
+  // Runs the prepare and decode stages of pipelined batches (NULL unless ocr_pipeline is on)
+  alprsupport::WorkerPool* pipeline_pool;
+
+  // Workspaces are created on demand, up to max_workspaces.  With ocr_numa_local a thread prefers an idle workspace
+  // from its own node, then a new one, and only then one from another node.
+  std::vector<OcrWorkspace*> workspaces;
+  std::vector<OcrWorkspace*> idle_workspaces;
+  size_t max_workspaces;
+  std::mutex workspace_mutex;
+  std::condition_variable workspace_cv;
+  // GPU crops are written into a single device buffer owned by AlprGpuSupport
+  std::mutex gpu_mutex;
+};
+
+// Borrows a workspace for the life of the object and hands it back on every path out, including exceptions.
+// Otherwise a failed batch would keep its workspace for good, and once all of them are lost checkout_workspace
+// blocks forever.
+class OcrWorkspaceLease {
+ public:
+  explicit OcrWorkspaceLease(Ocr& ocr) : ocr(ocr), workspace(ocr.checkout_workspace()) {}
+  ~OcrWorkspaceLease() { ocr.return_workspace(workspace); }
+  OcrWorkspace* get() const { return workspace; }
+  OcrWorkspace* operator->() const { return workspace; }
+
+ private:
+  OcrWorkspaceLease(const OcrWorkspaceLease&);
+  OcrWorkspaceLease& operator=(const OcrWorkspaceLease&);
+
+  Ocr& ocr;
+  OcrWorkspace* workspace;
 };
 }  // namespace alpr
 #endif  // OPENALPR_OCR_OCR_H_
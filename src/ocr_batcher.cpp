@@ -0,0 +1,168 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+#include "ocr_batcher.h"
+#include <alprsupport/profiler.h>
+#include <alprlog.h>
+#include <exception>
+
+using std::vector;
+
+namespace alpr {
+
+OcrBatcher::OcrBatcher(Ocr* ocr, int max_delay_ms)
+                       : ocr(ocr)
+                       , max_batch(ocr->get_max_batch())
+                       , max_delay(max_delay_ms)
+                       , pending_crops(0)
+                       , stopping(false)
+                       , total_batches(0)
+                       , total_crops(0) {
+  scheduler = std::thread(&OcrBatcher::scheduler_loop, this);
+}
+
+OcrBatcher::~OcrBatcher() {
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex);
+    stopping = true;
+  }
+  pending_cv.notify_all();
+  scheduler.join();
+}
+
+std::future<vector<OcrResult>> OcrBatcher::submit(const vector<cv::Mat>& images, const vector<OcrRequestCrop>& crops) {
+  PendingRequest* request = new PendingRequest();
+  request->images = images;
+  request->crops = crops;
+  std::future<vector<OcrResult>> result = request->promise.get_future();
+  enqueue(request);
+  return result;
+}
+
+void OcrBatcher::submit(const vector<cv::Mat>& images, const vector<OcrRequestCrop>& crops,
+                        OcrBatchCallback callback) {
+  PendingRequest* request = new PendingRequest();
+  request->images = images;
+  request->crops = crops;
+  request->callback = callback;
+  enqueue(request);
+}
+
+void OcrBatcher::enqueue(PendingRequest* request) {
+  request->submitted = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex);
+    pending.push_back(request);
+    pending_crops += request->crops.size();
+  }
+  pending_cv.notify_one();
+}
+
+void OcrBatcher::scheduler_loop() {
+  while (true) {
+    vector<PendingRequest*> batch;
+    {
+      std::unique_lock<std::mutex> lock(pending_mutex);
+      while (true) {
+        if (pending.empty()) {
+          if (stopping)
+            return;
+          pending_cv.wait(lock);
+          continue;
+        }
+        // Once stopping, flush whatever is left without waiting out the deadline
+        if (stopping || pending_crops >= static_cast<size_t>(max_batch))
+          break;
+        std::chrono::steady_clock::time_point deadline = pending.front()->submitted + max_delay;
+        if (pending_cv.wait_until(lock, deadline) == std::cv_status::timeout)
+          break;
+      }
+
+      // Take whole submissions, oldest first, until the next one would overflow the batch
+      size_t batch_crops = 0;
+      while (!pending.empty()) {
+        size_t request_crops = pending.front()->crops.size();
+        if (batch.size() > 0 && batch_crops + request_crops > static_cast<size_t>(max_batch))
+          break;
+        batch.push_back(pending.front());
+        batch_crops += request_crops;
+        pending_crops -= request_crops;
+        pending.pop_front();
+      }
+    }
+    run_batch(batch);
+  }
+}
+
+void OcrBatcher::run_batch(vector<PendingRequest*>& batch) {
+  // Merge the submissions: images are appended and each crop's image_index is shifted by its submission's offset
+  vector<cv::Mat> images;
+  vector<OcrRequestCrop> crops;
+  vector<int> image_offsets;
+  for (uint32_t i = 0; i < batch.size(); i++) {
+    image_offsets.push_back(images.size());
+    for (uint32_t c = 0; c < batch[i]->crops.size(); c++) {
+      OcrRequestCrop crop = batch[i]->crops[c];
+      crop.image_index += image_offsets[i];
+      crops.push_back(crop);
+    }
+    images.insert(images.end(), batch[i]->images.begin(), batch[i]->images.end());
+  }
+  image_offsets.push_back(images.size());
+
+  vector<vector<OcrResult>> request_results(batch.size());
+  std::exception_ptr error;
+  ALPR_PROF_SCOPE_START(alprsupport::Profiler::Get(), "OcrBatcher::run_batch");
+  try {
+    vector<OcrResult> results = ocr->recognize_batch(images, crops);
+
+    // Results come back in crop order, so scattering by image range keeps each submission's order intact
+    uint32_t request_idx = 0;
+    for (uint32_t r = 0; r < results.size(); r++) {
+      while (results[r].image_index >= image_offsets[request_idx + 1])
+        request_idx++;
+      results[r].image_index -= image_offsets[request_idx];
+      request_results[request_idx].push_back(results[r]);
+    }
+  } catch (...) {
+    error = std::current_exception();
+    // Nobody gets part of a failed batch
+    for (uint32_t i = 0; i < request_results.size(); i++)
+      request_results[i].clear();
+  }
+  ALPR_PROF_SCOPE_END(alprsupport::Profiler::Get());
+  total_batches++;
+  total_crops += crops.size();
+
+  for (uint32_t i = 0; i < batch.size(); i++) {
+    PendingRequest* request = batch[i];
+    if (request->callback) {
+      if (error)
+        ALPR_ERROR << "OCR batch failed for " << request->crops.size() << " crops";
+      try {
+        request->callback(request_results[i], error);
+      } catch (...) {
+        ALPR_ERROR << "Exception thrown from an OCR batch callback";
+      }
+    } else if (error) {
+      request->promise.set_exception(error);
+    } else {
+      request->promise.set_value(request_results[i]);
+    }
+    delete request;
+  }
+}
+}  // namespace alpr
@@ -0,0 +1,89 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+#ifndef OPENALPR_OCR_OCR_BATCHER_H_
+#define OPENALPR_OCR_OCR_BATCHER_H_
+
+#include "ocr.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace alpr {
+
+// Receives the results for the crops of one submission (same order and image indexes as recognize_batch).  If the
+// batch failed, `error' holds what recognize_batch threw and `results' is empty; it is NULL otherwise.
+typedef std::function<void(std::vector<OcrResult>& results, std::exception_ptr error)> OcrBatchCallback;
+
+/*
+  Collects crops from many callers (e.g., one per camera) into shared Ocr batches.
+
+  A batch is sent to the network once max_batch crops are waiting or the oldest submission has waited
+  max_delay_ms, whichever happens first.  Submissions are never split: each one keeps its own images and
+  image_index numbering, and gets back exactly what recognize_batch would have returned for it.
+*/
+class OCR_DLL_EXPORT OcrBatcher {
+ public:
+  OcrBatcher(Ocr* ocr, int max_delay_ms);
+  // Finishes every pending submission before returning
+  virtual ~OcrBatcher();
+
+  std::future<std::vector<OcrResult>> submit(const std::vector<cv::Mat>& images,
+                                             const std::vector<OcrRequestCrop>& crops);
+  // The callback runs on the batching thread, so it should hand off any slow work.  It is called exactly once,
+  // whether the batch succeeds or not.
+  void submit(const std::vector<cv::Mat>& images, const std::vector<OcrRequestCrop>& crops,
+              OcrBatchCallback callback);
+
+  size_t batches_run() { return total_batches; }
+  size_t crops_run() { return total_crops; }
+
+ private:
+  struct PendingRequest {
+    std::vector<cv::Mat> images;
+    std::vector<OcrRequestCrop> crops;
+    std::promise<std::vector<OcrResult>> promise;
+    OcrBatchCallback callback;
+    std::chrono::steady_clock::time_point submitted;
+  };
+
+  void enqueue(PendingRequest* request);
+  void scheduler_loop();
+  void run_batch(std::vector<PendingRequest*>& batch);
+
+  Ocr* ocr;
+  const int max_batch;
+  const std::chrono::milliseconds max_delay;
+
+  std::deque<PendingRequest*> pending;
+  size_t pending_crops;
+  std::mutex pending_mutex;
+  std::condition_variable pending_cv;
+  bool stopping;
+  std::thread scheduler;
+
+  std::atomic<size_t> total_batches;
+  std::atomic<size_t> total_crops;
+};
+}  // namespace alpr
+#endif  // OPENALPR_OCR_OCR_BATCHER_H_
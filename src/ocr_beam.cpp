@@ -0,0 +1,177 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+#include "ocr_beam.h"
+#include <algorithm>
+
+namespace alpr {
+
+OcrBeamSearch::OcrBeamSearch() : matcher(NULL), min_confidence(0), beam_width(0), num_candidates(0) {}
+
+OcrBeamSearch::OcrBeamSearch(const std::vector<uint8_t>& token_kinds, const std::vector<uint32_t>& token_classes,
+                             const PatternMatcher* matcher, float min_confidence, int beam_width,
+                             int num_candidates)
+    : token_kinds(token_kinds), token_classes(token_classes), matcher(matcher), min_confidence(min_confidence),
+      beam_width(beam_width), num_candidates(std::max(1, num_candidates)) {}
+
+void OcrBeamSearch::reset(OcrBeamSet& set, size_t capacity, size_t stride) {
+  set.capacity = capacity;
+  set.stride = stride;
+  set.hypotheses.clear();
+  if (set.hypotheses.capacity() < capacity)
+    set.hypotheses.reserve(capacity);
+  if (set.tokens.size() < capacity * stride)
+    set.tokens.resize(capacity * stride);
+}
+
+void OcrBeamSearch::offer(OcrBeamSet& to, const OcrBeamSet& from, const OcrBeamHypothesis& parent, float score,
+                          const PatternMatcher::State& state, const OcrDecodedToken* token) {
+  const OcrDecodedToken* parent_tokens = &from.tokens[parent.first_token];
+  uint32_t num_tokens = parent.num_tokens + (token != NULL ? 1 : 0);
+
+  // Paths that only differ in where they padded spell the same plate; keep the best of them
+  size_t slot = to.hypotheses.size();
+  for (size_t i = 0; i < to.hypotheses.size(); i++) {
+    const OcrBeamHypothesis& other = to.hypotheses[i];
+    if (other.num_tokens != num_tokens)
+      continue;
+    const OcrDecodedToken* other_tokens = &to.tokens[other.first_token];
+    bool same = true;
+    for (uint32_t c = 0; same && c < parent.num_tokens; c++)
+      same = other_tokens[c].id == parent_tokens[c].id;
+    if (same && token != NULL)
+      same = other_tokens[parent.num_tokens].id == token->id;
+    if (!same)
+      continue;
+    if (score <= other.score)
+      return;
+    slot = i;
+    break;
+  }
+
+  if (slot == to.hypotheses.size()) {
+    if (to.hypotheses.size() < to.capacity) {
+      OcrBeamHypothesis added;
+      added.first_token = slot * to.stride;
+      to.hypotheses.push_back(added);
+    } else {
+      // Full: replace the worst, if this is better
+      slot = 0;
+      for (size_t i = 1; i < to.hypotheses.size(); i++) {
+        if (to.hypotheses[i].score < to.hypotheses[slot].score)
+          slot = i;
+      }
+      if (score <= to.hypotheses[slot].score)
+        return;
+    }
+  }
+
+  OcrBeamHypothesis& h = to.hypotheses[slot];
+  h.score = score;
+  h.state = state;
+  h.num_tokens = num_tokens;
+  OcrDecodedToken* tokens = &to.tokens[h.first_token];
+  std::copy(parent_tokens, parent_tokens + parent.num_tokens, tokens);
+  if (token != NULL)
+    tokens[parent.num_tokens] = *token;
+}
+
+void OcrBeamSearch::search(const int64_t* ids, const float* confidences, int timesteps, int topk,
+                           int template_region, OcrBeamScratch& scratch) const {
+  const bool constrained = matcher != NULL && template_region >= 0;
+  reset(scratch.beams[0], beam_width, timesteps);
+  reset(scratch.beams[1], beam_width, timesteps);
+  reset(scratch.finished, num_candidates, timesteps);
+
+  OcrBeamHypothesis root;
+  root.score = 1;
+  root.first_token = 0;
+  root.num_tokens = 0;
+  if (constrained)
+    matcher->start(template_region, root.state);
+  scratch.beams[0].hypotheses.push_back(root);
+
+  OcrBeamSet* current = &scratch.beams[0];
+  OcrBeamSet* next = &scratch.beams[1];
+  for (int t = 0; t < timesteps && current->hypotheses.size() > 0; t++) {
+    // Scores only go down, so once the finished plates beat every open one there is nothing left to find
+    if (scratch.finished.hypotheses.size() == scratch.finished.capacity) {
+      float best_open = 0;
+      for (size_t i = 0; i < current->hypotheses.size(); i++)
+        best_open = std::max(best_open, current->hypotheses[i].score);
+      float worst_finished = scratch.finished.hypotheses[0].score;
+      for (size_t i = 1; i < scratch.finished.hypotheses.size(); i++)
+        worst_finished = std::min(worst_finished, scratch.finished.hypotheses[i].score);
+      if (best_open <= worst_finished)
+        break;
+    }
+
+    next->hypotheses.clear();
+    const size_t row = static_cast<size_t>(t) * topk;
+    for (size_t h = 0; h < current->hypotheses.size(); h++) {
+      const OcrBeamHypothesis& parent = current->hypotheses[h];
+      for (int k = 0; k < topk; k++) {
+        float confidence = confidences[row + k];
+        uint32_t id = static_cast<uint32_t>(ids[row + k] & 0xFFFFFFFF);
+        // NaN is never picked either
+        if (!(confidence >= min_confidence)) {
+          // The decoder skips a timestep whose top-1 is too weak, so the plate may pass it for free
+          if (k == 0)
+            offer(*next, *current, parent, parent.score, parent.state, NULL);
+          continue;
+        }
+        float score = parent.score * confidence;
+        switch (kind(id)) {
+          case OCR_TOKEN_PADDING:
+            // Top-1 padding is left out of the product, as in overall_confidence; lower-ranked padding still costs
+            // its confidence, or dropping a character would always score better than reading it
+            offer(*next, *current, parent, k == 0 ? parent.score : score, parent.state, NULL);
+            break;
+          case OCR_TOKEN_END:
+            if (!constrained || matcher->accepts(template_region, parent.state))
+              offer(scratch.finished, *current, parent, score, parent.state, NULL);
+            break;
+          case OCR_TOKEN_NEGATIVE:
+            break;
+          default: {
+            PatternMatcher::State state = parent.state;
+            if (constrained && !matcher->advance(template_region, state, symbol_class(id)))
+              break;
+            OcrDecodedToken token;
+            token.id = id;
+            token.timestep = t;
+            token.confidence = confidence;
+            offer(*next, *current, parent, score, state, &token);
+          }
+        }
+      }
+    }
+    std::swap(current, next);
+  }
+
+  // Plates still open after the last timestep end there
+  for (size_t h = 0; h < current->hypotheses.size(); h++) {
+    const OcrBeamHypothesis& open = current->hypotheses[h];
+    if (open.num_tokens > 0 && (!constrained || matcher->accepts(template_region, open.state)))
+      offer(scratch.finished, *current, open, open.score, open.state, NULL);
+  }
+
+  std::vector<OcrBeamHypothesis>& plates = scratch.finished.hypotheses;
+  std::sort(plates.begin(), plates.end(),
+            [](const OcrBeamHypothesis& a, const OcrBeamHypothesis& b) { return a.score > b.score; });
+}
+
+}  // namespace alpr
@@ -0,0 +1,103 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+#ifndef OPENALPR_OCR_OCR_BEAM_H_
+#define OPENALPR_OCR_OCR_BEAM_H_
+
+#include "ocr_decoder.h"
+#include "postprocess/patternmatcher.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace alpr {
+
+// One partial or finished plate.  Its characters are tokens[first_token, first_token + num_tokens) of its set.
+struct OcrBeamHypothesis {
+  // Product of the confidences of the candidate picked at every timestep so far
+  float score;
+  PatternMatcher::State state;
+  uint32_t first_token;
+  uint32_t num_tokens;
+};
+
+// Up to `capacity' best hypotheses, each with room for `stride' characters
+struct OcrBeamSet {
+  std::vector<OcrBeamHypothesis> hypotheses;
+  std::vector<OcrDecodedToken> tokens;
+  size_t capacity;
+  size_t stride;
+  OcrBeamSet() : capacity(0), stride(0) {}
+};
+
+// Scratch and output of OcrBeamSearch::search.  Grows to the largest beam and crop seen, then is reused.
+struct OcrBeamScratch {
+  OcrBeamSet beams[2];
+  // Best finished plates, highest score first after search()
+  OcrBeamSet finished;
+};
+
+/*
+  Beam search over one crop's [timesteps, topk] character_ids / character_confidences rows.
+
+  A plate picks one of the top-k candidates at every timestep, like the top-1 walk in OcrTokenDecoder: padding adds
+  nothing, a letter is appended, and an end token (or the last timestep) finishes the plate; negative tokens and
+  candidates below min_confidence are never picked.  Its score is the product of the picked confidences, leaving
+  out top-1 padding and timesteps whose top-1 is below min_confidence the way the decoder does, so the top-1 path
+  scores the same as OcrDecodedSequence::overall_confidence.
+
+  With a template region, every hypothesis carries its PatternMatcher state: a letter no template allows at that
+  position drops the hypothesis, and a plate only finishes if it matches a whole template.  The templates then cost
+  one AND per candidate letter instead of a regex run per permutation string.
+*/
+class OcrBeamSearch {
+ public:
+  OcrBeamSearch();
+  // token_classes: PatternMatcher::symbolClass of every character token.  `matcher' must outlive the search.
+  OcrBeamSearch(const std::vector<uint8_t>& token_kinds, const std::vector<uint32_t>& token_classes,
+                const PatternMatcher* matcher, float min_confidence, int beam_width, int num_candidates);
+
+  bool enabled() const { return beam_width > 0; }
+  const PatternMatcher* get_matcher() const { return matcher; }
+
+  // template_region: PatternMatcher::regionIndex, or -1 for no templates
+  void search(const int64_t* ids, const float* confidences, int timesteps, int topk, int template_region,
+              OcrBeamScratch& scratch) const;
+
+ private:
+  uint8_t kind(uint32_t id) const {
+    return id < token_kinds.size() ? token_kinds[id] : static_cast<uint8_t>(OCR_TOKEN_LETTER);
+  }
+  // Ids outside the token table are letters no template names, i.e. the matcher's other class
+  uint32_t symbol_class(uint32_t id) const {
+    return id < token_classes.size() ? token_classes[id] : matcher->otherClass();
+  }
+  // Adds `parent' (from `from') extended by `token' (NULL = nothing appended) to `to', unless it is worse than
+  // everything there or duplicates a better plate
+  static void offer(OcrBeamSet& to, const OcrBeamSet& from, const OcrBeamHypothesis& parent, float score,
+                    const PatternMatcher::State& state, const OcrDecodedToken* token);
+  static void reset(OcrBeamSet& set, size_t capacity, size_t stride);
+
+  std::vector<uint8_t> token_kinds;
+  std::vector<uint32_t> token_classes;
+  const PatternMatcher* matcher;
+  float min_confidence;
+  int beam_width;
+  int num_candidates;
+};
+
+}  // namespace alpr
+#endif  // OPENALPR_OCR_OCR_BEAM_H_
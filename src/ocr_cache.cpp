@@ -0,0 +1,212 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+#include "ocr_cache.h"
+#include "preprocess/crop_kernel.h"
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <string.h>
+
+namespace alpr {
+
+namespace {
+// The crop is warped at 4x2 times the 9x8 hash grid and box-filtered down, so single noisy pixels don't flip bits
+const int HASH_COLS = 9;
+const int HASH_ROWS = 8;
+const int SAMPLE_X = 4;
+const int SAMPLE_Y = 2;
+const int WARP_WIDTH = HASH_COLS * SAMPLE_X;
+const int WARP_HEIGHT = HASH_ROWS * SAMPLE_Y;
+
+int popcount64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(x);
+#else
+  int count = 0;
+  for (; x; x &= x - 1)
+    count++;
+  return count;
+#endif
+}
+
+int32_t to_cell(float value, int cell) {
+  return static_cast<int32_t>(std::floor(value / cell));
+}
+}  // namespace
+
+OcrResultCache::OcrResultCache(size_t capacity, int ttl_ms, int max_hamming, int geometry_cell)
+    : capacity(std::max<size_t>(1, capacity)),
+      ttl(std::chrono::milliseconds(ttl_ms)),
+      max_hamming(max_hamming),
+      geometry_cell(std::max(1, geometry_cell)) {
+  memset(&counters, 0, sizeof(counters));
+}
+
+bool OcrResultCache::make_key(const cv::Mat& image, const OcrRequestCrop& crop, OcrCacheKey& key) const {
+  key.source_id = crop.source_id;
+  key.hash = 0;
+  key.cell_x = key.cell_y = key.cell_width = 0;
+  // The crop kernel only reads 8 bit BGR; other frames go through warpPerspective uncached
+  if (crop.corner_points.size() < 8 || image.type() != CV_8UC3)
+    return false;
+
+  const std::vector<float>& p = crop.corner_points;
+  float center_x = (p[0] + p[2] + p[4] + p[6]) / 4;
+  float center_y = (p[1] + p[3] + p[5] + p[7]) / 4;
+  float width = std::sqrt((p[2] - p[0]) * (p[2] - p[0]) + (p[3] - p[1]) * (p[3] - p[1]));
+  key.cell_x = to_cell(center_x, geometry_cell);
+  key.cell_y = to_cell(center_y, geometry_cell);
+  key.cell_width = to_cell(width, geometry_cell);
+
+  // Same rectification as the network input, just much smaller
+  double dst_to_src[9];
+  crop_homography(crop.corner_points, WARP_WIDTH, WARP_HEIGHT, dst_to_src);
+  float planes[3 * WARP_WIDTH * WARP_HEIGHT];
+  warp_crop_to_planar_rgb(image, dst_to_src, WARP_WIDTH, WARP_HEIGHT, planes);
+
+  const int plane_size = WARP_WIDTH * WARP_HEIGHT;
+  float gray[HASH_ROWS][HASH_COLS];
+  for (int r = 0; r < HASH_ROWS; r++) {
+    for (int c = 0; c < HASH_COLS; c++) {
+      float sum = 0;
+      for (int y = r * SAMPLE_Y; y < (r + 1) * SAMPLE_Y; y++) {
+        for (int x = c * SAMPLE_X; x < (c + 1) * SAMPLE_X; x++) {
+          int i = y * WARP_WIDTH + x;
+          sum += 0.299f * planes[i] + 0.587f * planes[plane_size + i] + 0.114f * planes[2 * plane_size + i];
+        }
+      }
+      gray[r][c] = sum;
+    }
+  }
+  for (int r = 0; r < HASH_ROWS; r++) {
+    for (int c = 0; c + 1 < HASH_COLS; c++)
+      key.hash = (key.hash << 1) | (gray[r][c] > gray[r][c + 1] ? 1 : 0);
+  }
+  return true;
+}
+
+uint64_t OcrResultCache::cell_id(int64_t source_id, int32_t x, int32_t y, int32_t width) {
+  // 21 bits each is far more than any frame needs.  Sources are mixed in rather than packed, so two of them may
+  // share a cell; find() tells their entries apart.
+  const uint64_t MASK = (1u << 21) - 1;
+  uint64_t id = ((static_cast<uint64_t>(x) & MASK) << 42) | ((static_cast<uint64_t>(y) & MASK) << 21) |
+                (static_cast<uint64_t>(width) & MASK);
+  return id ^ (static_cast<uint64_t>(source_id) * 0x9E3779B97F4A7C15ull);
+}
+
+OcrResultCache::EntryList::iterator OcrResultCache::find(const OcrCacheKey& key, Clock::time_point now) {
+  EntryList::iterator best = lru.end();
+  int best_distance = max_hamming + 1;
+  // A plate sitting on a cell boundary jitters between the two, so look at the neighbours as well
+  for (int dx = -1; dx <= 1; dx++) {
+    for (int dy = -1; dy <= 1; dy++) {
+      for (int dw = -1; dw <= 1; dw++) {
+        auto cell = cells.find(cell_id(key.source_id, key.cell_x + dx, key.cell_y + dy, key.cell_width + dw));
+        if (cell == cells.end())
+          continue;
+        const std::vector<EntryList::iterator>& entries = cell->second;
+        for (size_t i = 0; i < entries.size(); i++) {
+          EntryList::iterator entry = entries[i];
+          if (now - entry->inserted > ttl) {
+            expired.push_back(entry);
+            continue;
+          }
+          if (entry->key.source_id != key.source_id)
+            continue;
+          int distance = popcount64(entry->key.hash ^ key.hash);
+          if (distance < best_distance) {
+            best_distance = distance;
+            best = entry;
+          }
+        }
+      }
+    }
+  }
+  counters.expirations += expired.size();
+  for (size_t i = 0; i < expired.size(); i++)
+    erase(expired[i]);
+  expired.clear();
+  return best;
+}
+
+void OcrResultCache::erase(EntryList::iterator entry) {
+  auto cell = cells.find(cell_id(entry->key.source_id, entry->key.cell_x, entry->key.cell_y, entry->key.cell_width));
+  std::vector<EntryList::iterator>& entries = cell->second;
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (entries[i] == entry) {
+      entries[i] = entries.back();
+      entries.pop_back();
+      break;
+    }
+  }
+  if (entries.empty())
+    cells.erase(cell);
+  lru.erase(entry);
+}
+
+bool OcrResultCache::lookup(const OcrCacheKey& key, bool& found, OcrResult& result) {
+  std::lock_guard<std::mutex> lock(mutex);
+  EntryList::iterator entry = find(key, Clock::now());
+  if (entry == lru.end()) {
+    counters.misses++;
+    return false;
+  }
+  counters.hits++;
+  lru.splice(lru.begin(), lru, entry);
+  found = entry->found;
+  if (found)
+    result = entry->result;
+  return true;
+}
+
+void OcrResultCache::insert(const OcrCacheKey& key, const OcrResult* result) {
+  std::lock_guard<std::mutex> lock(mutex);
+  Clock::time_point now = Clock::now();
+  // A near-identical crop read again (e.g. by two threads at once) replaces the older entry
+  EntryList::iterator existing = find(key, now);
+  if (existing != lru.end())
+    erase(existing);
+
+  lru.push_front(Entry());
+  Entry& entry = lru.front();
+  entry.key = key;
+  entry.found = result != NULL;
+  if (result != NULL)
+    entry.result = *result;
+  entry.inserted = now;
+  cells[cell_id(key.source_id, key.cell_x, key.cell_y, key.cell_width)].push_back(lru.begin());
+
+  while (lru.size() > capacity) {
+    counters.evictions++;
+    erase(std::prev(lru.end()));
+  }
+}
+
+OcrCacheStats OcrResultCache::stats() {
+  std::lock_guard<std::mutex> lock(mutex);
+  OcrCacheStats stats = counters;
+  stats.entries = lru.size();
+  return stats;
+}
+
+void OcrResultCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  lru.clear();
+  cells.clear();
+}
+
+}  // namespace alpr
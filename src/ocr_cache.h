@@ -0,0 +1,109 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+#ifndef OPENALPR_OCR_OCR_CACHE_H_
+#define OPENALPR_OCR_OCR_CACHE_H_
+
+#include "ocr.h"
+#include <opencv2/core/core.hpp>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+namespace alpr {
+
+// Identifies a crop for the cache: which source it came from, where it is in the frame and what it looks like
+struct OcrCacheKey {
+  int64_t source_id;
+  // dHash of the rectified crop: 8 rows of 8 "brighter than the pixel to the right" bits
+  uint64_t hash;
+  // Plate center and width, in ocr_cache_geometry_cell pixel cells
+  int32_t cell_x;
+  int32_t cell_y;
+  int32_t cell_width;
+};
+
+struct OcrCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  // Entries dropped because the cache was full / because they outlived the TTL
+  uint64_t evictions;
+  uint64_t expirations;
+  size_t entries;
+  double hit_rate() const { return hits + misses == 0 ? 0 : static_cast<double>(hits) / (hits + misses); }
+};
+
+/*
+  LRU cache of OCR results for repeated crops, e.g. a parked car seen in every frame of a video.
+
+  A crop matches an entry from the same source when its geometry falls in the same or a neighbouring cell and the
+  two hashes differ in at most max_hamming bits.  Entries older than ttl_ms are never returned, so a plate that changes in place (a
+  different car parking in the same spot) is read again within the TTL.  Crops that produced no result are cached
+  too, so a steady false detection doesn't run the network every frame either.
+
+  Safe to call from several threads.
+*/
+class OcrResultCache {
+ public:
+  OcrResultCache(size_t capacity, int ttl_ms, int max_hamming, int geometry_cell);
+
+  // Hash is computed from a 36x16 warp of the crop; costs a few microseconds.  False for a crop without its 4
+  // corners or from an image that isn't CV_8UC3, which can't be cached: it must be neither looked up nor inserted.
+  bool make_key(const cv::Mat& image, const OcrRequestCrop& crop, OcrCacheKey& key) const;
+
+  // True on a hit.  `found' tells whether the cached crop produced a result, which is then copied to `result'.
+  bool lookup(const OcrCacheKey& key, bool& found, OcrResult& result);
+  // `result' NULL records that the crop produced no result
+  void insert(const OcrCacheKey& key, const OcrResult* result);
+
+  OcrCacheStats stats();
+  void clear();
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+  struct Entry {
+    OcrCacheKey key;
+    bool found;
+    OcrResult result;
+    Clock::time_point inserted;
+  };
+  typedef std::list<Entry> EntryList;
+
+  static uint64_t cell_id(int64_t source_id, int32_t x, int32_t y, int32_t width);
+  // Closest live entry around `key', or lru.end().  Drops the expired entries it comes across.  Needs the lock.
+  EntryList::iterator find(const OcrCacheKey& key, Clock::time_point now);
+  void erase(EntryList::iterator entry);
+
+  size_t capacity;
+  Clock::duration ttl;
+  int max_hamming;
+  int geometry_cell;
+
+  std::mutex mutex;
+  // Most recently used first
+  EntryList lru;
+  // Entries by source and geometry cell
+  std::unordered_map<uint64_t, std::vector<EntryList::iterator>> cells;
+  // Scratch for find()
+  std::vector<EntryList::iterator> expired;
+  OcrCacheStats counters;
+};
+
+}  // namespace alpr
+#endif  // OPENALPR_OCR_OCR_CACHE_H_
@@ -0,0 +1,271 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+#include "ocr_decoder.h"
+#include <alprsupport/cpu_detect.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define ALPR_OCR_DECODER_SIMD
+#include <immintrin.h>
+#endif
+
+namespace alpr {
+
+namespace {
+const uint8_t FLAG_VALID = 1;
+
+#ifdef ALPR_OCR_DECODER_SIMD
+// Low 32 bits of 4 consecutive int64 ids (the ids are compared as `id & 0xFFFFFFFF`, like the table lookup)
+inline __m128i low_words_sse2(const int64_t* ids) {
+  __m128 a = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ids)));
+  __m128 b = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ids + 2)));
+  return _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+size_t classify_sse2(const int64_t* ids, const float* confidences, size_t count, float min_confidence,
+                     const std::pair<uint32_t, uint8_t>* specials, size_t num_specials, uint8_t* flags) {
+  // `confidence < min` is false for NaN, so the scalar code keeps NaNs; NLT does the same
+  const __m128 min_v = _mm_set1_ps(min_confidence);
+  const __m128i one = _mm_set1_epi32(FLAG_VALID);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i valid = _mm_and_si128(_mm_castps_si128(_mm_cmpnlt_ps(_mm_loadu_ps(confidences + i), min_v)), one);
+    __m128i id = low_words_sse2(ids + i);
+    __m128i kind = _mm_setzero_si128();
+    for (size_t s = 0; s < num_specials; s++) {
+      __m128i match = _mm_cmpeq_epi32(id, _mm_set1_epi32(static_cast<int>(specials[s].first)));
+      kind = _mm_or_si128(kind, _mm_and_si128(match, _mm_set1_epi32(specials[s].second << 1)));
+    }
+    __m128i f = _mm_or_si128(kind, valid);
+    f = _mm_packs_epi32(f, f);
+    f = _mm_packus_epi16(f, f);
+    int packed = _mm_cvtsi128_si32(f);
+    memcpy(flags + i, &packed, 4);
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+size_t classify_avx2(const int64_t* ids, const float* confidences, size_t count, float min_confidence,
+                     const std::pair<uint32_t, uint8_t>* specials, size_t num_specials, uint8_t* flags) {
+  const __m256 min_v = _mm256_set1_ps(min_confidence);
+  const __m256i one = _mm256_set1_epi32(FLAG_VALID);
+  const __m256i even_words = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i valid = _mm256_and_si256(
+        _mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(confidences + i), min_v, _CMP_NLT_UQ)), one);
+    __m256i a = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(ids + i)),
+                                            even_words);
+    __m256i b = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(ids + i + 4)),
+                                            even_words);
+    __m256i id = _mm256_permute2x128_si256(a, b, 0x20);
+    __m256i kind = _mm256_setzero_si256();
+    for (size_t s = 0; s < num_specials; s++) {
+      __m256i match = _mm256_cmpeq_epi32(id, _mm256_set1_epi32(static_cast<int>(specials[s].first)));
+      kind = _mm256_or_si256(kind, _mm256_and_si256(match, _mm256_set1_epi32(specials[s].second << 1)));
+    }
+    __m256i f = _mm256_or_si256(kind, valid);
+    f = _mm256_packs_epi32(f, f);
+    f = _mm256_packus_epi16(f, f);
+    int low = _mm_cvtsi128_si32(_mm256_castsi256_si128(f));
+    int high = _mm_cvtsi128_si32(_mm256_extracti128_si256(f, 1));
+    memcpy(flags + i, &low, 4);
+    memcpy(flags + i + 4, &high, 4);
+  }
+  return i;
+}
+#endif
+
+// Timesteps to read for crop b
+inline int crop_timesteps(const int64_t* lengths, int b, int timesteps) {
+  if (lengths == NULL || lengths[b] >= timesteps)
+    return timesteps;
+  return lengths[b] < 0 ? 0 : static_cast<int>(lengths[b]);
+}
+
+bool detect_avx2() {
+#ifdef ALPR_OCR_DECODER_SIMD
+  alprsupport::cpu_info_t* info = alprsupport::cpu_detect();
+  if (info == NULL)
+    return false;
+  bool avx2 = alprsupport::has_avx(info) && alprsupport::has_avx2(info);
+  free(info);
+  return avx2;
+#else
+  return false;
+#endif
+}
+}  // namespace
+
+OcrTokenDecoder::OcrTokenDecoder() : min_confidence(0) {}
+
+OcrTokenDecoder::OcrTokenDecoder(const std::vector<uint8_t>& token_kinds, float min_confidence)
+    : token_kinds(token_kinds), min_confidence(min_confidence) {
+  for (uint32_t i = 0; i < token_kinds.size(); i++) {
+    if (token_kinds[i] != OCR_TOKEN_LETTER)
+      special_tokens.push_back(std::make_pair(i, token_kinds[i]));
+  }
+}
+
+bool OcrTokenDecoder::uses_avx2() {
+  static const bool use_avx2 = detect_avx2();
+  return use_avx2;
+}
+
+void OcrTokenDecoder::classify(const int64_t* ids, const float* confidences, size_t count, uint8_t* flags) const {
+  size_t i = 0;
+#ifdef ALPR_OCR_DECODER_SIMD
+  if (uses_avx2())
+    i = classify_avx2(ids, confidences, count, min_confidence, special_tokens.data(), special_tokens.size(), flags);
+  else
+    i = classify_sse2(ids, confidences, count, min_confidence, special_tokens.data(), special_tokens.size(), flags);
+#endif
+  for (; i < count; i++)
+    flags[i] = (kind(ids[i]) << 1) | (confidences[i] < min_confidence ? 0 : FLAG_VALID);
+}
+
+void OcrTokenDecoder::reserve(OcrDecodedBatch& out, int batch, size_t count) {
+  if (out.sequences.size() < static_cast<size_t>(batch))
+    out.sequences.resize(batch);
+  if (out.tokens.size() < count)
+    out.tokens.resize(count);
+  out.num_tokens = 0;
+}
+
+void OcrTokenDecoder::decode(const int64_t* ids, const float* confidences, int batch, int timesteps, int topk,
+                             OcrDecodedBatch& out, const int64_t* lengths) const {
+  size_t count = static_cast<size_t>(batch) * timesteps * topk;
+  if (out.flags.size() < count)
+    out.flags.resize(count);
+  classify(ids, confidences, count, out.flags.data());
+  walk(ids, confidences, batch, timesteps, topk, lengths, out);
+}
+
+void OcrTokenDecoder::walk(const int64_t* ids, const float* confidences, int batch, int timesteps, int topk,
+                           const int64_t* lengths, OcrDecodedBatch& out) const {
+  reserve(out, batch, static_cast<size_t>(batch) * timesteps * topk);
+
+  const uint8_t* flags = out.flags.data();
+  for (int b = 0; b < batch; b++) {
+    OcrDecodedSequence& sequence = out.sequences[b];
+    sequence.first_token = out.num_tokens;
+    float overall_confidence = -1;
+    bool stop = false;
+    int length = crop_timesteps(lengths, b, timesteps);
+    for (int t = 0; t < length && !stop; t++) {
+      size_t row = (static_cast<size_t>(b) * timesteps + t) * topk;
+      for (int k = 0; k < topk; k++) {
+        uint8_t f = flags[row + k];
+        if (!(f & FLAG_VALID))
+          continue;
+        uint8_t token_kind = f >> 1;
+        float confidence = confidences[row + k];
+        if (k == 0) {
+          if (token_kind == OCR_TOKEN_PADDING)
+            continue;
+          overall_confidence = overall_confidence < 0 ? confidence : overall_confidence * confidence;
+          if (token_kind == OCR_TOKEN_NEGATIVE || token_kind == OCR_TOKEN_END) {
+            stop = true;
+            break;
+          }
+        }
+        if (token_kind != OCR_TOKEN_END) {
+          OcrDecodedToken& token = out.tokens[out.num_tokens++];
+          token.id = static_cast<uint32_t>(ids[row + k] & 0xFFFFFFFF);
+          token.timestep = t;
+          token.confidence = confidence;
+        }
+      }
+    }
+    sequence.num_tokens = out.num_tokens - sequence.first_token;
+    sequence.overall_confidence = overall_confidence;
+  }
+}
+
+void OcrTokenDecoder::decode_scalar(const int64_t* ids, const float* confidences, int batch, int timesteps,
+                                    int topk, OcrDecodedBatch& out, const int64_t* lengths) const {
+  reserve(out, batch, static_cast<size_t>(batch) * timesteps * topk);
+
+  for (int b = 0; b < batch; b++) {
+    OcrDecodedSequence& sequence = out.sequences[b];
+    sequence.first_token = out.num_tokens;
+    sequence.overall_confidence = -1;
+    bool keep_going = true;
+    int length = crop_timesteps(lengths, b, timesteps);
+    for (int t = 0; t < length && keep_going; t++) {
+      size_t row = (static_cast<size_t>(b) * timesteps + t) * topk;
+      for (int k = 0; k < topk; k++) {
+        float confidence = confidences[row + k];
+        if (confidence < min_confidence)
+          continue;
+        uint8_t token_kind = kind(ids[row + k]);
+        if (k == 0) {
+          if (token_kind == OCR_TOKEN_PADDING)
+            continue;
+          if (sequence.overall_confidence < 0)
+            sequence.overall_confidence = confidence;
+          else
+            sequence.overall_confidence *= confidence;
+          if (token_kind == OCR_TOKEN_NEGATIVE || token_kind == OCR_TOKEN_END) {
+            keep_going = false;
+            break;
+          }
+        }
+        if (token_kind != OCR_TOKEN_END) {
+          OcrDecodedToken& token = out.tokens[out.num_tokens++];
+          token.id = static_cast<uint32_t>(ids[row + k] & 0xFFFFFFFF);
+          token.timestep = t;
+          token.confidence = confidence;
+        }
+      }
+    }
+    sequence.num_tokens = out.num_tokens - sequence.first_token;
+  }
+}
+
+void OcrTokenDecoder::decode_top1(const int64_t* ids, const float* confidences, int batch, int timesteps, int topk,
+                                  OcrDecodedBatch& out, const int64_t* lengths) const {
+  reserve(out, batch, static_cast<size_t>(batch) * timesteps);
+  for (int b = 0; b < batch; b++) {
+    OcrDecodedSequence& sequence = out.sequences[b];
+    sequence.first_token = out.num_tokens;
+    float overall_confidence = -1;
+    int length = crop_timesteps(lengths, b, timesteps);
+    for (int t = 0; t < length; t++) {
+      size_t entry = (static_cast<size_t>(b) * timesteps + t) * topk;
+      float confidence = confidences[entry];
+      if (confidence < min_confidence)
+        continue;
+      uint8_t token_kind = kind(ids[entry]);
+      if (token_kind == OCR_TOKEN_PADDING)
+        continue;
+      overall_confidence = overall_confidence < 0 ? confidence : overall_confidence * confidence;
+      if (token_kind == OCR_TOKEN_NEGATIVE || token_kind == OCR_TOKEN_END)
+        break;
+      OcrDecodedToken& token = out.tokens[out.num_tokens++];
+      token.id = static_cast<uint32_t>(ids[entry] & 0xFFFFFFFF);
+      token.timestep = t;
+      token.confidence = confidence;
+    }
+    sequence.num_tokens = out.num_tokens - sequence.first_token;
+    sequence.overall_confidence = overall_confidence;
+  }
+}
+
+}  // namespace alpr
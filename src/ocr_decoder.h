@@ -0,0 +1,109 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+#ifndef OPENALPR_OCR_OCR_DECODER_H_
+#define OPENALPR_OCR_OCR_DECODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+namespace alpr {
+
+// How the decoder treats a character token, resolved from its text when the token table is loaded
+enum OcrTokenKind {
+  OCR_TOKEN_LETTER,
+  OCR_TOKEN_PADDING,   // * (padding) or ^ (start of sequence)
+  OCR_TOKEN_NEGATIVE,  // ~ (not a plate)
+  OCR_TOKEN_END        // $ (end of sequence)
+};
+
+// One character kept by the decoder
+struct OcrDecodedToken {
+  uint32_t id;
+  int timestep;
+  float confidence;
+};
+
+// The characters of one crop are tokens[first_token, first_token + num_tokens)
+struct OcrDecodedSequence {
+  uint32_t first_token;
+  uint32_t num_tokens;
+  // Product of the top-1 confidences up to the stop token, -1 if nothing counted
+  float overall_confidence;
+};
+
+// Decoder output and scratch.  Grows to the largest batch seen and is then reused without allocating.
+struct OcrDecodedBatch {
+  std::vector<OcrDecodedSequence> sequences;
+  std::vector<OcrDecodedToken> tokens;
+  // Per tensor entry: bit 0 = above the confidence threshold, bits 1-2 = OcrTokenKind
+  std::vector<uint8_t> flags;
+  size_t num_tokens;
+  OcrDecodedBatch() : num_tokens(0) {}
+};
+
+/*
+  Decodes whole [batch, timesteps, topk] character_ids / character_confidences tensors.
+
+  For every timestep, candidates below min_confidence are dropped.  The top-1 candidate multiplies into the
+  overall confidence and ends the sequence when it is a negative or end token (top-1 padding is skipped).  Every
+  other candidate is kept unless it is an end token.
+
+  The threshold and the token kinds are worked out for the whole tensor at once with SSE2/AVX2; the per-crop walk
+  then only reads one flag byte per entry.  decode_scalar is the element-by-element reference and produces exactly
+  the same output.
+
+  `lengths' (optional, one per crop) are the timesteps a model that stops early actually produced; the rest of the
+  crop's rows are never read.  decode_top1 keeps only the top-1 candidates (the same tokens as decode minus the
+  alternates) and reads nothing past the stop token, for callers that don't need alternates.
+*/
+class OcrTokenDecoder {
+ public:
+  OcrTokenDecoder();
+  OcrTokenDecoder(const std::vector<uint8_t>& token_kinds, float min_confidence);
+
+  void decode(const int64_t* ids, const float* confidences, int batch, int timesteps, int topk,
+              OcrDecodedBatch& out, const int64_t* lengths = NULL) const;
+  void decode_scalar(const int64_t* ids, const float* confidences, int batch, int timesteps, int topk,
+                     OcrDecodedBatch& out, const int64_t* lengths = NULL) const;
+  void decode_top1(const int64_t* ids, const float* confidences, int batch, int timesteps, int topk,
+                   OcrDecodedBatch& out, const int64_t* lengths = NULL) const;
+
+  uint8_t kind(int64_t id) const {
+    uint32_t index = static_cast<uint32_t>(id & 0xFFFFFFFF);
+    return index < token_kinds.size() ? token_kinds[index] : static_cast<uint8_t>(OCR_TOKEN_LETTER);
+  }
+
+  // True when decode() runs the AVX2 kernel on this CPU
+  static bool uses_avx2();
+
+ private:
+  void classify(const int64_t* ids, const float* confidences, size_t count, uint8_t* flags) const;
+  void walk(const int64_t* ids, const float* confidences, int batch, int timesteps, int topk,
+            const int64_t* lengths, OcrDecodedBatch& out) const;
+  // Sizes `out' for `batch' crops of up to count tokens
+  static void reserve(OcrDecodedBatch& out, int batch, size_t count);
+
+  std::vector<uint8_t> token_kinds;
+  // (id, kind) for every token that isn't a plain letter
+  std::vector<std::pair<uint32_t, uint8_t>> special_tokens;
+  float min_confidence;
+};
+
+}  // namespace alpr
+#endif  // OPENALPR_OCR_OCR_DECODER_H_
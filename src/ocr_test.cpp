@@ -14,17 +14,299 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <iostream>
+#include <alprsupport/timing.h>
+#include <alprsupport/filesystem.h>
+#include <alprsupport/json.hpp>
+#include <map>
 #include "ocr.h"
+#include "ocr_cache.h"
+#include "preprocess/crop_kernel.h"
 
 using namespace alpr;
 using namespace std;
 
+// Time initialize_input_tensor serially and with num_threads across increasing crop counts
+void benchmark_preprocessing(Ocr& alpr_ocr, std::vector<cv::Mat>& image_batch, vector<OcrRequestCrop>& crop_requests,
+                             int num_threads, int iterations) {
+  const int crop_counts[] = {1, 2, 5, 10, 25, 50, 100};
+  // 0 = one per core
+  alpr_ocr.set_preprocess_threads(num_threads);
+  const int thread_counts[] = {1, alpr_ocr.get_preprocess_threads()};
+  cout << "Preprocessing benchmark (" << thread_counts[1] << " threads, " << iterations << " iterations)" << endl;
+  cout << "crops\tserial_ms\tparallel_ms\tspeedup" << endl;
+  for (int crop_count : crop_counts) {
+    vector<OcrRequestCrop> crops;
+    for (int c = 0; c < crop_count; c++)
+      crops.push_back(crop_requests[c % crop_requests.size()]);
+
+    double elapsed_ms[2];
+    for (int t = 0; t < 2; t++) {
+      alpr_ocr.set_preprocess_threads(thread_counts[t]);
+      alpr_ocr.initialize_input_tensor(image_batch, crops);  // warm up the tensor allocation
+      timespec start_time, end_time;
+      alprsupport::getTimeMonotonic(&start_time);
+      for (int i = 0; i < iterations; i++)
+        alpr_ocr.initialize_input_tensor(image_batch, crops);
+      alprsupport::getTimeMonotonic(&end_time);
+      elapsed_ms[t] = alprsupport::diffclock(start_time, end_time) / iterations;
+    }
+    cout << crop_count << "\t" << elapsed_ms[0] << "\t" << elapsed_ms[1] << "\t" << elapsed_ms[0] / elapsed_ms[1]
+         << endl;
+  }
+  alpr_ocr.set_preprocess_threads(num_threads);
+}
+
+// Compares the single pass crop kernel with warpPerspective -> convertTo -> split on every crop, straight and with
+// the corners pulled in and pushed out so the warp is a real perspective one, and prints the largest difference
+int check_crop_kernel(Ocr& alpr_ocr, std::vector<cv::Mat>& image_batch, vector<OcrRequestCrop>& crop_requests) {
+  const int crop_width = alpr_ocr.get_crop_width();
+  const int crop_height = alpr_ocr.get_crop_height();
+  const float skews[] = {0.0f, 0.08f, -0.15f};
+  vector<cv::Point2f> small_corners;
+  small_corners.push_back(cv::Point2f(0, 0));
+  small_corners.push_back(cv::Point2f(crop_width, 0));
+  small_corners.push_back(cv::Point2f(crop_width, crop_height));
+  small_corners.push_back(cv::Point2f(0, crop_height));
+
+  vector<float> fused(3 * crop_width * crop_height);
+  float max_difference = 0;
+  size_t differing = 0;
+  size_t compared = 0;
+  for (const OcrRequestCrop& request : crop_requests) {
+    const cv::Mat& image = image_batch[request.image_index];
+    for (float skew : skews) {
+      // Top corners move in by `skew' of the width, the bottom ones out
+      OcrRequestCrop crop = request;
+      float dx = skew * crop.ideal_width;
+      crop.corner_points[0] += dx;
+      crop.corner_points[2] -= dx;
+      crop.corner_points[4] += dx;
+      crop.corner_points[6] -= dx;
+
+      double M[9];
+      crop_homography(crop.corner_points, crop_width, crop_height, M);
+      warp_crop_to_planar_rgb(image, M, crop_width, crop_height, fused.data());
+
+      vector<cv::Point2f> big_corners;
+      for (size_t z = 0; z + 1 < crop.corner_points.size(); z += 2)
+        big_corners.push_back(cv::Point2f(crop.corner_points[z], crop.corner_points[z + 1]));
+      cv::Mat warped, converted;
+      cv::warpPerspective(image, warped, cv::getPerspectiveTransform(big_corners, small_corners),
+                          cv::Size(crop_width, crop_height), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+      warped.convertTo(converted, CV_32F);
+      vector<cv::Mat> bgr;
+      cv::split(converted, bgr);
+
+      for (int c = 0; c < 3; c++) {
+        const float* plane = fused.data() + c * crop_width * crop_height;
+        const cv::Mat& reference = bgr[2 - c];
+        for (int y = 0; y < crop_height; y++) {
+          for (int x = 0; x < crop_width; x++) {
+            float difference = std::fabs(plane[y * crop_width + x] - reference.at<float>(y, x));
+            max_difference = std::max(max_difference, difference);
+            if (difference > 0)
+              differing++;
+          }
+        }
+      }
+      compared += 3 * crop_width * crop_height;
+    }
+  }
+  cout << "Crop kernel check (" << (crop_kernel_uses_avx2() ? "avx2" : "scalar") << ", "
+       << crop_requests.size() * (sizeof(skews) / sizeof(skews[0])) << " crops): max difference " << max_difference
+       << ", " << differing << " of " << compared << " values differ" << endl;
+  return max_difference == 0 ? 0 : 1;
+}
+
+// Time the batch token decoder against the element-by-element reference on synthetic output tensors
+void benchmark_decoding(Ocr& alpr_ocr, int iterations) {
+  const OcrTokenDecoder& decoder = alpr_ocr.get_char_decoder();
+  const int timesteps = alpr_ocr.get_max_timesteps();
+  const int topk = alpr_ocr.get_topk();
+  const int batch_sizes[] = {1, 10, 50, 100};
+  const int num_ids = 40;
+
+  int end_id = -1;
+  for (int id = 0; id < num_ids && end_id < 0; id++) {
+    if (decoder.kind(id) == OCR_TOKEN_END)
+      end_id = id;
+  }
+
+  cout << "Decode benchmark (" << timesteps << " timesteps, top " << topk << ", " << iterations << " iterations, "
+       << (OcrTokenDecoder::uses_avx2() ? "avx2" : "sse2/scalar") << ")" << endl;
+  cout << "crops	scalar_us	batch_us	speedup	match	top1_us" << endl;
+  srand(1);
+  for (int batch : batch_sizes) {
+    // Confident top-1 letters with a long tail, ending somewhere in the second half of the sequence
+    size_t count = static_cast<size_t>(batch) * timesteps * topk;
+    vector<int64_t> ids(count);
+    vector<float> confidences(count);
+    for (int b = 0; b < batch; b++) {
+      int end_t = timesteps / 2 + rand() % (timesteps - timesteps / 2);
+      for (int t = 0; t < timesteps; t++) {
+        float remaining = 1.0f;
+        for (int k = 0; k < topk; k++) {
+          size_t idx = (static_cast<size_t>(b) * timesteps + t) * topk + k;
+          ids[idx] = (k == 0 && t == end_t && end_id >= 0) ? end_id : rand() % num_ids;
+          confidences[idx] = remaining * (k == 0 ? 0.5f + 0.5f * rand() / RAND_MAX : 0.5f * rand() / RAND_MAX);
+          remaining -= confidences[idx];
+        }
+      }
+    }
+
+    OcrDecodedBatch outputs[2];
+    double elapsed_us[2];
+    for (int mode = 0; mode < 2; mode++) {
+      timespec start_time, end_time;
+      alprsupport::getTimeMonotonic(&start_time);
+      for (int i = 0; i < iterations; i++) {
+        if (mode == 0)
+          decoder.decode_scalar(ids.data(), confidences.data(), batch, timesteps, topk, outputs[mode]);
+        else
+          decoder.decode(ids.data(), confidences.data(), batch, timesteps, topk, outputs[mode]);
+      }
+      alprsupport::getTimeMonotonic(&end_time);
+      elapsed_us[mode] = alprsupport::diffclock(start_time, end_time) * 1000.0 / iterations;
+    }
+
+    bool match = outputs[0].num_tokens == outputs[1].num_tokens;
+    for (int b = 0; match && b < batch; b++) {
+      const OcrDecodedSequence& a = outputs[0].sequences[b];
+      const OcrDecodedSequence& c = outputs[1].sequences[b];
+      match = a.first_token == c.first_token && a.num_tokens == c.num_tokens &&
+              a.overall_confidence == c.overall_confidence;
+    }
+    for (size_t i = 0; match && i < outputs[0].num_tokens; i++) {
+      const OcrDecodedToken& a = outputs[0].tokens[i];
+      const OcrDecodedToken& c = outputs[1].tokens[i];
+      match = a.id == c.id && a.timestep == c.timestep && a.confidence == c.confidence;
+    }
+    // Top-1 only (top1_only in ocr_config.json)
+    timespec start_time, end_time;
+    alprsupport::getTimeMonotonic(&start_time);
+    for (int i = 0; i < iterations; i++)
+      decoder.decode_top1(ids.data(), confidences.data(), batch, timesteps, topk, outputs[0]);
+    alprsupport::getTimeMonotonic(&end_time);
+    double top1_us = alprsupport::diffclock(start_time, end_time) * 1000.0 / iterations;
+
+    cout << batch << "\t" << elapsed_us[0] << "\t" << elapsed_us[1] << "\t" << elapsed_us[0] / elapsed_us[1] << "\t"
+         << (match ? "yes" : "NO") << "\t" << top1_us << endl;
+  }
+}
+
+// Best reading of a result: the first (top-1) character kept at each timestep
+string plate_string(const OcrResult& result) {
+  string plate;
+  int last_index = -1;
+  for (const OcrChar& c : result.characters) {
+    if (c.char_index != last_index)
+      plate += c.letter;
+    last_index = c.char_index;
+  }
+  return plate;
+}
+
+// Writes the float network input of every crop to <dir>/calib_NNNNN.raw (float32, in the model's layout) with an
+// index in <dir>/calibration.json.  tools/quantize_ocr.py calibrates the quantized model on these.
+bool export_calibration(Ocr& alpr_ocr, std::vector<cv::Mat>& image_batch, vector<OcrRequestCrop>& crop_requests,
+                        const string& dir) {
+  if (!alprsupport::DirectoryExists(dir.c_str())) {
+    std::cerr << "Calibration directory " << dir << " does not exist" << std::endl;
+    return false;
+  }
+  const std::vector<int64_t> shape = alpr_ocr.get_input_shape(1);
+  const size_t slot_values = shape[1] * shape[2] * shape[3];
+  vector<float> tensor(slot_values * crop_requests.size());
+  alpr_ocr.preprocess_crops(image_batch, crop_requests, tensor.data());
+
+  nlohmann::json index;
+  index["input_name"] = alpr_ocr.get_input_name();
+  index["shape"] = shape;
+  index["files"] = nlohmann::json::array();
+  for (uint32_t i = 0; i < crop_requests.size(); i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "calib_%05u.raw", i);
+    std::ofstream out(dir + "/" + name, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(tensor.data() + i * slot_values), slot_values * sizeof(float));
+    if (!out) {
+      std::cerr << "Failed to write " << dir << "/" << name << std::endl;
+      return false;
+    }
+    index["files"].push_back(name);
+  }
+  std::ofstream index_file(dir + "/calibration.json");
+  index_file << index.dump(2) << std::endl;
+  cout << "Wrote " << crop_requests.size() << " calibration samples to " << dir << endl;
+  return true;
+}
+
+// Runs the same crops through the default model and ocr_x_<variant> and reports how often the plate strings agree
+// and how long a batch takes on each
+int compare_models(Config& config, const string& variant, std::vector<cv::Mat>& image_batch,
+                   vector<OcrRequestCrop>& crop_requests, int iterations) {
+  const string variants[2] = {config.ocr_model_variant, variant};
+  std::map<int, string> plates[2];
+  double elapsed_ms[2];
+  for (int m = 0; m < 2; m++) {
+    config.ocr_model_variant = variants[m];
+    Ocr alpr_ocr(&config);
+    if (!alpr_ocr.initialized()) {
+      std::cerr << "Failed to load OCR model variant '" << variants[m] << "'" << std::endl;
+      return 1;
+    }
+    std::vector<OcrResult> results = alpr_ocr.recognize_batch(image_batch, crop_requests);
+    timespec start_time, end_time;
+    alprsupport::getTimeMonotonic(&start_time);
+    for (int i = 0; i < iterations; i++)
+      results = alpr_ocr.recognize_batch(image_batch, crop_requests);
+    alprsupport::getTimeMonotonic(&end_time);
+    elapsed_ms[m] = alprsupport::diffclock(start_time, end_time) / iterations;
+    for (const OcrResult& result : results)
+      plates[m][result.image_index] = plate_string(result);
+  }
+  config.ocr_model_variant = variants[0];
+
+  int matches = 0;
+  for (uint32_t i = 0; i < crop_requests.size(); i++) {
+    int image_index = crop_requests[i].image_index;
+    const string& reference = plates[0].count(image_index) ? plates[0][image_index] : "";
+    const string& candidate = plates[1].count(image_index) ? plates[1][image_index] : "";
+    if (reference == candidate)
+      matches++;
+    else
+      cout << "  mismatch image " << image_index << ": '" << reference << "' vs '" << candidate << "'" << endl;
+  }
+  string reference_name = variants[0].empty() ? "default" : variants[0];
+  cout << "Model comparison (" << crop_requests.size() << " crops, " << iterations << " iterations)" << endl;
+  cout << "model	batch_ms	crops_per_sec" << endl;
+  for (int m = 0; m < 2; m++) {
+    cout << (m == 0 ? reference_name : variants[m]) << "	" << elapsed_ms[m] << "	"
+         << crop_requests.size() * 1000.0 / elapsed_ms[m] << endl;
+  }
+  cout << "plate agreement: " << matches << "/" << crop_requests.size() << " ("
+       << 100.0 * matches / std::max<size_t>(1, crop_requests.size()) << "%), speedup "
+       << elapsed_ms[0] / elapsed_ms[1] << "x" << endl;
+  return 0;
+}
+
 int main(int argc, char **argv) {
   std::vector<string> filenames;
   std::string country;
   bool tracing_enabled = false;
   int iterations = 1;
   int duplicates = 1;
+  int preprocess_threads = 1;
+  bool preprocess_benchmark = false;
+  bool decode_benchmark = false;
+  bool crop_check = false;
+  std::string batch_buckets;
+  int intra_op_threads = 1;
+  bool pipeline = false;
+  std::string model_variant;
+  std::string compare_variant;
+  std::string calibration_dir;
+  int cache_size = 0;
+  int beam_width = 0;
 
   TCLAP::CmdLine cmd("AlprOCR Command Line Utility", ' ', "1.0.0");
   TCLAP::UnlabeledMultiArg<string>  fileArg("image_file", "Image containing license plates", true, "", "image_file_path");
@@ -32,12 +314,36 @@ int main(int argc, char **argv) {
   TCLAP::ValueArg<int> iterationsArg("i","iterations","Number of iterations to run for the batches. Default=1",false, 1 ,"iterations");
   TCLAP::ValueArg<string> countryArg("c","country","country to use for OCR. Default=us",false, "us" ,"country");
   TCLAP::ValueArg<int> duplicatesArg("d","duplicates","Number of times to repeat image. Default=1",false, 1 ,"duplicates");
+  TCLAP::ValueArg<int> threadsArg("t","threads","Threads used to preprocess crops (0 = all cores). Default=1",false, 1 ,"threads");
+  TCLAP::SwitchArg preprocessBenchmarkArg("","preprocess_benchmark","Compare serial and threaded crop preprocessing across batch sizes", false);
+  TCLAP::ValueArg<std::string> bucketsArg("","batch_buckets","Batch sizes to pad to: exact, clamp, pow2 or a list such as 1,4,16", false, "", "policy");
+  TCLAP::ValueArg<int> intraThreadsArg("","intra_op_threads","ONNX runtime intra-op threads for the OCR session (0 = one per core)", false, 1, "threads");
+  TCLAP::SwitchArg pipelineArg("","pipeline","Overlap preprocessing, inference and decoding of sub-batches", false);
+  TCLAP::ValueArg<std::string> variantArg("","model_variant","Load ocr_x_<variant> (e.g. int8) instead of ocr_x", false, "", "variant");
+  TCLAP::ValueArg<std::string> compareArg("","compare_variant","Compare plate strings and speed of the model against ocr_x_<variant>", false, "", "variant");
+  TCLAP::ValueArg<std::string> calibrationArg("","export_calibration","Write the preprocessed input of every crop to this directory for quantization", false, "", "dir");
+  TCLAP::ValueArg<int> cacheArg("","cache_size","Entries in the crop result cache; repeated iterations then hit it (0 = off)", false, 0, "entries");
+  TCLAP::ValueArg<int> beamArg("","beam_width","Beam search the top-k characters under the country's templates and print the best plates (0 = off)", false, 0, "width");
+  TCLAP::SwitchArg decodeBenchmarkArg("","decode_benchmark","Compare the batch token decoder with the element-by-element loop", false);
+  TCLAP::SwitchArg cropCheckArg("","crop_check","Compare the crop kernel with warpPerspective + convertTo + split and print the largest difference", false);
 
   try {
     cmd.add(fileArg);
     cmd.add(countryArg);
     cmd.add(iterationsArg);
     cmd.add(duplicatesArg);
+    cmd.add(threadsArg);
+    cmd.add(preprocessBenchmarkArg);
+    cmd.add(decodeBenchmarkArg);
+    cmd.add(cropCheckArg);
+    cmd.add(bucketsArg);
+    cmd.add(intraThreadsArg);
+    cmd.add(pipelineArg);
+    cmd.add(variantArg);
+    cmd.add(compareArg);
+    cmd.add(calibrationArg);
+    cmd.add(cacheArg);
+    cmd.add(beamArg);
 
     if (cmd.parse(argc, argv) == false) {
       // Error occurred while parsing. Exit now.
@@ -48,6 +354,18 @@ int main(int argc, char **argv) {
     country = countryArg.getValue();
     iterations = iterationsArg.getValue();
     duplicates = duplicatesArg.getValue();
+    preprocess_threads = threadsArg.getValue();
+    preprocess_benchmark = preprocessBenchmarkArg.getValue();
+    decode_benchmark = decodeBenchmarkArg.getValue();
+    crop_check = cropCheckArg.getValue();
+    batch_buckets = bucketsArg.getValue();
+    intra_op_threads = intraThreadsArg.getValue();
+    pipeline = pipelineArg.getValue();
+    model_variant = variantArg.getValue();
+    compare_variant = compareArg.getValue();
+    calibration_dir = calibrationArg.getValue();
+    cache_size = cacheArg.getValue();
+    beam_width = beamArg.getValue();
 
     if (duplicates > 1) {
       if (filenames.size() != 1) {
@@ -68,6 +386,13 @@ int main(int argc, char **argv) {
   AlprLog::instance()->setLogLevel(ALPRINFO);
 
   Config config(country, "", "");
+  config.ocr_preprocess_threads = preprocess_threads;
+  config.ocr_batch_buckets = batch_buckets;
+  config.ocr_intra_op_threads = intra_op_threads;
+  config.ocr_pipeline = pipeline;
+  config.ocr_model_variant = model_variant;
+  config.ocr_cache_size = cache_size;
+  config.ocr_beam_width = beam_width;
 
 
   Ocr alpr_ocr(&config);
@@ -77,6 +402,11 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (decode_benchmark) {
+    benchmark_decoding(alpr_ocr, std::max(iterations, 100));
+    return 0;
+  }
+
   std::vector<cv::Mat> image_batch;
   vector<OcrRequestCrop> crop_requests;
 
@@ -99,6 +429,19 @@ int main(int argc, char **argv) {
     crop_requests.push_back(crop_request);
   }
 
+  if (!compare_variant.empty())
+    return compare_models(config, compare_variant, image_batch, crop_requests, iterations);
+
+  if (!calibration_dir.empty())
+    return export_calibration(alpr_ocr, image_batch, crop_requests, calibration_dir) ? 0 : 1;
+
+  if (crop_check)
+    return check_crop_kernel(alpr_ocr, image_batch, crop_requests);
+
+  if (preprocess_benchmark) {
+    benchmark_preprocessing(alpr_ocr, image_batch, crop_requests, preprocess_threads, iterations);
+    return 0;
+  }
 
   for (int i = 0; i < iterations; i++) {
     const clock_t begin_time = clock();
@@ -112,9 +455,19 @@ int main(int argc, char **argv) {
         cout << " : " << alprchars.characters[z].char_index << " - " << alprchars.characters[z].letter
              << " - " << alprchars.characters[z].confidence << endl;
       }
+      for (const OcrPlateCandidate& candidate : alprchars.candidates) {
+        cout << "  Candidate: " << candidate.plate << " : " << candidate.confidence
+             << (candidate.matches_template ? " (template)" : "") << endl;
+      }
     }
   }
 
+  if (cache_size > 0) {
+    OcrCacheStats stats = alpr_ocr.get_cache_stats();
+    cout << "Result cache: " << stats.hits << " hits, " << stats.misses << " misses (" << 100 * stats.hit_rate()
+         << "%), " << stats.evictions << " evicted, " << stats.expirations << " expired, " << stats.entries
+         << " entries" << endl;
+  }
 
   return 0;
 }
@@ -0,0 +1,492 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+#include "patternmatcher.h"
+#include "runtimebundle.h"
+#include <alprsupport/utf8/checked.h>
+#include <alprsupport/utf8/unchecked.h>
+#include <alprlog.h>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string.h>
+#include <sstream>
+
+namespace alpr {
+
+namespace {
+bool decodeUtf8(const std::string& text, std::vector<uint32_t>& code_points) {
+  code_points.clear();
+  if (utf8::find_invalid(text.begin(), text.end()) != text.end())
+    return false;
+  std::string::const_iterator it = text.begin();
+  while (it != text.end())
+    code_points.push_back(utf8::unchecked::next(it));
+  return true;
+}
+
+bool isNumber(uint32_t cp) {
+  return (cp >= '0' && cp <= '9') ||
+         (cp >= 0x0660 && cp <= 0x0669) ||  // Arabic-Indic
+         (cp >= 0x06F0 && cp <= 0x06F9) ||  // Extended Arabic-Indic (Persian)
+         (cp >= 0x0966 && cp <= 0x096F) ||  // Devanagari
+         (cp >= 0xFF10 && cp <= 0xFF19);    // Fullwidth
+}
+
+bool isLetter(uint32_t cp) {
+  if (cp < 0x80)
+    return (cp >= 'A' && cp <= 'Z') || (cp >= 'a' && cp <= 'z');
+  // Latin-1 punctuation and symbols, and the multiplication / division signs
+  if (cp < 0xC0 || cp == 0xD7 || cp == 0xF7)
+    return false;
+  return !isNumber(cp);
+}
+}  // namespace
+
+bool PatternMatcher::CharClass::accepts(uint32_t cp) const {
+  bool in = any || (letters && isLetter(cp)) || (numbers && isNumber(cp));
+  for (size_t i = 0; !in && i < ranges.size(); i++)
+    in = cp >= ranges[i].first && cp <= ranges[i].second;
+  return in != negated;
+}
+
+PatternMatcher::PatternMatcher() : other_class(0), num_classes(0) {}
+
+bool PatternMatcher::parseClass(const std::string& text, CharClass& out) {
+  out = CharClass();
+  std::vector<uint32_t> cps;
+  if (!decodeUtf8(text, cps) || cps.empty())
+    return false;
+
+  size_t i = 0;
+  size_t end = cps.size();
+  bool bracket = cps[0] == '[';
+  if (bracket) {
+    if (cps.size() < 2 || cps.back() != ']')
+      return false;
+    i = 1;
+    end = cps.size() - 1;
+    if (i < end && cps[i] == '^') {
+      out.negated = true;
+      i++;
+    }
+  } else if (cps.size() == 1 && cps[0] == '.') {
+    out.any = true;
+    return true;
+  }
+
+  while (i < end) {
+    uint32_t cp = cps[i++];
+    if (cp == '\\' && i < end) {
+      uint32_t escaped = cps[i++];
+      if ((escaped == 'p' || escaped == 'P') && i < end && (cps[i] == 'L' || cps[i] == 'N')) {
+        // \pL / \pN; \PL and \PN are only supported on their own
+        if (escaped == 'P' && (bracket || i + 1 != end))
+          return false;
+        (cps[i] == 'L' ? out.letters : out.numbers) = true;
+        out.negated = out.negated != (escaped == 'P');
+        i++;
+      } else if (escaped == 'd') {
+        out.ranges.push_back(std::make_pair('0', '9'));
+      } else if (escaped < 0x80 && (isLetter(escaped) || isNumber(escaped))) {
+        // \w, \s, \D, \b... mean something else to re2, so they can't be read as the character itself
+        return false;
+      } else {
+        out.ranges.push_back(std::make_pair(escaped, escaped));
+      }
+    } else if (bracket && i + 1 < end && cps[i] == '-') {
+      out.ranges.push_back(std::make_pair(cp, cps[i + 1]));
+      i += 2;
+    } else if (bracket || end == 1) {
+      out.ranges.push_back(std::make_pair(cp, cp));
+    } else {
+      // Anything fancier than a class or a single character needs a real regex engine
+      return false;
+    }
+  }
+  return true;
+}
+
+bool PatternMatcher::parsePattern(const std::string& pattern, const CharClass& letters, const CharClass& numbers,
+                                  std::vector<CharClass>& positions) {
+  positions.clear();
+  std::vector<uint32_t> cps;
+  if (!decodeUtf8(pattern, cps))
+    return false;
+  for (size_t i = 0; i < cps.size(); i++) {
+    CharClass position;
+    uint32_t cp = cps[i];
+    if (cp == '[') {
+      // Up to the closing bracket, which is parsed as a class of its own
+      size_t close = i + 1;
+      while (close < cps.size() && cps[close] != ']')
+        close++;
+      if (close == cps.size())
+        return false;
+      std::string text;
+      for (size_t j = i; j <= close; j++)
+        utf8::unchecked::append(cps[j], std::back_inserter(text));
+      if (!parseClass(text, position))
+        return false;
+      i = close;
+    } else if (cp == '\\') {
+      // \d, \pL, \. and so on mean the same here as in a class (and in the RegexRule regex)
+      if (i + 1 == cps.size())
+        return false;
+      size_t end = i + 2;
+      if ((cps[i + 1] == 'p' || cps[i + 1] == 'P') && end < cps.size())
+        end++;
+      std::string text;
+      for (size_t j = i; j < end; j++)
+        utf8::unchecked::append(cps[j], std::back_inserter(text));
+      if (!parseClass(text, position))
+        return false;
+      i = end - 1;
+    } else if (cp == '?') {
+      position.any = true;
+    } else if (cp == '@') {
+      position = letters;
+    } else if (cp == '#') {
+      position = numbers;
+    } else if (cp == '*' || cp == '+') {
+      return false;
+    } else {
+      position.ranges.push_back(std::make_pair(cp, cp));
+    }
+    positions.push_back(position);
+  }
+  return !positions.empty();
+}
+
+bool PatternMatcher::load(const std::string& patterns_path, const std::vector<std::string>& tokens,
+                          const std::string& letters_regex, const std::string& numbers_regex) {
+  std::vector<std::string> lines;
+  std::ifstream infile(patterns_path.c_str());
+  std::string region, pattern;
+  while (infile >> region >> pattern)
+    lines.push_back(region + " " + pattern);
+  return compile(lines, tokens, letters_regex, numbers_regex);
+}
+
+bool PatternMatcher::compile(const std::vector<std::string>& lines, const std::vector<std::string>& tokens,
+                             const std::string& letters_regex, const std::string& numbers_regex) {
+  regions.clear();
+  region_indices.clear();
+  masks.clear();
+  length_masks.clear();
+  symbol_classes.clear();
+  patterns.clear();
+
+  CharClass letters, numbers;
+  if (!parseClass(letters_regex, letters)) {
+    ALPR_WARN << "Unsupported postprocess_regex_letters " << letters_regex << ", using \\pL";
+    parseClass("\\pL", letters);
+  }
+  if (!parseClass(numbers_regex, numbers)) {
+    ALPR_WARN << "Unsupported postprocess_regex_numbers " << numbers_regex << ", using \\pN";
+    parseClass("\\pN", numbers);
+  }
+
+  // Templates grouped by region, in file order
+  std::vector<std::string> region_names;
+  std::vector<std::vector<std::vector<CharClass>>> region_patterns;
+  std::string region, pattern;
+  std::vector<CharClass> positions;
+  for (size_t line = 0; line < lines.size(); line++) {
+    std::istringstream fields(lines[line]);
+    if (!(fields >> region >> pattern))
+      continue;
+    if (!parsePattern(pattern, letters, numbers, positions)) {
+      ALPR_WARN << "Unsupported plate pattern " << region << " " << pattern;
+      continue;
+    }
+    auto found = region_indices.find(region);
+    if (found == region_indices.end()) {
+      found = region_indices.insert(std::make_pair(region, static_cast<int>(region_names.size()))).first;
+      region_names.push_back(region);
+      region_patterns.resize(region_names.size());
+    }
+    if (region_patterns[found->second].size() >= 64 * MAX_WORDS) {
+      ALPR_WARN << "More than " << 64 * MAX_WORDS << " patterns for region " << region << ", ignoring " << pattern;
+      continue;
+    }
+    region_patterns[found->second].push_back(positions);
+    patterns.push_back(region + " " + pattern);
+  }
+
+  // Symbols are the tokens plus one for any other letter.  Tokens that every position of every template treats
+  // the same share a class.
+  size_t num_symbols = tokens.size() + 1;
+  std::vector<uint32_t> token_classes(num_symbols);
+  std::vector<uint32_t> class_representatives;
+  std::map<std::vector<bool>, uint32_t> signatures;
+  std::vector<uint32_t> cps;
+  for (size_t s = 0; s < num_symbols; s++) {
+    // Multi-character tokens (and the `other' symbol) only match ?
+    bool single = s < tokens.size() && decodeUtf8(tokens[s], cps) && cps.size() == 1;
+    std::vector<bool> signature;
+    for (size_t r = 0; r < region_patterns.size(); r++) {
+      for (size_t p = 0; p < region_patterns[r].size(); p++) {
+        for (size_t c = 0; c < region_patterns[r][p].size(); c++) {
+          const CharClass& position = region_patterns[r][p][c];
+          signature.push_back(position.any || (single && position.accepts(cps[0])));
+        }
+      }
+    }
+    auto found = signatures.find(signature);
+    if (found == signatures.end()) {
+      found = signatures.insert(std::make_pair(signature, static_cast<uint32_t>(class_representatives.size()))).first;
+      class_representatives.push_back(s);
+    }
+    token_classes[s] = found->second;
+  }
+  for (size_t s = 0; s < tokens.size(); s++)
+    symbol_classes.insert(std::make_pair(tokens[s], token_classes[s]));
+  other_class = token_classes[tokens.size()];
+  num_classes = class_representatives.size();
+
+  for (size_t r = 0; r < region_patterns.size(); r++) {
+    const std::vector<std::vector<CharClass>>& templates = region_patterns[r];
+    Region compiled;
+    compiled.num_patterns = templates.size();
+    compiled.num_words = (compiled.num_patterns + 63) / 64;
+    compiled.max_length = 0;
+    for (size_t p = 0; p < templates.size(); p++)
+      compiled.max_length = std::max<int>(compiled.max_length, templates[p].size());
+    compiled.first_mask = masks.size();
+    compiled.first_length_mask = length_masks.size();
+    masks.resize(masks.size() + num_classes * compiled.max_length * compiled.num_words, 0);
+    length_masks.resize(length_masks.size() + (compiled.max_length + 1) * compiled.num_words, 0);
+
+    for (size_t p = 0; p < templates.size(); p++) {
+      uint64_t bit = 1ull << (p % 64);
+      size_t word = p / 64;
+      length_masks[compiled.first_length_mask + templates[p].size() * compiled.num_words + word] |= bit;
+      for (size_t k = 0; k < num_classes; k++) {
+        uint32_t s = class_representatives[k];
+        bool single = s < tokens.size() && decodeUtf8(tokens[s], cps) && cps.size() == 1;
+        for (size_t c = 0; c < templates[p].size(); c++) {
+          const CharClass& position = templates[p][c];
+          if (position.any || (single && position.accepts(cps[0])))
+            masks[compiled.first_mask + (k * compiled.max_length + c) * compiled.num_words + word] |= bit;
+        }
+      }
+    }
+    regions.push_back(compiled);
+  }
+  region_names_by_index = region_names;
+  this->letters_regex = letters_regex;
+  this->numbers_regex = numbers_regex;
+  token_classes_by_id.assign(token_classes.begin(), token_classes.begin() + tokens.size());
+  return true;
+}
+
+namespace {
+// Layout of PatternMatcher::save, all in native byte order:
+//   CompiledHeader, CompiledRegion[num_regions], uint64 masks[num_masks], uint64 length_masks[num_length_masks],
+//   uint32 token_classes[num_tokens], then a string table of letters_regex, numbers_regex, the region names and
+//   the "region pattern" lines
+struct CompiledHeader {
+  uint32_t num_regions;
+  uint32_t num_tokens;
+  uint32_t other_class;
+  uint32_t num_classes;
+  uint64_t num_masks;
+  uint64_t num_length_masks;
+};
+
+struct CompiledRegion {
+  int32_t num_patterns;
+  int32_t num_words;
+  int32_t max_length;
+  int32_t reserved;
+  uint64_t first_mask;
+  uint64_t first_length_mask;
+};
+
+template <typename T>
+void appendArray(const T* values, size_t count, std::vector<char>& out) {
+  const char* bytes = reinterpret_cast<const char*>(values);
+  out.insert(out.end(), bytes, bytes + count * sizeof(T));
+}
+
+template <typename T>
+bool readArray(const char*& data, const char* end, size_t count, std::vector<T>& out) {
+  if (static_cast<size_t>(end - data) / sizeof(T) < count)
+    return false;
+  out.resize(count);
+  if (count > 0)
+    memcpy(&out[0], data, count * sizeof(T));
+  data += count * sizeof(T);
+  return true;
+}
+}  // namespace
+
+void PatternMatcher::save(std::vector<char>& out) const {
+  CompiledHeader header;
+  memset(&header, 0, sizeof(header));
+  header.num_regions = regions.size();
+  header.num_tokens = token_classes_by_id.size();
+  header.other_class = other_class;
+  header.num_classes = num_classes;
+  header.num_masks = masks.size();
+  header.num_length_masks = length_masks.size();
+  appendArray(&header, 1, out);
+  for (size_t r = 0; r < regions.size(); r++) {
+    CompiledRegion region;
+    memset(&region, 0, sizeof(region));
+    region.num_patterns = regions[r].num_patterns;
+    region.num_words = regions[r].num_words;
+    region.max_length = regions[r].max_length;
+    region.first_mask = regions[r].first_mask;
+    region.first_length_mask = regions[r].first_length_mask;
+    appendArray(&region, 1, out);
+  }
+  appendArray(masks.data(), masks.size(), out);
+  appendArray(length_masks.data(), length_masks.size(), out);
+  appendArray(token_classes_by_id.data(), token_classes_by_id.size(), out);
+  std::vector<std::string> strings;
+  strings.push_back(letters_regex);
+  strings.push_back(numbers_regex);
+  strings.insert(strings.end(), region_names_by_index.begin(), region_names_by_index.end());
+  strings.insert(strings.end(), patterns.begin(), patterns.end());
+  appendStringTable(strings, out);
+}
+
+bool PatternMatcher::loadCompiled(const void* data, size_t size, const std::vector<std::string>& tokens,
+                                  const std::string& letters_regex, const std::string& numbers_regex) {
+  const char* read = static_cast<const char*>(data);
+  const char* end = read + size;
+  std::vector<CompiledHeader> header;
+  std::vector<CompiledRegion> compiled_regions;
+  std::vector<uint64_t> compiled_masks, compiled_length_masks;
+  std::vector<uint32_t> classes;
+  std::vector<std::string> strings;
+  if (!readArray(read, end, 1, header) || !readArray(read, end, header[0].num_regions, compiled_regions) ||
+      !readArray(read, end, header[0].num_masks, compiled_masks) ||
+      !readArray(read, end, header[0].num_length_masks, compiled_length_masks) ||
+      !readArray(read, end, header[0].num_tokens, classes) ||
+      !readStringTable(read, end - read, strings, NULL) || strings.size() < 2 + compiled_regions.size()) {
+    ALPR_ERROR << "Corrupt compiled plate patterns";
+    return false;
+  }
+  // The classes were worked out for one token table and one pair of letter / number classes
+  if (classes.size() != tokens.size() || strings[0] != letters_regex || strings[1] != numbers_regex)
+    return false;
+  // Every table lookup stays inside the arrays
+  const size_t loaded_classes = header[0].num_classes;
+  bool valid = header[0].other_class < loaded_classes;
+  for (size_t s = 0; valid && s < classes.size(); s++)
+    valid = classes[s] < loaded_classes;
+  for (size_t r = 0; valid && r < compiled_regions.size(); r++) {
+    const CompiledRegion& region = compiled_regions[r];
+    valid = region.num_patterns >= 0 && region.num_patterns <= 64 * MAX_WORDS &&
+            region.num_words == (region.num_patterns + 63) / 64 && region.max_length >= 0 &&
+            region.first_mask + loaded_classes * region.max_length * region.num_words <= compiled_masks.size() &&
+            region.first_length_mask + (region.max_length + 1) * static_cast<size_t>(region.num_words) <=
+                compiled_length_masks.size();
+  }
+  if (!valid) {
+    ALPR_ERROR << "Corrupt compiled plate patterns";
+    return false;
+  }
+
+  regions.clear();
+  region_indices.clear();
+  symbol_classes.clear();
+  for (size_t r = 0; r < compiled_regions.size(); r++) {
+    Region region;
+    region.num_patterns = compiled_regions[r].num_patterns;
+    region.num_words = compiled_regions[r].num_words;
+    region.max_length = compiled_regions[r].max_length;
+    region.first_mask = compiled_regions[r].first_mask;
+    region.first_length_mask = compiled_regions[r].first_length_mask;
+    regions.push_back(region);
+    region_indices.insert(std::make_pair(strings[2 + r], static_cast<int>(r)));
+  }
+  masks.swap(compiled_masks);
+  length_masks.swap(compiled_length_masks);
+  for (size_t s = 0; s < tokens.size(); s++)
+    symbol_classes.insert(std::make_pair(tokens[s], classes[s]));
+  other_class = header[0].other_class;
+  num_classes = header[0].num_classes;
+  token_classes_by_id.swap(classes);
+  region_names_by_index.assign(strings.begin() + 2, strings.begin() + 2 + compiled_regions.size());
+  patterns.assign(strings.begin() + 2 + compiled_regions.size(), strings.end());
+  this->letters_regex = letters_regex;
+  this->numbers_regex = numbers_regex;
+  return true;
+}
+
+int PatternMatcher::regionIndex(const std::string& region) const {
+  auto found = region_indices.find(region);
+  return found == region_indices.end() ? -1 : found->second;
+}
+
+uint32_t PatternMatcher::symbolClass(const std::string& letter) const {
+  auto found = symbol_classes.find(letter);
+  return found == symbol_classes.end() ? other_class : found->second;
+}
+
+void PatternMatcher::start(int region, State& state) const {
+  const Region& r = regions[region];
+  for (int w = 0; w < MAX_WORDS; w++) {
+    int bits = std::min(64, std::max(0, r.num_patterns - 64 * w));
+    state.bits[w] = bits == 64 ? ~0ull : (1ull << bits) - 1;
+  }
+  state.length = 0;
+}
+
+bool PatternMatcher::advance(int region, State& state, uint32_t symbol_class) const {
+  const Region& r = regions[region];
+  if (state.length >= r.max_length) {
+    for (int w = 0; w < r.num_words; w++)
+      state.bits[w] = 0;
+    return false;
+  }
+  const uint64_t* m = mask(region, symbol_class, state.length++);
+  uint64_t alive = 0;
+  for (int w = 0; w < r.num_words; w++) {
+    state.bits[w] &= m[w];
+    alive |= state.bits[w];
+  }
+  return alive != 0;
+}
+
+bool PatternMatcher::accepts(int region, const State& state) const {
+  const Region& r = regions[region];
+  if (state.length > r.max_length)
+    return false;
+  const uint64_t* lengths = &length_masks[r.first_length_mask + state.length * r.num_words];
+  for (int w = 0; w < r.num_words; w++) {
+    if (state.bits[w] & lengths[w])
+      return true;
+  }
+  return false;
+}
+
+bool PatternMatcher::match(int region, const uint32_t* classes, size_t count) const {
+  State state;
+  start(region, state);
+  for (size_t i = 0; i < count; i++) {
+    if (!advance(region, state, classes[i]))
+      return false;
+  }
+  return accepts(region, state);
+}
+
+}  // namespace alpr
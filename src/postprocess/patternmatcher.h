@@ -0,0 +1,130 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+#ifndef OPENALPR_POSTPROCESS_PATTERNMATCHER_H_
+#define OPENALPR_POSTPROCESS_PATTERNMATCHER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace alpr {
+
+/*
+  All the plate templates of a country's .patterns file, compiled once so a plate is checked against every
+  template of its region in one pass.
+
+  Templates use the RegexRule syntax: a literal character, ? (any character), @ (postprocess_regex_letters),
+  # (postprocess_regex_numbers), a [...] class or a \-escaped literal.  None of them repeats (* and + are rejected),
+  so a template is a fixed-length row of character classes.  Each region keeps, per position and per symbol, a
+  bitmask of the templates that accept that symbol there; matching ANDs one mask per character, and a prefix whose
+  mask is empty can't be completed into any template.
+
+  Symbols are the OCR character tokens, grouped into classes of tokens that every template treats the same (all
+  digits, all letters but I and O, ...), so the tables stay small even for large token sets.  Letter and number
+  classes (\pL, \pN) are worked out without ICU: ASCII, plus the common non-Latin digit blocks as numbers and
+  every other non-ASCII code point as a letter.
+*/
+class PatternMatcher {
+ public:
+  // Up to 64 * MAX_WORDS templates per region
+  static const int MAX_WORDS = 4;
+  struct State {
+    uint64_t bits[MAX_WORDS];
+    int length;
+  };
+
+  PatternMatcher();
+
+  // Reads "region pattern" lines.  `tokens' is the OCR's character table; any other letter only matches ?.
+  bool load(const std::string& patterns_path, const std::vector<std::string>& tokens,
+            const std::string& letters_regex, const std::string& numbers_regex);
+  // Same from the lines of a .patterns file
+  bool compile(const std::vector<std::string>& lines, const std::vector<std::string>& tokens,
+               const std::string& letters_regex, const std::string& numbers_regex);
+  // The compiled tables, to be loaded back with loadCompiled instead of compiling the patterns again
+  void save(std::vector<char>& out) const;
+  // False if the tables are corrupt or were compiled for other tokens or letter / number classes
+  bool loadCompiled(const void* data, size_t size, const std::vector<std::string>& tokens,
+                    const std::string& letters_regex, const std::string& numbers_regex);
+  bool empty() const { return regions.empty(); }
+
+  // -1 when the region has no templates
+  int regionIndex(const std::string& region) const;
+  // Class of a letter, resolved once when it is added to a plate
+  uint32_t symbolClass(const std::string& letter) const;
+  // Class of letters outside the token table
+  uint32_t otherClass() const { return other_class; }
+
+  void start(int region, State& state) const;
+  // Appends one character.  False once no template of the region can match any more.
+  bool advance(int region, State& state, uint32_t symbol_class) const;
+  // True when the characters so far match a whole template
+  bool accepts(int region, const State& state) const;
+  bool match(int region, const uint32_t* classes, size_t count) const;
+
+  // "region pattern" of every template that compiled
+  const std::vector<std::string>& getPatterns() const { return patterns; }
+
+ private:
+  struct CharClass {
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    bool any;
+    bool letters;
+    bool numbers;
+    bool negated;
+    CharClass() : any(false), letters(false), numbers(false), negated(false) {}
+    bool accepts(uint32_t cp) const;
+  };
+  struct Region {
+    int num_patterns;
+    int num_words;
+    int max_length;
+    // Offsets of this region's tables in masks and length_masks
+    size_t first_mask;
+    size_t first_length_mask;
+  };
+
+  static bool parseClass(const std::string& text, CharClass& out);
+  static bool parsePattern(const std::string& pattern, const CharClass& letters, const CharClass& numbers,
+                           std::vector<CharClass>& positions);
+  const uint64_t* mask(int region, uint32_t symbol_class, int position) const {
+    const Region& r = regions[region];
+    return &masks[r.first_mask + (static_cast<size_t>(symbol_class) * r.max_length + position) * r.num_words];
+  }
+
+  std::vector<Region> regions;
+  std::unordered_map<std::string, int> region_indices;
+  // [class][position][word] per region
+  std::vector<uint64_t> masks;
+  // [length 0..max_length][word] per region: templates of exactly that length
+  std::vector<uint64_t> length_masks;
+  // Token text -> symbol class.  Letters outside the token table get other_class.
+  std::unordered_map<std::string, uint32_t> symbol_classes;
+  uint32_t other_class;
+  uint32_t num_classes;
+  std::vector<std::string> patterns;
+  // What save() writes besides the tables
+  std::vector<std::string> region_names_by_index;
+  std::vector<uint32_t> token_classes_by_id;
+  std::string letters_regex;
+  std::string numbers_regex;
+};
+
+}  // namespace alpr
+#endif  // OPENALPR_POSTPROCESS_PATTERNMATCHER_H_
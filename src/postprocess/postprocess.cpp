@@ -20,40 +20,45 @@
 #include "postprocess.h"
 #include <alprsupport/filesystem.h>
 #include <alprlog.h>
-#include <alprsupport/json.hpp>
+#include <algorithm>
+#include <string.h>
 
 using namespace std;
 
 namespace alpr {
 
+namespace {
+// Letter indices are stored as bytes; positions never hold anywhere near this many candidates
+const size_t MAX_LETTERS_PER_POSITION = 255;
+
+// FNV-1a over a permutation's letter indices
+uint32_t hashIndices(const uint8_t* indices, size_t count) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < count; i++)
+    hash = (hash ^ indices[i]) * 16777619u;
+  return hash;
+}
+}  // namespace
+
 PostProcess::PostProcess(Config* config) {
   this->config = config;
   this->min_confidence = 0;
-  stringstream filename;
-  filename << config->getPostProcessRuntimeDir() << "/" << config->getCountry() << ".patterns";
-
-  std::ifstream infile(filename.str().c_str());
-  string region, pattern;
-  while (infile >> region >> pattern) {
-
-    // Check to see if Right-to-left language is enabled.  If so, we need to reverse the output for characters/numbers
-    std::string ocr_config_path = config->getOCRPrefix() + config->ocrLanguage + "/ocr_config.json";
-
-    if (!alprsupport::fileExists(ocr_config_path.c_str())) {
-      ALPR_ERROR << "Unable to find OCR configuration: " << ocr_config_path;
-      return;
-    }
+  this->num_possibilities = 0;
+  this->num_visited = 0;
+  this->visited_epoch = 0;
+  this->template_index = -1;
+  this->runtime_generation = 0;
+  this->pattern_matcher = NULL;
+  acquireRuntimeData();
+}
 
-    // Read runtime constants from JSON
-    // Check if right_to_left is enabled to perform the conversion on output
-    std::ifstream ifs(ocr_config_path);
-    nlohmann::json ocr_config = nlohmann::json::parse(ifs);
-    if (ocr_config.find("right_to_left") != ocr_config.end()) {
-      translate_to_right_to_left = ocr_config["right_to_left"];
-    } else {
-      translate_to_right_to_left = false;
-    }
-  }
+void PostProcess::acquireRuntimeData() {
+  // Read before acquiring, so a reload that lands in between is picked up on the next plate
+  runtime_generation = RuntimeData::generation();
+  runtime_data = RuntimeData::acquire(config->getOCRLanguageDir(), config->getPostProcessRuntimeDir(),
+                                      config->getCountry(), config->postProcessRegexLetters,
+                                      config->postProcessRegexNumbers);
+  pattern_matcher = &runtime_data->patternMatcher();
 }
 
 PostProcess::~PostProcess() {
@@ -100,6 +105,7 @@ void PostProcess::insertLetter(string letter, int line_index, int char_position,
     newLetter.line_index = line_index;
     newLetter.char_position = char_position;
     newLetter.letter = letter;
+    newLetter.symbol_class = pattern_matcher->symbolClass(letter);
     newLetter.occurrences = 1;
     newLetter.total_score = score;
     letters[char_position].push_back(newLetter);
@@ -110,21 +116,24 @@ void PostProcess::insertLetter(string letter, int line_index, int char_position,
 }
 
 void PostProcess::clear() {
+  // Between plates is the one point where no letter refers to the old templates
+  if (RuntimeData::generation() != runtime_generation)
+    acquireRuntimeData();
   for (int i = 0; i < letters.size(); i++) {
     letters[i].clear();
   }
   letters.resize(0);
   unknown_char_positions.clear();
   unknown_char_positions.resize(0);
-  all_possibilities.clear();
-  all_possibilities_letters.clear();
-  best_chars = "";
+  num_possibilities = 0;
+  best_chars.clear();
   matches_template = false;
 }
 
-void PostProcess::analyze(string templateregion, int topn) {
+void PostProcess::analyze(const string& templateregion, int topn) {
   timespec startTime;
   alprsupport::getTimeMonotonic(&startTime);
+  template_index = templateregion.empty() ? -1 : pattern_matcher->regionIndex(templateregion);
 
   // Get a list of missing positions
   for (int i = letters.size() -1; i >= 0; i--) {
@@ -136,10 +145,13 @@ void PostProcess::analyze(string templateregion, int topn) {
   if (letters.size() == 0)
     return;
 
-  // Sort the letters as they are
+  // Sort the letters as they are, best score first.  A position only holds a handful of letters, so an insertion
+  // sort (stable, and unlike stable_sort it doesn't allocate a merge buffer) is all it takes.
   for (int i = 0; i < letters.size(); i++) {
-    if (letters[i].size() > 0)
-      std::stable_sort(letters[i].begin(), letters[i].end(), letterCompare);
+    for (size_t j = 1; j < letters[i].size(); j++) {
+      for (size_t k = j; k > 0 && letters[i][k - 1].total_score < letters[i][k].total_score; k--)
+        std::swap(letters[i][k - 1], letters[i][k]);
+    }
   }
 
   if (this->config->debugPostProcess) {
@@ -162,9 +174,9 @@ void PostProcess::analyze(string templateregion, int topn) {
          << "ms." << endl;
   }
 
-  if (all_possibilities.size() > 0) {
+  if (num_possibilities > 0) {
     best_chars = all_possibilities[0].letters;
-    for (int z = 0; z < all_possibilities.size(); z++) {
+    for (int z = 0; z < num_possibilities; z++) {
       if (all_possibilities[z].matches_template) {
         best_chars = all_possibilities[z].letters;
         break;
@@ -174,14 +186,14 @@ void PostProcess::analyze(string templateregion, int topn) {
     // Now adjust the confidence scores to a percentage value
     float maxPercentScore = calculateMaxConfidenceScore();
     float highestRelativeScore = static_cast<float>(all_possibilities[0].total_score);
-    if (translate_to_right_to_left) {
+    if (runtime_data->rightToLeft()) {
       // Convert the characters to RTL (specifically for Arabic output in Egypt)
       // this code will only execute if "right_to_left: true" is set in the ocr_config.json
 
       // All arabic numbers 0-9 (utf-8 and latin/ascii)
       const std::vector<std::string> NUMBERS = {"0", "1", "2", "3", "4", "5", "6", "7", "8", "9",
         u8"\u0660",u8"\u0661",u8"\u0662",u8"\u0663",u8"\u0664",u8"\u0665",u8"\u0666",u8"\u0667",u8"\u0668",u8"\u0669",};
-      for (uint32_t i = 0; i < all_possibilities.size(); i++) {
+      for (uint32_t i = 0; i < num_possibilities; i++) {
         std::vector<Letter> arabic_letters;
         std::vector<Letter> arabic_numbers;
         for (uint32_t j = 0; j < all_possibilities[i].letter_details.size(); j++) {
@@ -214,31 +226,31 @@ void PostProcess::analyze(string templateregion, int topn) {
     }
     if (this->config->debugPostProcess) {
       // Print top words
-      for (int i = 0; i < all_possibilities.size(); i++) {
+      for (int i = 0; i < num_possibilities; i++) {
         cout << "Top " << topn << " Possibilities: " << all_possibilities[i].letters
              << " :\t" << all_possibilities[i].total_score;
         if (all_possibilities[i].letters == best_chars)
           cout << " <--- ";
         cout << endl;
       }
-      cout << all_possibilities.size() << " total permutations" << endl;
+      cout << num_possibilities << " total permutations" << endl;
     }
 
-    for (int i = 0; i < all_possibilities.size(); i++) {
+    for (int i = 0; i < num_possibilities; i++) {
       all_possibilities[i].total_score = maxPercentScore * (all_possibilities[i].total_score / highestRelativeScore);
     }
   }
 
   if (this->config->debugPostProcess) {
     // Print top words
-    for (int i = 0; i < all_possibilities.size(); i++) {
+    for (int i = 0; i < num_possibilities; i++) {
       cout << "Top " << topn << " Possibilities: " << all_possibilities[i].letters << " :\t"
            << all_possibilities[i].total_score;
       if (all_possibilities[i].letters == best_chars)
         cout << " <--- ";
       cout << endl;
     }
-    cout << all_possibilities.size() << " total permutations" << endl;
+    cout << num_possibilities << " total permutations" << endl;
   }
 
   if (config->debugTiming) {
@@ -252,7 +264,7 @@ void PostProcess::analyze(string templateregion, int topn) {
 }
 
 bool PostProcess::regionIsValid(std::string templateregion) {
-  return true;
+  return pattern_matcher->regionIndex(templateregion) >= 0;
 }
 
 float PostProcess::calculateMaxConfidenceScore() {
@@ -274,19 +286,55 @@ float PostProcess::calculateMaxConfidenceScore() {
 }
 
 const vector<PPResult> PostProcess::getResults() {
-  return this->all_possibilities;
+  return vector<PPResult>(all_possibilities.begin(), all_possibilities.begin() + num_possibilities);
 }
 
 struct PermutationCompare {
-  bool operator() (pair<float, vector<int>> &a, pair<float, vector<int>> &b) {
-    return (a.first < b.first);
+  template<typename Node>
+  bool operator() (const Node &a, const Node &b) const {
+    return (a.score < b.score);
   }
 };
 
-void PostProcess::findAllPermutations(string templateregion, int topn) {
-  // use a priority queue to process permutations in highest scoring order
-  priority_queue<pair<float, vector<int>>, vector<pair<float, vector<int>>>, PermutationCompare> permutations;
-  set<float> permutationHashes;
+bool PostProcess::markVisited(uint32_t node) {
+  const size_t positions = letters.size();
+  const uint8_t* indices = &permutation_indices[node * positions];
+  size_t mask = visited.size() - 1;
+  for (size_t slot = hashIndices(indices, positions) & mask;; slot = (slot + 1) & mask) {
+    VisitedSlot& entry = visited[slot];
+    if (entry.epoch != visited_epoch) {
+      entry.epoch = visited_epoch;
+      entry.node = node;
+      break;
+    }
+    if (memcmp(&permutation_indices[entry.node * positions], indices, positions) == 0)
+      return false;
+  }
+
+  // Keep the table at most half full.  Every queued node is in the set, so they are simply inserted again.
+  if (++num_visited * 2 > visited.size()) {
+    visited.assign(visited.size() * 2, VisitedSlot());
+    visited_epoch = 1;
+    num_visited = 0;
+    for (uint32_t n = 0; n <= node; n++)
+      markVisited(n);
+  }
+  return true;
+}
+
+void PostProcess::findAllPermutations(const string& templateregion, int topn) {
+  // Best-first search over the letter indices of every position, highest total score first
+  const size_t positions = letters.size();
+  permutation_heap.clear();
+  permutation_indices.clear();
+  if (visited.empty())
+    visited.resize(256);
+  // Epoch 0 marks slots that have never been used
+  if (++visited_epoch == 0) {
+    visited.assign(visited.size(), VisitedSlot());
+    visited_epoch = 1;
+  }
+  num_visited = 0;
 
   // push the first word onto the queue
   float total_score = 0;
@@ -294,92 +342,137 @@ void PostProcess::findAllPermutations(string templateregion, int topn) {
     if (letters[i].size() > 0)
       total_score += letters[i][0].total_score;
   }
-  vector<int> v(letters.size());
-  permutations.push(make_pair(total_score, v));
+  permutation_indices.resize(positions, 0);
+  markVisited(0);
+  PermutationNode first = {total_score, 0};
+  permutation_heap.push_back(first);
 
   int consecutiveNonMatches = 0;
-  while (permutations.size() > 0) {
+  while (permutation_heap.size() > 0) {
     // get the top permutation and analyze
-    pair<float, vector<int>> topPermutation = permutations.top();
-    if (analyzePermutation(topPermutation.second, templateregion, topn) == true)
+    std::pop_heap(permutation_heap.begin(), permutation_heap.end(), PermutationCompare());
+    PermutationNode top = permutation_heap.back();
+    permutation_heap.pop_back();
+    int dead_position;
+    if (analyzePermutation(&permutation_indices[top.node * positions], templateregion, topn, dead_position) == true)
       consecutiveNonMatches = 0;
     else
       consecutiveNonMatches += 1;
-    permutations.pop();
 
-    if (all_possibilities.size() >= topn || consecutiveNonMatches >= (topn*2))
+    if (num_possibilities >= topn || consecutiveNonMatches >= (topn*2))
       break;
 
-    // add child permutations to queue
-    for (int i = 0; i < letters.size(); i++) {
+    // add child permutations to queue.  Children that only change letters after a dead position die there too;
+    // whatever they could lead to is still reached by changing the earlier letters first.
+    for (size_t i = 0; static_cast<int>(i) <= dead_position && i < positions; i++) {
+      size_t index = permutation_indices[top.node * positions + i];
       // no more permutations with this letter
-      if (topPermutation.second[i]+1 >= letters[i].size())
+      if (index + 1 >= std::min(letters[i].size(), MAX_LETTERS_PER_POSITION))
         continue;
 
-      pair<float, vector<int>> childPermutation = topPermutation;
-      childPermutation.first -= letters[i][topPermutation.second[i]].total_score
-                                 - letters[i][topPermutation.second[i] + 1].total_score;
-      childPermutation.second[i] += 1;
-
-      // ignore permutations that have already been visited (assume that score is a good hash for permutation)
-      if (permutationHashes.end() != permutationHashes.find(childPermutation.first))
+      // The child's row is appended first, so the visited check can compare it in place
+      uint32_t child = permutation_indices.size() / positions;
+      permutation_indices.resize(permutation_indices.size() + positions);
+      std::copy(permutation_indices.begin() + top.node * positions,
+                permutation_indices.begin() + (top.node + 1) * positions,
+                permutation_indices.begin() + child * positions);
+      permutation_indices[child * positions + i] += 1;
+
+      // ignore permutations that have already been visited
+      if (!markVisited(child)) {
+        permutation_indices.resize(child * positions);
         continue;
+      }
 
-      permutations.push(childPermutation);
-      permutationHashes.insert(childPermutation.first);
+      PermutationNode node;
+      node.score = top.score - (letters[i][index].total_score - letters[i][index + 1].total_score);
+      node.node = child;
+      permutation_heap.push_back(node);
+      std::push_heap(permutation_heap.begin(), permutation_heap.end(), PermutationCompare());
     }
   }
 }
 
-bool PostProcess::analyzePermutation(vector<int> letterIndices, string templateregion, int topn) {
-  PPResult possibility;
-  possibility.letters = "";
+bool PostProcess::analyzePermutation(const uint8_t* letterIndices, const string& templateregion, int topn,
+                                     int& dead_position) {
+  // Built in place; its string and details keep their capacity from one permutation to the next
+  PPResult& possibility = candidate;
+  possibility.letters.clear();
+  possibility.letter_details.clear();
   possibility.total_score = 0;
   possibility.matches_template = false;
   int plate_char_length = 0;
+  // Templates are followed along as the letters are added.  When only matching plates are kept, the first letter
+  // that no template of the region allows ends the permutation.
+  const bool must_match = config->mustMatchPattern && templateregion.size() > 0;
+  bool template_alive = template_index >= 0;
+  dead_position = letters.size();
+  if (must_match && !template_alive) {
+    dead_position = -1;
+    return false;
+  }
+  PatternMatcher::State template_state;
+  if (template_alive)
+    pattern_matcher->start(template_index, template_state);
 
   int last_line = 0;
   for (int i = 0; i < letters.size(); i++) {
     if (letters[i].size() == 0)
       continue;
 
-    Letter letter = letters[i][letterIndices[i]];
+    const Letter& letter = letters[i][letterIndices[i]];
     // Add a "\n" on new lines
     if (letter.line_index != last_line) {
-      possibility.letters = possibility.letters + "\n";
+      possibility.letters += '\n';
     }
     last_line = letter.line_index;
     if (letter.letter != SKIP_CHAR) {
-      possibility.letters = possibility.letters + letter.letter;
+      if (template_alive)
+        template_alive = pattern_matcher->advance(template_index, template_state, letter.symbol_class);
+      if (must_match && !template_alive) {
+        dead_position = i;
+        return false;
+      }
+      possibility.letters += letter.letter;
       possibility.letter_details.push_back(letter);
       plate_char_length += 1;
     }
     possibility.total_score = possibility.total_score + letter.total_score;
   }
 
+  possibility.matches_template = template_alive && pattern_matcher->accepts(template_index, template_state);
+
   // ignore plates that don't fit the length requirements
   if (plate_char_length < config->postProcessMinCharacters ||
     plate_char_length > config->postProcessMaxCharacters)
     return false;
 
-  // ignore duplicate words
-  if (all_possibilities_letters.end() != all_possibilities_letters.find(possibility.letters))
-    return false;
+  // ignore duplicate words (there are at most topn results to compare against)
+  for (size_t i = 0; i < num_possibilities; i++) {
+    if (all_possibilities[i].letters == possibility.letters)
+      return false;
+  }
 
   // If mustMatchPattern is toggled in the config and a template is provided,
   // only include this result if there is a pattern match
   if (!config->mustMatchPattern || templateregion.size() == 0 ||
       (config->mustMatchPattern && possibility.matches_template)) {
-    all_possibilities.push_back(possibility);
-    all_possibilities_letters.insert(possibility.letters);
+    if (num_possibilities == all_possibilities.size()) {
+      all_possibilities.push_back(possibility);
+    } else {
+      PPResult& result = all_possibilities[num_possibilities];
+      result.letters = possibility.letters;
+      result.total_score = possibility.total_score;
+      result.matches_template = possibility.matches_template;
+      result.letter_details = possibility.letter_details;
+    }
+    num_possibilities++;
     return true;
   }
   return false;
 }
-
 std::vector<string> PostProcess::getPatterns() {
-  vector<string> v;
-  return v;
+  return pattern_matcher->getPatterns();
 }
 
 bool letterCompare(const Letter &left, const Letter &right) {
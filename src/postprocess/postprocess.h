@@ -22,12 +22,14 @@
 
 #include "config.h"
 #include "utility.h"
+#include "patternmatcher.h"
+#include "runtimedata.h"
+#include <memory>
 #include <fstream>
 #include <iostream>
+#include <stdint.h>
 #include <stdio.h>
-#include <queue>
 #include <vector>
-#include <set>
 #include <unordered_map>
 
 #define SKIP_CHAR "~"
@@ -40,6 +42,8 @@ struct Letter {
   int char_position;
   float total_score;
   int occurrences;
+  // PatternMatcher::symbolClass of letter
+  uint32_t symbol_class;
 };
 
 struct PPResult {
@@ -58,29 +62,71 @@ class PostProcess {
   ~PostProcess();
   void addLetter(std::string letter, int line_index, int charposition, float score);
   void clear();
-  void analyze(std::string templateregion, int topn);
+  void analyze(const std::string& templateregion, int topn);
   const std::vector<PPResult> getResults();
+  // Same results without copying them (valid until the next clear/analyze)
+  size_t getResultCount() const { return num_possibilities; }
+  const PPResult& getResult(size_t index) const { return all_possibilities[index]; }
   bool regionIsValid(std::string templateregion);
   std::vector<std::string> getPatterns();
   void setConfidenceThreshold(float min_confidence, float skip_level);
 
 
  private:
-  void findAllPermutations(std::string templateregion, int topn);
-  bool analyzePermutation(std::vector<int> letterIndices, std::string templateregion, int topn);
+  // A queued permutation: its score and the row of its letter indices in permutation_indices
+  struct PermutationNode {
+    float score;
+    uint32_t node;
+  };
+  struct VisitedSlot {
+    uint32_t epoch;
+    uint32_t node;
+  };
+
+  void findAllPermutations(const std::string& templateregion, int topn);
+  // `dead_position' is the position whose letter no template allows when only matching plates are kept (-1 when
+  // none ever can), or the number of positions
+  bool analyzePermutation(const uint8_t* letterIndices, const std::string& templateregion, int topn,
+                          int& dead_position);
+  // False if a permutation with the same letter indices as `node' was already queued in this search
+  bool markVisited(uint32_t node);
   void insertLetter(std::string letter, int line_index, int charPosition, float score);
   float calculateMaxConfidenceScore();
 
+  // Takes the current shared runtime data for this config
+  void acquireRuntimeData();
+
   Config* config;
+  // ocr_config.json and this country's templates, shared with every other PostProcess and Ocr on the same files
+  std::shared_ptr<const RuntimeData> runtime_data;
+  // RuntimeData::generation() when runtime_data was acquired
+  uint64_t runtime_generation;
+  // runtime_data's templates
+  const PatternMatcher* pattern_matcher;
+  // Region of the plate being analyzed, -1 when it has no templates
+  int template_index;
   std::vector<std::vector<Letter>> letters;
   std::vector<int> unknown_char_positions;
+  // The first num_possibilities entries are the results.  Entries past that are kept (with their string
+  // capacity) for the next plate.
   std::vector<PPResult> all_possibilities;
-  std::set<std::string> all_possibilities_letters;
+  size_t num_possibilities;
+
+  // Permutation search scratch.  It only ever grows, so once warmed up a search makes no heap allocations.
+  std::vector<PermutationNode> permutation_heap;
+  // One row of letters.size() indices per queued permutation
+  std::vector<uint8_t> permutation_indices;
+  // Open-addressing set of queued permutations keyed by their indices.  Slots from earlier searches are told
+  // apart by their epoch, so the table is never cleared.
+  std::vector<VisitedSlot> visited;
+  size_t num_visited;
+  uint32_t visited_epoch;
+  // The permutation being analyzed
+  PPResult candidate;
   float min_confidence;
   float skip_level;
   std::string best_chars;
   bool matches_template;
-  bool translate_to_right_to_left;
 };
 
 }  // namespace alpr
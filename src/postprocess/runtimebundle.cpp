@@ -0,0 +1,271 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+#include "runtimebundle.h"
+#include <alprlog.h>
+#include <fstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace alpr {
+
+namespace {
+const char BUNDLE_MAGIC[8] = {'A', 'L', 'P', 'R', 'B', 'N', 'D', 'L'};
+const size_t BUNDLE_ALIGNMENT = 8;
+
+size_t aligned(size_t offset) {
+  return (offset + BUNDLE_ALIGNMENT - 1) / BUNDLE_ALIGNMENT * BUNDLE_ALIGNMENT;
+}
+}  // namespace
+
+RuntimeBundle::RuntimeBundle() : data(NULL), size(0) {}
+
+RuntimeBundle::~RuntimeBundle() {
+  close();
+}
+
+void RuntimeBundle::close() {
+  if (data != NULL) {
+#ifdef _WIN32
+    free(const_cast<char*>(data));
+#else
+    munmap(const_cast<char*>(data), size);
+#endif
+  }
+  data = NULL;
+  size = 0;
+  sections.clear();
+}
+
+bool RuntimeBundle::open(const std::string& path) {
+  close();
+  this->path = path;
+#ifdef _WIN32
+  std::ifstream file(path.c_str(), std::ios::binary | std::ios::ate);
+  if (!file.is_open()) {
+    ALPR_ERROR << "Unable to open runtime bundle " << path;
+    return false;
+  }
+  size = file.tellg();
+  file.seekg(0, std::ios::beg);
+  char* buffer = static_cast<char*>(malloc(size));
+  if (buffer == NULL || !file.read(buffer, size)) {
+    free(buffer);
+    size = 0;
+    ALPR_ERROR << "Unable to read runtime bundle " << path;
+    return false;
+  }
+  data = buffer;
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    ALPR_ERROR << "Unable to open runtime bundle " << path;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    ::close(fd);
+    ALPR_ERROR << "Unable to read runtime bundle " << path;
+    return false;
+  }
+  void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping keeps its own reference to the file
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    ALPR_ERROR << "Unable to map runtime bundle " << path;
+    return false;
+  }
+  data = static_cast<const char*>(addr);
+  size = st.st_size;
+#endif
+
+  RuntimeBundleHeader header;
+  if (size < sizeof(header)) {
+    ALPR_ERROR << "Truncated runtime bundle " << path;
+    close();
+    return false;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) != 0 ||
+      header.byte_order != RUNTIME_BUNDLE_BYTE_ORDER || header.version != RUNTIME_BUNDLE_VERSION) {
+    ALPR_ERROR << "Unsupported runtime bundle " << path << " (version " << header.version << ", expected "
+               << RUNTIME_BUNDLE_VERSION << ")";
+    close();
+    return false;
+  }
+  size_t toc_end = sizeof(header) + static_cast<size_t>(header.num_sections) * sizeof(RuntimeBundleSection);
+  if (header.file_size != size || toc_end > size) {
+    ALPR_ERROR << "Truncated runtime bundle " << path;
+    close();
+    return false;
+  }
+  sections.resize(header.num_sections);
+  if (header.num_sections > 0)
+    memcpy(&sections[0], data + sizeof(header), header.num_sections * sizeof(RuntimeBundleSection));
+  for (size_t i = 0; i < sections.size(); i++) {
+    const RuntimeBundleSection& section = sections[i];
+    if (section.offset < toc_end || section.offset > size || section.size > size - section.offset ||
+        section.name[RUNTIME_BUNDLE_NAME_SIZE - 1] != '\0') {
+      ALPR_ERROR << "Corrupt table of contents in runtime bundle " << path;
+      close();
+      return false;
+    }
+  }
+  return true;
+}
+
+const void* RuntimeBundle::find(uint32_t type, const std::string& name, size_t& section_size) const {
+  for (size_t i = 0; i < sections.size(); i++) {
+    if (sections[i].type == type && name == sections[i].name) {
+      section_size = sections[i].size;
+      return data + sections[i].offset;
+    }
+  }
+  section_size = 0;
+  return NULL;
+}
+
+bool RuntimeBundle::strings(const std::string& name, std::vector<std::string>& out) const {
+  size_t section_size;
+  const char* section = static_cast<const char*>(find(BUNDLE_STRINGS, name, section_size));
+  out.clear();
+  return section != NULL && readStringTable(section, section_size, out, NULL);
+}
+
+void appendStringTable(const std::vector<std::string>& strings, std::vector<char>& out) {
+  std::vector<uint32_t> table;
+  table.push_back(strings.size());
+  uint32_t offset = 0;
+  table.push_back(offset);
+  for (size_t i = 0; i < strings.size(); i++) {
+    offset += strings[i].size();
+    table.push_back(offset);
+  }
+  size_t start = out.size();
+  out.resize(start + table.size() * sizeof(uint32_t));
+  memcpy(&out[start], &table[0], table.size() * sizeof(uint32_t));
+  for (size_t i = 0; i < strings.size(); i++)
+    out.insert(out.end(), strings[i].begin(), strings[i].end());
+}
+
+bool readStringTable(const char* data, size_t size, std::vector<std::string>& out, size_t* consumed) {
+  out.clear();
+  uint32_t count;
+  if (size < sizeof(count))
+    return false;
+  memcpy(&count, data, sizeof(count));
+  size_t table_size = sizeof(count) + (static_cast<size_t>(count) + 1) * sizeof(uint32_t);
+  if (table_size > size)
+    return false;
+  const char* characters = data + table_size;
+  size_t num_characters = size - table_size;
+  uint32_t begin, end;
+  memcpy(&begin, data + sizeof(count), sizeof(begin));
+  if (begin != 0)
+    return false;
+  out.resize(count);
+  for (uint32_t i = 0; i < count; i++) {
+    memcpy(&end, data + sizeof(count) + (i + 1) * sizeof(end), sizeof(end));
+    if (end < begin || end > num_characters) {
+      out.clear();
+      return false;
+    }
+    out[i].assign(characters + begin, end - begin);
+    begin = end;
+  }
+  if (consumed != NULL)
+    *consumed = table_size + begin;
+  return true;
+}
+
+void RuntimeBundleWriter::add(uint32_t type, const std::string& name, const void* data, size_t size) {
+  Pending section;
+  section.type = type;
+  section.name = name.substr(0, RUNTIME_BUNDLE_NAME_SIZE - 1);
+  section.data.assign(static_cast<const char*>(data), static_cast<const char*>(data) + size);
+  pending.push_back(section);
+}
+
+void RuntimeBundleWriter::addStrings(const std::string& name, const std::vector<std::string>& strings) {
+  std::vector<char> data;
+  appendStringTable(strings, data);
+  add(BUNDLE_STRINGS, name, data.data(), data.size());
+}
+
+bool RuntimeBundleWriter::write(const std::string& path) const {
+  RuntimeBundleHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC));
+  header.version = RUNTIME_BUNDLE_VERSION;
+  header.byte_order = RUNTIME_BUNDLE_BYTE_ORDER;
+  header.num_sections = pending.size();
+
+  std::vector<RuntimeBundleSection> toc(pending.size());
+  size_t offset = aligned(sizeof(header) + toc.size() * sizeof(RuntimeBundleSection));
+  for (size_t i = 0; i < pending.size(); i++) {
+    memset(&toc[i], 0, sizeof(toc[i]));
+    toc[i].type = pending[i].type;
+    strncpy(toc[i].name, pending[i].name.c_str(), RUNTIME_BUNDLE_NAME_SIZE - 1);
+    toc[i].offset = offset;
+    toc[i].size = pending[i].data.size();
+    offset = aligned(offset + pending[i].data.size());
+  }
+  header.file_size = offset;
+
+  // Written aside and renamed over the old bundle, so processes that have it mapped keep reading the old file
+  std::string temp_path = path + ".tmp";
+  std::ofstream file(temp_path.c_str(), std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    ALPR_ERROR << "Unable to write runtime bundle " << path;
+    return false;
+  }
+  const char padding[BUNDLE_ALIGNMENT] = {0};
+  size_t written = sizeof(header) + toc.size() * sizeof(RuntimeBundleSection);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  if (!toc.empty())
+    file.write(reinterpret_cast<const char*>(&toc[0]), toc.size() * sizeof(RuntimeBundleSection));
+  for (size_t i = 0; i < pending.size(); i++) {
+    file.write(padding, toc[i].offset - written);
+    file.write(pending[i].data.data(), pending[i].data.size());
+    written = toc[i].offset + pending[i].data.size();
+  }
+  file.write(padding, offset - written);
+  file.close();
+  if (!file.good()) {
+    ALPR_ERROR << "Unable to write runtime bundle " << path;
+    remove(temp_path.c_str());
+    return false;
+  }
+  if (rename(temp_path.c_str(), path.c_str()) != 0) {
+    // Windows won't rename over an existing file
+    remove(path.c_str());
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+      ALPR_ERROR << "Unable to write runtime bundle " << path;
+      remove(temp_path.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace alpr
@@ -0,0 +1,137 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+#ifndef OPENALPR_POSTPROCESS_RUNTIMEBUNDLE_H_
+#define OPENALPR_POSTPROCESS_RUNTIMEBUNDLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace alpr {
+
+/*
+  runtime.bundle: an OCR runtime directory (ocr_config.json, the models, and the countries' compiled .patterns)
+  in one file that is mapped and used in place.
+
+    RuntimeBundleHeader
+    RuntimeBundleSection x num_sections   (table of contents)
+    section data, each starting on an 8-byte boundary
+
+  Everything is stored in the writer's byte order; a reader on the other order (see byte_order) rejects the file,
+  as it does any other version.  Sections are found by type and name:
+
+    BUNDLE_CONSTANTS        "ocr"                     OcrRuntimeConstants
+    BUNDLE_STRINGS          "idx2char", "region_idx2name", "sequence_length_output",
+                            "model_inputs" (model name, input_layout, input_channel_order triplets)
+    BUNDLE_MODEL            model file name without extension (e.g. "ocr_x_int8")
+    BUNDLE_MODEL_ENCRYPTED  same, still encrypted with the ocr key as the .enc file was
+    BUNDLE_PATTERNS         country, PatternMatcher::save output
+*/
+const uint32_t RUNTIME_BUNDLE_VERSION = 1;
+const uint32_t RUNTIME_BUNDLE_BYTE_ORDER = 0x01020304;
+const size_t RUNTIME_BUNDLE_NAME_SIZE = 48;
+
+enum RuntimeBundleSectionType {
+  BUNDLE_CONSTANTS = 1,
+  BUNDLE_STRINGS = 2,
+  BUNDLE_MODEL = 3,
+  BUNDLE_MODEL_ENCRYPTED = 4,
+  BUNDLE_PATTERNS = 5
+};
+
+struct RuntimeBundleHeader {
+  char magic[8];  // "ALPRBNDL"
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t num_sections;
+  uint32_t reserved;
+  uint64_t file_size;
+};
+
+struct RuntimeBundleSection {
+  uint32_t type;
+  uint32_t reserved;
+  char name[RUNTIME_BUNDLE_NAME_SIZE];
+  // From the start of the file
+  uint64_t offset;
+  uint64_t size;
+};
+
+// The numbers in ocr_config.json, as stored in a bundle
+struct OcrRuntimeConstants {
+  int32_t topk;
+  int32_t crop_width;
+  int32_t crop_height;
+  int32_t max_timesteps;
+  // Entries in region_idx2name (ids may have gaps)
+  uint32_t num_regions;
+  uint8_t top1_only;
+  uint8_t right_to_left;
+  uint8_t reserved[2];
+};
+
+// String table: uint32 count, uint32 offsets[count + 1] into the characters that follow
+void appendStringTable(const std::vector<std::string>& strings, std::vector<char>& out);
+// Reads a table from the start of data[0, size).  `consumed' (if not NULL) gets its length in bytes.
+bool readStringTable(const char* data, size_t size, std::vector<std::string>& out, size_t* consumed);
+
+// A mapped bundle.  Section pointers stay valid for the life of the object.
+class RuntimeBundle {
+ public:
+  RuntimeBundle();
+  ~RuntimeBundle();
+
+  // Maps the file and checks its header and table of contents; logs why on failure
+  bool open(const std::string& path);
+  const std::string& getPath() const { return path; }
+
+  // NULL when there is no such section
+  const void* find(uint32_t type, const std::string& name, size_t& size) const;
+  // Copies a BUNDLE_STRINGS section.  False when it is missing or malformed.
+  bool strings(const std::string& name, std::vector<std::string>& out) const;
+  const std::vector<RuntimeBundleSection>& getSections() const { return sections; }
+
+ private:
+  RuntimeBundle(const RuntimeBundle&);
+  RuntimeBundle& operator=(const RuntimeBundle&);
+  void close();
+
+  std::string path;
+  const char* data;
+  size_t size;
+  std::vector<RuntimeBundleSection> sections;
+};
+
+// Builds a bundle in memory and writes it in one go
+class RuntimeBundleWriter {
+ public:
+  void add(uint32_t type, const std::string& name, const void* data, size_t size);
+  void addStrings(const std::string& name, const std::vector<std::string>& strings);
+  bool write(const std::string& path) const;
+
+ private:
+  struct Pending {
+    uint32_t type;
+    std::string name;
+    std::vector<char> data;
+  };
+  std::vector<Pending> pending;
+};
+
+}  // namespace alpr
+#endif  // OPENALPR_POSTPROCESS_RUNTIMEBUNDLE_H_
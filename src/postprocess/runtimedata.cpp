@@ -0,0 +1,280 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+#include "runtimedata.h"
+#include <alprsupport/filesystem.h>
+#include <alprsupport/json.hpp>
+#include <alprlog.h>
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <string.h>
+
+namespace alpr {
+
+namespace {
+// Dense id -> token table from an {"id": "token"} JSON object
+void loadTokenTable(const nlohmann::json& config, const char* name, std::vector<std::string>& table) {
+  table.clear();
+  if (config.find(name) == config.end())
+    return;
+  for (auto& x : config[name].items()) {
+    size_t id = std::stoul(x.key());
+    if (id >= table.size())
+      table.resize(id + 1);
+    table[id] = x.value().get<std::string>();
+  }
+}
+
+bool sameFile(const alprsupport::FileInfo& a, const alprsupport::FileInfo& b) {
+  return a.creation_time == b.creation_time && a.size == b.size;
+}
+
+struct RegistryEntry {
+  std::string ocr_dir;
+  std::string patterns_dir;
+  std::string country;
+  std::string letters_regex;
+  std::string numbers_regex;
+  // The data's sources as they were when it was loaded, to tell whether they changed since
+  std::vector<alprsupport::FileInfo> source_infos;
+  std::shared_ptr<const RuntimeData> data;
+};
+
+struct Registry {
+  std::mutex mutex;
+  std::map<std::string, RegistryEntry> entries;
+  std::atomic<uint64_t> generation;
+  Registry() : generation(0) {}
+};
+
+Registry& registry() {
+  static Registry instance;
+  return instance;
+}
+
+std::vector<alprsupport::FileInfo> sourceInfos(const RuntimeData& data) {
+  std::vector<alprsupport::FileInfo> infos;
+  for (size_t i = 0; i < data.getSources().size(); i++)
+    infos.push_back(alprsupport::getFileInfo(data.getSources()[i]));
+  return infos;
+}
+}  // namespace
+
+RuntimeData::RuntimeData() : is_loaded(false) {
+  memset(&constants, 0, sizeof(constants));
+}
+
+bool RuntimeData::load(const std::string& ocr_dir, const std::string& patterns_dir, const std::string& country,
+                       const std::string& letters_regex, const std::string& numbers_regex, bool use_bundle) {
+  std::string bundle_path = ocr_dir + "/runtime.bundle";
+  std::string ocr_config_path = ocr_dir + "/ocr_config.json";
+  if (use_bundle && alprsupport::fileExists(bundle_path.c_str())) {
+    if (!loadBundle(bundle_path))
+      return false;
+  } else if (!loadJson(ocr_config_path)) {
+    return false;
+  }
+
+  // Bundled templates were compiled for given letter / number classes; with other ones they are compiled again
+  bool compiled = false;
+  if (bundle != NULL) {
+    size_t size;
+    const void* patterns = bundle->find(BUNDLE_PATTERNS, country, size);
+    compiled = patterns != NULL &&
+               pattern_matcher.loadCompiled(patterns, size, char_tokens, letters_regex, numbers_regex);
+  }
+  if (!compiled) {
+    std::string patterns_path = patterns_dir + "/" + country + ".patterns";
+    pattern_matcher.load(patterns_path, char_tokens, letters_regex, numbers_regex);
+    sources.push_back(patterns_path);
+  }
+  is_loaded = true;
+  return true;
+}
+
+bool RuntimeData::loadBundle(const std::string& bundle_path) {
+  std::shared_ptr<RuntimeBundle> opened(new RuntimeBundle());
+  if (!opened->open(bundle_path))
+    return false;
+  size_t size;
+  const void* stored = opened->find(BUNDLE_CONSTANTS, "ocr", size);
+  std::vector<std::string> inputs;
+  if (stored == NULL || size != sizeof(constants) || !opened->strings("idx2char", char_tokens) ||
+      !opened->strings("region_idx2name", region_tokens)) {
+    ALPR_ERROR << "Runtime bundle " << bundle_path << " has no OCR configuration";
+    return false;
+  }
+  memcpy(&constants, stored, sizeof(constants));
+  std::vector<std::string> sequence_lengths;
+  opened->strings("sequence_length_output", sequence_lengths);
+  sequence_length_output = sequence_lengths.empty() ? "sequence_lengths" : sequence_lengths[0];
+  // (model name, layout, channel order) triplets; the unnamed one is the top-level default
+  default_input.layout = "NCHW";
+  default_input.channel_order = "RGB";
+  opened->strings("model_inputs", inputs);
+  for (size_t i = 0; i + 2 < inputs.size(); i += 3) {
+    OcrModelInput input;
+    input.layout = inputs[i + 1];
+    input.channel_order = inputs[i + 2];
+    if (inputs[i].empty())
+      default_input = input;
+    else
+      model_inputs[inputs[i]] = input;
+  }
+  bundle = opened;
+  sources.push_back(bundle_path);
+  return true;
+}
+
+bool RuntimeData::loadJson(const std::string& ocr_config_path) {
+  if (!alprsupport::fileExists(ocr_config_path.c_str())) {
+    ALPR_ERROR << "Unable to find OCR configuration: " << ocr_config_path;
+    return false;
+  }
+  // A file caught half-written by a deploy fails here rather than in the caller, so a reload keeps the old data
+  try {
+    std::ifstream ifs(ocr_config_path.c_str());
+    nlohmann::json ocr_config = nlohmann::json::parse(ifs);
+    const char* required[] = {"topk", "crop_width", "crop_height", "max_timesteps"};
+    for (size_t i = 0; i < sizeof(required) / sizeof(required[0]); i++) {
+      if (ocr_config.find(required[i]) == ocr_config.end()) {
+        ALPR_ERROR << "Missing " << required[i] << " in " << ocr_config_path;
+        return false;
+      }
+    }
+    constants.topk = ocr_config["topk"];
+    constants.crop_width = ocr_config["crop_width"];
+    constants.crop_height = ocr_config["crop_height"];
+    constants.max_timesteps = ocr_config["max_timesteps"];
+    constants.num_regions = ocr_config.count("region_idx2name") ? ocr_config["region_idx2name"].size() : 0;
+    // "top1_only": true skips the alternate characters, and stops reading each crop at its end token
+    constants.top1_only = ocr_config.value("top1_only", false);
+    constants.right_to_left = ocr_config.value("right_to_left", false);
+    sequence_length_output = ocr_config.value("sequence_length_output", "sequence_lengths");
+    default_input.layout = ocr_config.value("input_layout", "NCHW");
+    default_input.channel_order = ocr_config.value("input_channel_order", "RGB");
+    if (ocr_config.count("model_inputs")) {
+      for (auto& x : ocr_config["model_inputs"].items()) {
+        OcrModelInput input;
+        input.layout = x.value().value("input_layout", "NCHW");
+        input.channel_order = x.value().value("input_channel_order", "RGB");
+        model_inputs[x.key()] = input;
+      }
+    }
+    loadTokenTable(ocr_config, "idx2char", char_tokens);
+    loadTokenTable(ocr_config, "region_idx2name", region_tokens);
+  } catch (const std::exception& e) {
+    ALPR_ERROR << "Invalid OCR configuration " << ocr_config_path << ": " << e.what();
+    return false;
+  }
+  sources.push_back(ocr_config_path);
+  return true;
+}
+
+OcrModelInput RuntimeData::modelInput(const std::string& model_name) const {
+  std::map<std::string, OcrModelInput>::const_iterator found = model_inputs.find(model_name);
+  return found == model_inputs.end() ? default_input : found->second;
+}
+
+const void* RuntimeData::modelData(const std::string& model_name, size_t& size, bool& encrypted) const {
+  size = 0;
+  encrypted = false;
+  if (bundle == NULL)
+    return NULL;
+  const void* data = bundle->find(BUNDLE_MODEL, model_name, size);
+  if (data == NULL) {
+    data = bundle->find(BUNDLE_MODEL_ENCRYPTED, model_name, size);
+    encrypted = data != NULL;
+  }
+  return data;
+}
+
+std::shared_ptr<const RuntimeData> RuntimeData::acquire(const std::string& ocr_dir, const std::string& patterns_dir,
+                                                        const std::string& country, const std::string& letters_regex,
+                                                        const std::string& numbers_regex) {
+  Registry& r = registry();
+  std::string key = ocr_dir + '\n' + patterns_dir + '\n' + country + '\n' + letters_regex + '\n' + numbers_regex;
+  std::lock_guard<std::mutex> lock(r.mutex);
+  std::map<std::string, RegistryEntry>::iterator found = r.entries.find(key);
+  if (found != r.entries.end())
+    return found->second.data;
+
+  // Loads run under the lock, so threads starting up together read the files once between them
+  std::shared_ptr<RuntimeData> data(new RuntimeData());
+  if (!data->load(ocr_dir, patterns_dir, country, letters_regex, numbers_regex, true)) {
+    // Not registered, so the next caller tries again
+    static const std::shared_ptr<const RuntimeData> empty(new RuntimeData());
+    return empty;
+  }
+  RegistryEntry entry;
+  entry.ocr_dir = ocr_dir;
+  entry.patterns_dir = patterns_dir;
+  entry.country = country;
+  entry.letters_regex = letters_regex;
+  entry.numbers_regex = numbers_regex;
+  entry.source_infos = sourceInfos(*data);
+  entry.data = data;
+  r.entries.insert(std::make_pair(key, entry));
+  return entry.data;
+}
+
+std::shared_ptr<const RuntimeData> RuntimeData::loadSources(const std::string& ocr_dir,
+                                                            const std::string& patterns_dir,
+                                                            const std::string& country,
+                                                            const std::string& letters_regex,
+                                                            const std::string& numbers_regex) {
+  std::shared_ptr<RuntimeData> data(new RuntimeData());
+  if (!data->load(ocr_dir, patterns_dir, country, letters_regex, numbers_regex, false))
+    return std::shared_ptr<const RuntimeData>();
+  return data;
+}
+
+int RuntimeData::reloadChanged() {
+  Registry& r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  int reloaded = 0;
+  for (std::map<std::string, RegistryEntry>::iterator it = r.entries.begin(); it != r.entries.end(); ++it) {
+    RegistryEntry& entry = it->second;
+    std::vector<alprsupport::FileInfo> infos = sourceInfos(*entry.data);
+    bool changed = false;
+    for (size_t i = 0; !changed && i < infos.size(); i++)
+      changed = !sameFile(infos[i], entry.source_infos[i]);
+    // A bundle dropped into the directory replaces the text files too
+    std::string bundle_path = entry.ocr_dir + "/runtime.bundle";
+    changed = changed || (!entry.data->fromBundle() && alprsupport::fileExists(bundle_path.c_str()));
+    if (!changed)
+      continue;
+    std::shared_ptr<RuntimeData> data(new RuntimeData());
+    if (!data->load(entry.ocr_dir, entry.patterns_dir, entry.country, entry.letters_regex, entry.numbers_regex,
+                    true)) {
+      ALPR_WARN << "Keeping the loaded runtime data for " << entry.ocr_dir;
+      continue;
+    }
+    ALPR_INFO << "Reloaded runtime data for " << entry.ocr_dir << " (" << entry.country << ")";
+    entry.source_infos = sourceInfos(*data);
+    entry.data = data;
+    reloaded++;
+    r.generation++;
+  }
+  return reloaded;
+}
+
+uint64_t RuntimeData::generation() {
+  return registry().generation.load(std::memory_order_relaxed);
+}
+
+}  // namespace alpr
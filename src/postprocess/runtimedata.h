@@ -0,0 +1,106 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+#ifndef OPENALPR_POSTPROCESS_RUNTIMEDATA_H_
+#define OPENALPR_POSTPROCESS_RUNTIMEDATA_H_
+
+#include "patternmatcher.h"
+#include "runtimebundle.h"
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace alpr {
+
+// input_layout / input_channel_order of one model in ocr_config.json
+struct OcrModelInput {
+  std::string layout;
+  std::string channel_order;
+};
+
+/*
+  What the OCR and PostProcess read from the runtime directories: the constants and token tables of
+  ocr_config.json, the model files, and the country's .patterns compiled against the tokens.
+
+  They come from <ocr_dir>/runtime.bundle when there is one (see runtimebundle.h): the file is mapped, the
+  constants and compiled templates are copied out of it and the models are read in place, so nothing is parsed.
+  Otherwise ocr_config.json and <patterns_dir>/<country>.patterns are parsed and compiled.
+
+  Each combination of directories, country and letter/number classes is loaded once per process and shared by
+  every Ocr and PostProcess that asks for it.  An instance never changes after loading, so it is read without
+  locks.  reloadChanged() swaps in fresh copies of the files that changed on disk; holders keep the copy they have
+  until they acquire again (PostProcess does when generation() moves; an Ocr keeps its own, since the token tables
+  belong to its model).
+*/
+class RuntimeData {
+ public:
+  // Never NULL.  When neither the bundle nor ocr_config.json can be read, returns an empty instance (loaded()
+  // false) and logs why.
+  static std::shared_ptr<const RuntimeData> acquire(const std::string& ocr_dir, const std::string& patterns_dir,
+                                                    const std::string& country, const std::string& letters_regex,
+                                                    const std::string& numbers_regex);
+  // Reads ocr_config.json and the .patterns file even when there is a bundle, outside the registry.  For building
+  // bundles; NULL on failure.
+  static std::shared_ptr<const RuntimeData> loadSources(const std::string& ocr_dir, const std::string& patterns_dir,
+                                                        const std::string& country, const std::string& letters_regex,
+                                                        const std::string& numbers_regex);
+  // Re-reads every registered entry whose files changed since it was loaded.  Returns how many were replaced.
+  static int reloadChanged();
+  // Bumped by every replacement, so holders can tell cheaply that a newer copy exists
+  static uint64_t generation();
+
+  bool loaded() const { return is_loaded; }
+  bool fromBundle() const { return bundle != NULL; }
+  const OcrRuntimeConstants& ocrConstants() const { return constants; }
+  // right_to_left in ocr_config.json: reverse the letters and numbers of the results (Arabic output in Egypt)
+  bool rightToLeft() const { return constants.right_to_left != 0; }
+  // Name of the optional [batch] output with the timesteps each crop used
+  const std::string& sequenceLengthOutput() const { return sequence_length_output; }
+  // The model's entry under "model_inputs", else the top-level input_layout / input_channel_order
+  OcrModelInput modelInput(const std::string& model_name) const;
+  // Bytes of a bundled model (e.g. "ocr_x_int8"), valid for the life of this instance.  NULL when there is no
+  // bundle or it doesn't hold the model.
+  const void* modelData(const std::string& model_name, size_t& size, bool& encrypted) const;
+  // idx2char and region_idx2name by id.  Ids missing from the JSON map to "".
+  const std::vector<std::string>& charTokens() const { return char_tokens; }
+  const std::vector<std::string>& regionTokens() const { return region_tokens; }
+  const PatternMatcher& patternMatcher() const { return pattern_matcher; }
+  // Files this instance was read from, watched by reloadChanged()
+  const std::vector<std::string>& getSources() const { return sources; }
+
+ private:
+  RuntimeData();
+  bool load(const std::string& ocr_dir, const std::string& patterns_dir, const std::string& country,
+            const std::string& letters_regex, const std::string& numbers_regex, bool use_bundle);
+  bool loadBundle(const std::string& bundle_path);
+  bool loadJson(const std::string& ocr_config_path);
+
+  bool is_loaded;
+  std::shared_ptr<RuntimeBundle> bundle;
+  OcrRuntimeConstants constants;
+  std::string sequence_length_output;
+  OcrModelInput default_input;
+  std::map<std::string, OcrModelInput> model_inputs;
+  std::vector<std::string> char_tokens;
+  std::vector<std::string> region_tokens;
+  PatternMatcher pattern_matcher;
+  std::vector<std::string> sources;
+};
+
+}  // namespace alpr
+#endif  // OPENALPR_POSTPROCESS_RUNTIMEDATA_H_
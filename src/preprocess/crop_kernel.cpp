@@ -0,0 +1,388 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+#include "crop_kernel.h"
+#include "opencv2/imgproc/imgproc.hpp"
+#include <alprsupport/cpu_detect.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <cmath>
+#include <algorithm>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define ALPR_CROP_KERNEL_AVX2
+#include <immintrin.h>
+#endif
+
+using std::vector;
+using cv::Point2f;
+
+namespace alpr {
+
+namespace {
+// Same sub-pixel precision warpPerspective uses for INTER_LINEAR
+const int INTER_BITS = 5;
+const int INTER_TAB_SIZE = 1 << INTER_BITS;
+const float INTER_SCALE = 1.0f / INTER_TAB_SIZE;
+// warpPerspective's tile size
+const int WARP_BLOCK_SIZE = 32;
+
+inline int clamp_index(int v, int max_index) {
+  return v < 0 ? 0 : (v > max_index ? max_index : v);
+}
+
+// warpPerspective maps the destination in tiles this many columns wide, and works out each pixel's source
+// position in double relative to its tile's first column.  Evaluating it in the same order rounds every position
+// to the same 1/32 of a pixel.
+inline int warp_block_width(int crop_width, int crop_height) {
+  int block_height = std::min(WARP_BLOCK_SIZE / 2, crop_height);
+  return std::min(WARP_BLOCK_SIZE * WARP_BLOCK_SIZE / block_height, crop_width);
+}
+
+// Source position of output pixel (x, y) in 1/32 pixels
+inline void warp_position(const double* M, int x, int y, int block_width, int& X, int& Y) {
+  int block_x = x - x % block_width;
+  int x1 = x - block_x;
+  double X0 = M[0] * block_x + M[1] * y + M[2];
+  double Y0 = M[3] * block_x + M[4] * y + M[5];
+  double W0 = M[6] * block_x + M[7] * y + M[8];
+  double w = W0 + M[6] * x1;
+  w = w ? INTER_TAB_SIZE / w : 0;
+  double fx = std::max(static_cast<double>(INT_MIN), std::min(static_cast<double>(INT_MAX), (X0 + M[0] * x1) * w));
+  double fy = std::max(static_cast<double>(INT_MIN), std::min(static_cast<double>(INT_MAX), (Y0 + M[3] * x1) * w));
+  X = static_cast<int>(std::lrint(fx));
+  Y = static_cast<int>(std::lrint(fy));
+}
+
+// Samples one output pixel and stores the channel-swapped value in the R, G, B planes at `offset`
+template<typename T>
+inline void warp_pixel(const cv::Mat& src, const double* M, int x, int y, int block_width, T* r_plane, T* g_plane,
+                       T* b_plane, int offset) {
+  int X, Y;
+  warp_position(M, x, y, block_width, X, Y);
+  int x0 = X >> INTER_BITS;
+  int y0 = Y >> INTER_BITS;
+  float ax = (X & (INTER_TAB_SIZE - 1)) * INTER_SCALE;
+  float ay = (Y & (INTER_TAB_SIZE - 1)) * INTER_SCALE;
+
+  const int max_x = src.cols - 1;
+  const int max_y = src.rows - 1;
+  const uint8_t* row0 = src.ptr<uint8_t>(clamp_index(y0, max_y));
+  const uint8_t* row1 = src.ptr<uint8_t>(clamp_index(y0 + 1, max_y));
+  const int xa = clamp_index(x0, max_x) * 3;
+  const int xb = clamp_index(x0 + 1, max_x) * 3;
+
+  // Multiples of 1/1024, so each weight, product and sum is exact in float: the same value remap gets from its
+  // 15 bit fixed-point weights, rounded the same way
+  const float w00 = (1.0f - ax) * (1.0f - ay);
+  const float w01 = ax * (1.0f - ay);
+  const float w10 = (1.0f - ax) * ay;
+  const float w11 = ax * ay;
+  T* planes[3] = {b_plane, g_plane, r_plane};
+  for (int c = 0; c < 3; c++) {
+    float v = row0[xa + c] * w00 + row0[xb + c] * w01 + row1[xa + c] * w10 + row1[xb + c] * w11;
+    // Always a whole level in [0, 255], so the uint8 planes hold exactly the float values
+    planes[c][offset] = static_cast<T>(std::floor(v + 0.5f));
+  }
+}
+
+// Where a crop is written: element offset(pixel) of each channel's plane.  Planar output is three separate planes,
+// interleaved output three planes one element apart, stepping 3 per pixel.
+template<typename T>
+struct CropOutput {
+  T* r_plane;
+  T* g_plane;
+  T* b_plane;
+  int step;
+  // Interleaved as B, G, R rather than R, G, B
+  bool bgr;
+
+  int offset(int pixel) const { return step * pixel; }
+
+  static CropOutput planar(T* dst, int crop_width, int crop_height) {
+    const int channel_stride = crop_width * crop_height;
+    CropOutput out = {dst, dst + channel_stride, dst + 2 * channel_stride, 1, false};
+    return out;
+  }
+  static CropOutput interleaved(T* dst, bool bgr) {
+    CropOutput out = {bgr ? dst + 2 : dst, dst + 1, bgr ? dst : dst + 2, 3, bgr};
+    return out;
+  }
+};
+
+template<typename T>
+void warp_crop_scalar(const cv::Mat& src, const double* M, int crop_width, int crop_height, const CropOutput<T>& out) {
+  const int block_width = warp_block_width(crop_width, crop_height);
+  for (int y = 0; y < crop_height; y++) {
+    for (int x = 0; x < crop_width; x++)
+      warp_pixel(src, M, x, y, block_width, out.r_plane, out.g_plane, out.b_plane, out.offset(y * crop_width + x));
+  }
+}
+
+#ifdef ALPR_CROP_KERNEL_AVX2
+// Source positions of 4 output pixels x1 = block_x + offsets, as warp_position computes them
+__attribute__((target("avx2")))
+inline __m128i warp_positions_avx2(__m256d offsets, __m256d m0, __m256d m6, __m256d X0, __m256d W0) {
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d tab_size = _mm256_set1_pd(static_cast<double>(INTER_TAB_SIZE));
+  const __m256d int_min = _mm256_set1_pd(static_cast<double>(INT_MIN));
+  const __m256d int_max = _mm256_set1_pd(static_cast<double>(INT_MAX));
+  __m256d w = _mm256_add_pd(W0, _mm256_mul_pd(m6, offsets));
+  __m256d nonzero = _mm256_cmp_pd(w, zero, _CMP_NEQ_OQ);
+  w = _mm256_and_pd(_mm256_div_pd(tab_size, w), nonzero);
+  __m256d f = _mm256_mul_pd(_mm256_add_pd(X0, _mm256_mul_pd(m0, offsets)), w);
+  f = _mm256_max_pd(int_min, _mm256_min_pd(int_max, f));
+  return _mm256_cvtpd_epi32(f);
+}
+
+// 24 interleaved values from three channels of 8: lanes of `pixels' pick each one's pixel, the masks its channel
+template<int C1_MASK, int C2_MASK>
+__attribute__((target("avx2")))
+inline __m256 interleave_avx2(__m256 c0, __m256 c1, __m256 c2, __m256i pixels) {
+  __m256 v = _mm256_blend_ps(_mm256_permutevar8x32_ps(c0, pixels), _mm256_permutevar8x32_ps(c1, pixels), C1_MASK);
+  return _mm256_blend_ps(v, _mm256_permutevar8x32_ps(c2, pixels), C2_MASK);
+}
+
+// 8 whole levels in [0, 255] -> 8 bytes in the low half
+__attribute__((target("avx2")))
+inline __m128i pack_levels_avx2(__m256 levels) {
+  __m256i v = _mm256_cvttps_epi32(levels);
+  __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  return _mm_packus_epi16(words, words);
+}
+
+// Stores the levels of the 8 pixels starting at `pixel'
+__attribute__((target("avx2")))
+inline void store_levels_avx2(const CropOutput<float>& out, int pixel, __m256 r, __m256 g, __m256 b) {
+  if (out.step == 1) {
+    _mm256_storeu_ps(out.r_plane + pixel, r);
+    _mm256_storeu_ps(out.g_plane + pixel, g);
+    _mm256_storeu_ps(out.b_plane + pixel, b);
+    return;
+  }
+  const __m256 first = out.bgr ? b : r;
+  const __m256 third = out.bgr ? r : b;
+  float* dst = (out.bgr ? out.b_plane : out.r_plane) + 3 * pixel;
+  _mm256_storeu_ps(dst, interleave_avx2<0x92, 0x24>(first, g, third, _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2)));
+  _mm256_storeu_ps(dst + 8, interleave_avx2<0x24, 0x49>(first, g, third, _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5)));
+  _mm256_storeu_ps(dst + 16, interleave_avx2<0x49, 0x92>(first, g, third, _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7)));
+}
+
+__attribute__((target("avx2")))
+inline void store_levels_avx2(const CropOutput<uint8_t>& out, int pixel, __m256 r, __m256 g, __m256 b) {
+  if (out.step == 1) {
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out.r_plane + pixel), pack_levels_avx2(r));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out.g_plane + pixel), pack_levels_avx2(g));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out.b_plane + pixel), pack_levels_avx2(b));
+    return;
+  }
+  // First and second channel bytes side by side in one register, the third in another, shuffled into place
+  const __m128i c01 = _mm_unpacklo_epi64(pack_levels_avx2(out.bgr ? b : r), pack_levels_avx2(g));
+  const __m128i c2 = pack_levels_avx2(out.bgr ? r : b);
+  const char Z = -128;
+  __m128i lo = _mm_or_si128(
+      _mm_shuffle_epi8(c01, _mm_setr_epi8(0, 8, Z, 1, 9, Z, 2, 10, Z, 3, 11, Z, 4, 12, Z, 5)),
+      _mm_shuffle_epi8(c2, _mm_setr_epi8(Z, Z, 0, Z, Z, 1, Z, Z, 2, Z, Z, 3, Z, Z, 4, Z)));
+  __m128i hi = _mm_or_si128(
+      _mm_shuffle_epi8(c01, _mm_setr_epi8(13, Z, 6, 14, Z, 7, 15, Z, Z, Z, Z, Z, Z, Z, Z, Z)),
+      _mm_shuffle_epi8(c2, _mm_setr_epi8(Z, 5, Z, Z, 6, Z, Z, 7, Z, Z, Z, Z, Z, Z, Z, Z)));
+  uint8_t* dst = (out.bgr ? out.b_plane : out.r_plane) + 3 * pixel;
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), lo);
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 16), hi);
+}
+
+// 8 output pixels per iteration.  Source positions are worked out in double exactly like warp_position (no FMA:
+// it would round differently); the four bilinear taps are then fetched with 32 bit gathers (B, G, R and one
+// spare byte), so any group of pixels whose gather would read past the end of the image falls back to warp_pixel.
+// The rounded levels go straight to `out', narrowed and interleaved in registers as it needs.
+template<typename T>
+__attribute__((target("avx2")))
+void warp_crop_avx2(const cv::Mat& src, const double* M, int crop_width, int crop_height, const CropOutput<T>& out) {
+  const int block_width = warp_block_width(crop_width, crop_height);
+
+  const __m256d m0 = _mm256_set1_pd(M[0]);
+  const __m256d m3 = _mm256_set1_pd(M[3]);
+  const __m256d m6 = _mm256_set1_pd(M[6]);
+  const __m256d low_lanes = _mm256_setr_pd(0, 1, 2, 3);
+  const __m256d high_lanes = _mm256_setr_pd(4, 5, 6, 7);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 inter_scale = _mm256_set1_ps(INTER_SCALE);
+
+  const __m256i izero = _mm256_setzero_si256();
+  const __m256i ione = _mm256_set1_epi32(1);
+  const __m256i ithree = _mm256_set1_epi32(3);
+  const __m256i frac_mask = _mm256_set1_epi32(INTER_TAB_SIZE - 1);
+  const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+  const __m256i max_x = _mm256_set1_epi32(src.cols - 1);
+  const __m256i max_y = _mm256_set1_epi32(src.rows - 1);
+  const __m256i row_step = _mm256_set1_epi32(static_cast<int>(src.step));
+  // last byte offset a 4 byte gather may start from without leaving the image
+  const __m256i gather_limit = _mm256_set1_epi32(static_cast<int>((src.rows - 1) * src.step) + (src.cols * 3) - 4);
+  const int* base = reinterpret_cast<const int*>(src.data);
+
+  for (int y = 0; y < crop_height; y++) {
+    int x = 0;
+    for (; x + 8 <= crop_width; x += 8) {
+      const int pixel = y * crop_width + x;
+      // Blocks are a multiple of 8 wide unless they span the whole row, so a group never straddles two
+      int block_x = x - x % block_width;
+      if (x + 8 > block_x + block_width) {
+        for (int i = 0; i < 8; i++)
+          warp_pixel(src, M, x + i, y, block_width, out.r_plane, out.g_plane, out.b_plane, out.offset(pixel + i));
+        continue;
+      }
+      const __m256d X0 = _mm256_set1_pd(M[0] * block_x + M[1] * y + M[2]);
+      const __m256d Y0 = _mm256_set1_pd(M[3] * block_x + M[4] * y + M[5]);
+      const __m256d W0 = _mm256_set1_pd(M[6] * block_x + M[7] * y + M[8]);
+      const __m256d first = _mm256_set1_pd(static_cast<double>(x - block_x));
+      const __m256d lo = _mm256_add_pd(first, low_lanes);
+      const __m256d hi = _mm256_add_pd(first, high_lanes);
+      __m256i X = _mm256_insertf128_si256(_mm256_castsi128_si256(warp_positions_avx2(lo, m0, m6, X0, W0)),
+                                          warp_positions_avx2(hi, m0, m6, X0, W0), 1);
+      __m256i Y = _mm256_insertf128_si256(_mm256_castsi128_si256(warp_positions_avx2(lo, m3, m6, Y0, W0)),
+                                          warp_positions_avx2(hi, m3, m6, Y0, W0), 1);
+
+      __m256i x0 = _mm256_srai_epi32(X, INTER_BITS);
+      __m256i y0 = _mm256_srai_epi32(Y, INTER_BITS);
+      __m256 ax = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(X, frac_mask)), inter_scale);
+      __m256 ay = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(Y, frac_mask)), inter_scale);
+
+      __m256i xa = _mm256_min_epi32(_mm256_max_epi32(x0, izero), max_x);
+      __m256i xb = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(x0, ione), izero), max_x);
+      __m256i ya = _mm256_min_epi32(_mm256_max_epi32(y0, izero), max_y);
+      __m256i yb = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(y0, ione), izero), max_y);
+      xa = _mm256_mullo_epi32(xa, ithree);
+      xb = _mm256_mullo_epi32(xb, ithree);
+      ya = _mm256_mullo_epi32(ya, row_step);
+      yb = _mm256_mullo_epi32(yb, row_step);
+      __m256i off00 = _mm256_add_epi32(ya, xa);
+      __m256i off01 = _mm256_add_epi32(ya, xb);
+      __m256i off10 = _mm256_add_epi32(yb, xa);
+      __m256i off11 = _mm256_add_epi32(yb, xb);
+
+      __m256i furthest = _mm256_max_epi32(_mm256_max_epi32(off00, off01), _mm256_max_epi32(off10, off11));
+      if (_mm256_movemask_epi8(_mm256_cmpgt_epi32(furthest, gather_limit)) != 0) {
+        for (int i = 0; i < 8; i++)
+          warp_pixel(src, M, x + i, y, block_width, out.r_plane, out.g_plane, out.b_plane, out.offset(pixel + i));
+        continue;
+      }
+
+      __m256i p00 = _mm256_i32gather_epi32(base, off00, 1);
+      __m256i p01 = _mm256_i32gather_epi32(base, off01, 1);
+      __m256i p10 = _mm256_i32gather_epi32(base, off10, 1);
+      __m256i p11 = _mm256_i32gather_epi32(base, off11, 1);
+
+      // Exact, as in warp_pixel, so the order of the sums doesn't matter
+      __m256 inv_ax = _mm256_sub_ps(one, ax);
+      __m256 inv_ay = _mm256_sub_ps(one, ay);
+      __m256 w00 = _mm256_mul_ps(inv_ax, inv_ay);
+      __m256 w01 = _mm256_mul_ps(ax, inv_ay);
+      __m256 w10 = _mm256_mul_ps(inv_ax, ay);
+      __m256 w11 = _mm256_mul_ps(ax, ay);
+
+      // B, G, R are bytes 0, 1, 2 of each gathered word
+      __m256 levels[3];
+      for (int c = 0; c < 3; c++) {
+        const int shift = c * 8;
+        __m256 v = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p00, shift), byte_mask)), w00);
+        v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p01, shift), byte_mask)), w01));
+        v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p10, shift), byte_mask)), w10));
+        v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p11, shift), byte_mask)), w11));
+        levels[c] = _mm256_floor_ps(_mm256_add_ps(v, half));
+      }
+      store_levels_avx2(out, pixel, levels[2], levels[1], levels[0]);
+    }
+    for (; x < crop_width; x++)
+      warp_pixel(src, M, x, y, block_width, out.r_plane, out.g_plane, out.b_plane, out.offset(y * crop_width + x));
+  }
+}
+#endif
+
+bool detect_avx2() {
+#ifdef ALPR_CROP_KERNEL_AVX2
+  alprsupport::cpu_info_t* info = alprsupport::cpu_detect();
+  if (info == NULL)
+    return false;
+  bool avx2 = alprsupport::has_avx(info) && alprsupport::has_avx2(info);
+  free(info);
+  return avx2;
+#else
+  return false;
+#endif
+}
+}  // namespace
+
+bool crop_kernel_uses_avx2() {
+  static const bool use_avx2 = detect_avx2();
+  return use_avx2;
+}
+
+void crop_homography(const std::vector<float>& corner_points, int crop_width, int crop_height, double dst_to_src[9]) {
+  vector<Point2f> small_corners;
+  small_corners.push_back(Point2f(0, 0));
+  small_corners.push_back(Point2f(crop_width, 0));
+  small_corners.push_back(Point2f(crop_width, crop_height));
+  small_corners.push_back(Point2f(0, crop_height));
+
+  vector<Point2f> big_corners;
+  for (uint32_t z = 0; z + 1 < corner_points.size(); z = z + 2)
+    big_corners.push_back(Point2f(corner_points[z], corner_points[z + 1]));
+
+  // The dst->src matrix warpPerspective would use: the src->dst transform, inverted the way it inverts it
+  cv::Mat transmtx = cv::getPerspectiveTransform(big_corners, small_corners);
+  cv::invert(transmtx, transmtx);
+  for (int r = 0; r < 3; r++) {
+    for (int c = 0; c < 3; c++)
+      dst_to_src[r * 3 + c] = transmtx.at<double>(r, c);
+  }
+}
+
+namespace {
+template<typename T>
+void warp_crop(const cv::Mat& src, const double* M, int crop_width, int crop_height, const CropOutput<T>& out) {
+#ifdef ALPR_CROP_KERNEL_AVX2
+  if (crop_kernel_uses_avx2()) {
+    warp_crop_avx2(src, M, crop_width, crop_height, out);
+    return;
+  }
+#endif
+  warp_crop_scalar(src, M, crop_width, crop_height, out);
+}
+}  // namespace
+
+void warp_crop_to_planar_rgb(const cv::Mat& src, const double dst_to_src[9], int crop_width, int crop_height,
+                             float* dst) {
+  warp_crop(src, dst_to_src, crop_width, crop_height, CropOutput<float>::planar(dst, crop_width, crop_height));
+}
+
+void warp_crop_to_planar_rgb(const cv::Mat& src, const double dst_to_src[9], int crop_width, int crop_height,
+                             uint8_t* dst) {
+  warp_crop(src, dst_to_src, crop_width, crop_height, CropOutput<uint8_t>::planar(dst, crop_width, crop_height));
+}
+
+void warp_crop_to_interleaved(const cv::Mat& src, const double dst_to_src[9], int crop_width, int crop_height,
+                              bool bgr, float* dst) {
+  warp_crop(src, dst_to_src, crop_width, crop_height, CropOutput<float>::interleaved(dst, bgr));
+}
+
+void warp_crop_to_interleaved(const cv::Mat& src, const double dst_to_src[9], int crop_width, int crop_height,
+                              bool bgr, uint8_t* dst) {
+  warp_crop(src, dst_to_src, crop_width, crop_height, CropOutput<uint8_t>::interleaved(dst, bgr));
+}
+
+}  // namespace alpr
@@ -0,0 +1,62 @@
+/*************************************************************************
+ * REKOR RECOGNITION SYSTEMS CONFIDENTIAL
+ *
+ *  Copyright 2020 Rekor Recognition Systems, Inc.
+ *  All Rights Reserved.
+ *
+ * NOTICE:  All information contained herein is, and remains
+ * the property of Rekor Recognition Systems Incorporated. The intellectual
+ * and technical concepts contained herein are proprietary to Rekor Recognition
+ * Systems Incorporated and may be covered by U.S. and Foreign Patents.
+ * patents in process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material
+ * is strictly forbidden unless prior written permission is obtained
+ * from Rekor Recognition Systems Technology Incorporated.
+ */
+
+#ifndef OPENALPR_PREPROCESS_CROP_KERNEL_H_
+#define OPENALPR_PREPROCESS_CROP_KERNEL_H_
+
+#include <opencv2/core/core.hpp>
+#include <stdint.h>
+#include <vector>
+
+namespace alpr {
+
+/*
+  Single pass replacement for warpPerspective -> convertTo(CV_32F) -> split.
+
+  Each output pixel is sampled from `src` (CV_8UC3, BGR) through the 3x3 homography `dst_to_src`
+  (row-major, output crop coordinates -> source image coordinates) with bilinear interpolation and
+  replicated borders, and written straight into the three R, G, B float planes starting at `dst`.
+
+  Interpolation follows warpPerspective(INTER_LINEAR) with an 8 bit destination: source positions are worked out
+  in double in warpPerspective's tile order and quantized to 1/32 of a pixel, and the weights are exact, so each
+  value rounds to the same integer level.  For the matrix crop_homography returns the output matches
+  warpPerspective -> convertTo -> split exactly; ocr_test --crop_check reports the largest difference on real crops.
+  (Built with FMA contraction of scalar double math, positions can differ by 1/32 pixel and values by a level.)
+*/
+void warp_crop_to_planar_rgb(const cv::Mat& src, const double dst_to_src[9], int crop_width, int crop_height,
+                             float* dst);
+// Same planes as uint8, for models that take 8 bit input
+void warp_crop_to_planar_rgb(const cv::Mat& src, const double dst_to_src[9], int crop_width, int crop_height,
+                             uint8_t* dst);
+
+/*
+  NHWC variants for models that transpose (and cast) inside the graph: pixels are written interleaved, three
+  values per pixel, as B, G, R (`bgr`, the source order) or R, G, B.  The values are the same as above.
+*/
+void warp_crop_to_interleaved(const cv::Mat& src, const double dst_to_src[9], int crop_width, int crop_height,
+                              bool bgr, float* dst);
+void warp_crop_to_interleaved(const cv::Mat& src, const double dst_to_src[9], int crop_width, int crop_height,
+                              bool bgr, uint8_t* dst);
+
+// Homography mapping crop coordinates to the source image for the 4 (x, y) corner pairs of an OcrRequestCrop
+void crop_homography(const std::vector<float>& corner_points, int crop_width, int crop_height,
+                     double dst_to_src[9]);
+
+// True when warp_crop_to_planar_rgb is running the AVX2 kernel on this CPU
+bool crop_kernel_uses_avx2();
+
+}  // namespace alpr
+#endif  // OPENALPR_PREPROCESS_CROP_KERNEL_H_
@@ -0,0 +1,146 @@
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+#include "tclap/CmdLine.h"
+#include <alprsupport/config.h>
+#include <alprsupport/filesystem.h>
+#include <alprlog.h>
+#include "postprocess/runtimebundle.h"
+#include "postprocess/runtimedata.h"
+
+using namespace alpr;
+using namespace std;
+
+// Model files the Ocr looks for: ocr_x or ocr_x_<variant>, optionally encrypted as .enc
+bool is_model_file(const std::string& filename, std::string& model_name, bool& encrypted) {
+  encrypted = alprsupport::hasEnding(filename, ".enc");
+  model_name = encrypted ? filename.substr(0, filename.size() - 4) : filename;
+  return model_name.compare(0, 5, "ocr_x") == 0 && model_name.find('.') == std::string::npos;
+}
+
+bool read_file(const std::string& path, std::vector<char>& out) {
+  std::ifstream file(path.c_str(), std::ios::binary);
+  if (!file.is_open())
+    return false;
+  out.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  return true;
+}
+
+int list_bundle(const std::string& path) {
+  RuntimeBundle bundle;
+  if (!bundle.open(path))
+    return 1;
+  const char* type_names[] = {"", "constants", "strings", "model", "model (encrypted)", "patterns"};
+  cout << path << ": version " << RUNTIME_BUNDLE_VERSION << ", " << bundle.getSections().size() << " sections"
+       << endl;
+  cout << "type\tname\toffset\tsize" << endl;
+  for (const RuntimeBundleSection& section : bundle.getSections()) {
+    cout << (section.type < sizeof(type_names) / sizeof(type_names[0]) ? type_names[section.type] : "unknown")
+         << "\t" << section.name << "\t" << section.offset << "\t" << section.size << endl;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  std::string ocr_dir;
+  std::string patterns_dir;
+  std::vector<std::string> countries;
+  std::string output;
+
+  TCLAP::CmdLine cmd("Packs an OCR runtime directory into runtime.bundle", ' ', "1.0.0");
+  TCLAP::UnlabeledMultiArg<string> countriesArg("country", "Countries whose .patterns are compiled into the bundle", false, "country");
+  TCLAP::ValueArg<std::string> ocrDirArg("","ocr_dir","Directory with ocr_config.json and the ocr_x models", true, "", "dir");
+  TCLAP::ValueArg<std::string> patternsDirArg("","patterns_dir","Directory with the <country>.patterns files. Default=the configured postprocess runtime dir", false, "", "dir");
+  TCLAP::ValueArg<std::string> outputArg("o","output","Bundle to write. Default=<ocr_dir>/runtime.bundle", false, "", "file");
+  TCLAP::SwitchArg listArg("","list","Print the table of contents of the bundle instead of writing it", false);
+
+  try {
+    cmd.add(countriesArg);
+    cmd.add(ocrDirArg);
+    cmd.add(patternsDirArg);
+    cmd.add(outputArg);
+    cmd.add(listArg);
+
+    if (cmd.parse(argc, argv) == false) {
+      // Error occurred while parsing. Exit now.
+      return 1;
+    }
+
+    ocr_dir = ocrDirArg.getValue();
+    patterns_dir = patternsDirArg.getValue();
+    countries = countriesArg.getValue();
+    output = outputArg.getValue();
+  } catch (TCLAP::ArgException &e) {
+    std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+    return 1;
+  }
+
+  // Setup logging to console
+  AlprLog::instance()->setParameters("alpr", false, "", 0, 0);
+  AlprLog::instance()->setLogLevel(ALPRINFO);
+
+  if (output.empty())
+    output = ocr_dir + "/runtime.bundle";
+  if (listArg.getValue())
+    return list_bundle(output);
+  if (countries.empty())
+    countries.push_back("us");
+
+  // Templates are compiled for each country's letter / number classes; the OCR tables are the same for all of them
+  RuntimeBundleWriter writer;
+  std::shared_ptr<const RuntimeData> data;
+  for (const std::string& country : countries) {
+    Config config(country, "", "");
+    std::string country_patterns_dir = patterns_dir.empty() ? config.getPostProcessRuntimeDir() : patterns_dir;
+    data = RuntimeData::loadSources(ocr_dir, country_patterns_dir, country, config.postProcessRegexLetters,
+                                    config.postProcessRegexNumbers);
+    if (data == NULL)
+      return 1;
+    if (data->patternMatcher().empty()) {
+      cerr << "No templates for " << country << " in " << country_patterns_dir << endl;
+      return 1;
+    }
+    std::vector<char> compiled;
+    data->patternMatcher().save(compiled);
+    writer.add(BUNDLE_PATTERNS, country, compiled.data(), compiled.size());
+  }
+
+  writer.add(BUNDLE_CONSTANTS, "ocr", &data->ocrConstants(), sizeof(OcrRuntimeConstants));
+  writer.addStrings("idx2char", data->charTokens());
+  writer.addStrings("region_idx2name", data->regionTokens());
+  writer.addStrings("sequence_length_output", std::vector<std::string>(1, data->sequenceLengthOutput()));
+
+  std::vector<std::string> model_inputs;
+  OcrModelInput default_input = data->modelInput("");
+  model_inputs.push_back("");
+  model_inputs.push_back(default_input.layout);
+  model_inputs.push_back(default_input.channel_order);
+  int num_models = 0;
+  for (const std::string& filename : alprsupport::getFilesInDir(ocr_dir.c_str())) {
+    std::string model_name;
+    bool encrypted;
+    if (!is_model_file(filename, model_name, encrypted))
+      continue;
+    std::vector<char> model;
+    if (!read_file(ocr_dir + "/" + filename, model)) {
+      cerr << "Unable to read " << ocr_dir << "/" << filename << endl;
+      return 1;
+    }
+    writer.add(encrypted ? BUNDLE_MODEL_ENCRYPTED : BUNDLE_MODEL, model_name, model.data(), model.size());
+    OcrModelInput input = data->modelInput(model_name);
+    model_inputs.push_back(model_name);
+    model_inputs.push_back(input.layout);
+    model_inputs.push_back(input.channel_order);
+    num_models++;
+  }
+  writer.addStrings("model_inputs", model_inputs);
+  if (num_models == 0)
+    cerr << "Warning: no ocr_x models in " << ocr_dir << "; the Ocr will look for them next to the bundle" << endl;
+
+  if (!writer.write(output))
+    return 1;
+  return list_bundle(output);
+}
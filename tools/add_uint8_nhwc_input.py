@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+#
+# Copyright 2020 Rekor Recognition Systems, Inc.  All Rights Reserved.
+#
+"""Prefixes the OCR graph so it takes uint8 NHWC BGR crops, as they come out of the warp.
+
+The fp32 ocr_x takes float RGB planes ([N, 3, H, W]), which makes the preprocessor write four bytes per value and
+transpose every pixel.  This adds Cast -> Transpose -> channel swap in front of the original input, so the
+conversion runs inside ORT, and flags the layout for that model under "model_inputs" in ocr_config.json:
+
+    tools/add_uint8_nhwc_input.py runtime/ocr_x runtime/ocr_x_nhwc --config runtime/ocr_config.json
+    ocr_test --model_variant nhwc samples/*.png
+
+The model must be the plain (unencrypted) ONNX file.
+"""
+
+import argparse
+import json
+import os
+
+import onnx
+from onnx import TensorProto, helper
+
+
+def add_prefix(model, keep_float):
+    graph = model.graph
+    initializer_names = {init.name for init in graph.initializer}
+    inputs = [i for i in graph.input if i.name not in initializer_names]
+    if len(inputs) != 1:
+        raise SystemExit("expected a single graph input, found %d" % len(inputs))
+    original = inputs[0]
+    dims = original.type.tensor_type.shape.dim
+    if len(dims) != 4 or dims[1].dim_value != 3:
+        raise SystemExit("expected an [N, 3, H, W] input, got %s" % original.type.tensor_type.shape)
+    name = original.name
+    batch = dims[0].dim_param or dims[0].dim_value or "batch"
+    height = dims[2].dim_value
+    width = dims[3].dim_value
+
+    # The original consumers now read the end of the prefix
+    planar = name + "_rgb_planes"
+    for node in graph.node:
+        for i, node_input in enumerate(node.input):
+            if node_input == name:
+                node.input[i] = planar
+    for output in graph.output:
+        if output.name == name:
+            raise SystemExit("the graph input is also an output")
+
+    prefix = []
+    as_float = name
+    if not keep_float:
+        as_float = name + "_float"
+        prefix.append(helper.make_node("Cast", [name], [as_float], to=TensorProto.FLOAT, name=name + "_cast"))
+    bgr_planes = name + "_bgr_planes"
+    prefix.append(helper.make_node("Transpose", [as_float], [bgr_planes], perm=[0, 3, 1, 2],
+                                   name=name + "_to_nchw"))
+    swap = name + "_bgr_to_rgb"
+    graph.initializer.append(helper.make_tensor(swap, TensorProto.INT64, [3], [2, 1, 0]))
+    prefix.append(helper.make_node("Gather", [bgr_planes, swap], [planar], axis=1, name=name + "_swap"))
+
+    nodes = prefix + list(graph.node)
+    del graph.node[:]
+    graph.node.extend(nodes)
+
+    graph.input.remove(original)
+    elem_type = TensorProto.FLOAT if keep_float else TensorProto.UINT8
+    graph.input.insert(0, helper.make_tensor_value_info(name, elem_type, [batch, height, width, 3]))
+    return model
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("model", help="OCR model taking float [N, 3, H, W] RGB planes")
+    parser.add_argument("output", help="model to write (e.g. runtime/ocr_x_nhwc)")
+    parser.add_argument("--config", help="ocr_config.json to record the new model's input format in")
+    parser.add_argument("--keep_float", action="store_true",
+                        help="take float NHWC instead of uint8 (e.g. for a model quantized with a float input)")
+    args = parser.parse_args()
+
+    model = add_prefix(onnx.load(args.model), args.keep_float)
+    onnx.checker.check_model(model)
+    onnx.save(model, args.output)
+    print("Wrote %s" % args.output)
+
+    if args.config:
+        with open(args.config) as f:
+            config = json.load(f)
+        model_name = os.path.basename(args.output)
+        if model_name.endswith(".enc"):
+            model_name = model_name[:-len(".enc")]
+        config.setdefault("model_inputs", {})[model_name] = {"input_layout": "NHWC", "input_channel_order": "BGR"}
+        with open(args.config, "w") as f:
+            json.dump(config, f)
+        print("Flagged %s as NHWC / BGR in %s" % (model_name, args.config))
+
+
+if __name__ == "__main__":
+    main()
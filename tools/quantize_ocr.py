@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+#
+# Copyright 2020 Rekor Recognition Systems, Inc.  All Rights Reserved.
+#
+"""Builds the statically quantized ocr_x_int8 model from the fp32 ocr_x.
+
+Calibration samples come from ocr_test, so the quantizer sees exactly the tensors Ocr feeds the network:
+
+    ocr_test --export_calibration calib/ samples/*.png
+    tools/quantize_ocr.py runtime/ocr_x calib/ runtime/ocr_x_int8
+    ocr_test --compare_variant int8 samples/*.png
+
+The model must be the plain (unencrypted) ONNX file; encrypt the result with encdecfile if the deployment
+expects ocr_x_int8.enc.
+"""
+
+import argparse
+import json
+import os
+
+import numpy as np
+from onnxruntime.quantization import (CalibrationDataReader, CalibrationMethod, QuantFormat, QuantType,
+                                      quantize_static)
+
+
+class OcrCalibrationReader(CalibrationDataReader):
+    """Feeds the calib_NNNNN.raw tensors listed in calibration.json one at a time."""
+
+    def __init__(self, calibration_dir):
+        with open(os.path.join(calibration_dir, "calibration.json")) as f:
+            index = json.load(f)
+        self.input_name = index["input_name"]
+        self.shape = index["shape"]
+        self.paths = [os.path.join(calibration_dir, name) for name in index["files"]]
+        self.position = 0
+
+    def get_next(self):
+        if self.position >= len(self.paths):
+            return None
+        tensor = np.fromfile(self.paths[self.position], dtype=np.float32).reshape(self.shape)
+        self.position += 1
+        return {self.input_name: tensor}
+
+    def rewind(self):
+        self.position = 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("model", help="fp32 ocr_x model")
+    parser.add_argument("calibration_dir", help="directory written by ocr_test --export_calibration")
+    parser.add_argument("output", help="quantized model to write (e.g. runtime/ocr_x_int8)")
+    parser.add_argument("--format", choices=["qdq", "qoperator"], default="qdq",
+                        help="QDQ keeps the graph structure and lets ORT fuse; QOperator uses the integer ops directly")
+    parser.add_argument("--method", choices=["minmax", "entropy", "percentile"], default="minmax")
+    parser.add_argument("--per_tensor", action="store_true", help="one weight scale per tensor instead of per channel")
+    args = parser.parse_args()
+
+    reader = OcrCalibrationReader(args.calibration_dir)
+    print("Calibrating on %d samples" % len(reader.paths))
+    quantize_static(args.model, args.output, reader,
+                    quant_format=QuantFormat.QDQ if args.format == "qdq" else QuantFormat.QOperator,
+                    calibrate_method={"minmax": CalibrationMethod.MinMax,
+                                      "entropy": CalibrationMethod.Entropy,
+                                      "percentile": CalibrationMethod.Percentile}[args.method],
+                    per_channel=not args.per_tensor,
+                    activation_type=QuantType.QUInt8,
+                    weight_type=QuantType.QInt8)
+    print("Wrote %s" % args.output)
+
+
+if __name__ == "__main__":
+    main()